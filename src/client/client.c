@@ -1,30 +1,54 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include "../common/common.h"
 #include "../common/cdf.h"
+#include "../common/alias.h"
 #include "../common/conn.h"
+#include "../common/receiver.h"
+#include "../common/clock.h"
+#include "../common/flow_log.h"
+#include "../common/flow_stats.h"
+#include "../common/pacing.h"
 
 bool verbose_mode = false;  /* by default, we don't give more detailed output */
+unsigned int num_receivers = TG_DEFAULT_RECEIVERS;  /* number of threads receiving traffic from all connections */
+unsigned int num_generators = TG_DEFAULT_GENERATORS;    /* number of threads generating requests */
 
 char config_file_name[80] = {0};    /* configuration file */
 char dist_file_name[80] = {0};  /* flow size distribution file */
 char fct_log_name[80] = "flows.txt";    /* default log file */
 int seed = 0;   /* random seed */
 char result_script_name[80] = {0};  /* script file to parse final results */
-unsigned int usleep_overhead_us = 0;    /* usleep overhead in microsecond */
-struct timeval tv_start, tv_end;    /* start and end time of traffic */
-unsigned int num_new_conn = 0;  /* new established connections */
+enum wait_mode wait_mode = TG_WAIT_SLEEP;   /* how generators wait for request arrivals */
+enum log_format log_format = TG_LOG_TEXT;   /* format of the FCT log */
+bool stream_mode = false;   /* sample requests when they are generated instead of before traffic starts */
+unsigned long long traffic_start_ns, traffic_end_ns;    /* start and end time of traffic (CLOCK_MONOTONIC) */
+atomic_uint num_new_conn;   /* new established connections */
+struct flow_stats *fct_stats = NULL;    /* FCT and goodput histograms of completed flows */
+unsigned int report_interval_ms = 0;    /* interval between two live reports (0: no report) */
+unsigned int closed_users[TG_CLOSED_MAX_LEVELS];    /* closed loop: virtual users per server at each level */
+unsigned int num_closed_levels = 0; /* number of concurrency levels (0: open loop) */
+unsigned int think_time_us = 0; /* closed loop: average think time between two requests of a user */
+unsigned int conn_depth = 1;    /* maximum number of outstanding requests per connection */
+bool mux_mode = false;  /* let the server interleave the responses of outstanding requests as frames */
+unsigned int max_conn = 0;  /* maximum number of connections per server (0: no limit) */
+bool prewarm_mode = false;  /* open the connections needed at the target load before traffic starts */
 
 /* per-server variables */
 unsigned int num_server = 0;    /* total number of servers */
@@ -41,23 +65,89 @@ unsigned int num_rate = 0;  /* number of sending rates */
 unsigned int *rate_value = NULL;
 unsigned int *rate_prob = NULL;
 unsigned int rate_prob_total = 0;
+struct alias_table dscp_dist;   /* sampler of DSCP values */
+struct alias_table rate_dist;   /* sampler of sending rates */
 
 double load = -1;   /* network load (Mbps) */
 unsigned int req_total_num = 0; /* total number of requests to generate */
 unsigned int req_total_time = 0;    /* total time to generate requests (in seconds) */
 struct cdf_table *req_size_dist = NULL;
-unsigned int period_us; /* average request arrival interval (in microseconds) */
+double period_ns; /* average request arrival interval (in nanoseconds) */
 
-/* per-request variables */
+/* a request sampled from the workload */
+struct request
+{
+    unsigned int size;  /* flow size (in bytes) */
+    unsigned int server_id; /* server ID */
+    unsigned int dscp;  /* DSCP of flow */
+    unsigned int rate;  /* sending rate of flow */
+    double interval_ns; /* time since the previous request of the same generator */
+};
+
+/* per-request variables (not used in streaming mode) */
 unsigned int *req_size = NULL;  /* flow size (in bytes) */
 unsigned int *req_server_id = NULL; /* server ID */
 unsigned int *req_dscp = NULL;  /* DSCP of flow */
 unsigned int *req_rate = NULL;  /* sending rate of flow */
-unsigned int *req_sleep_us = NULL;  /* sleep time interval */
-struct timeval *req_start_time; /* start time of flow */
-struct timeval *req_stop_time;  /* stop time of flow */
+double *req_arrival_ns = NULL;  /* arrival time relative to the start of its generator (in nanoseconds) */
 
-struct conn_list *connection_lists = NULL;  /* connection pool */
+struct vuser;
+
+/* a thread generating an independent Poisson stream of requests with its own connection pools */
+struct generator
+{
+    unsigned int id;
+    pthread_t thread;
+    unsigned int seed;  /* random seed of the stream */
+    unsigned int rand_state;    /* state of rand_r() */
+    unsigned int req_first; /* ID of the first request of the stream */
+    unsigned int req_num;   /* number of requests of the stream (unknown in streaming mode with -t) */
+    unsigned long long req_count;   /* number of requests generated so far */
+    unsigned long long req_size_total;  /* total size of requests generated so far */
+    struct conn_list *lists;    /* connection pools to all servers */
+    struct precise_clock clock; /* hybrid sleep/spin wait */
+    unsigned long long late_ns_total;   /* total time requests are generated after their arrival time */
+    unsigned long long late_ns_max; /* maximum time a request is generated after its arrival time */
+    _Atomic(struct vuser*) done_head;   /* closed loop: users whose request has completed (pushed by receivers) */
+    int done_fd;    /* closed loop: eventfd signaled when done_head becomes non-empty (-1: none) */
+    struct timer_wheel *wheel;  /* closed loop: think times of users */
+};
+
+/* a virtual user of the closed loop, issuing a request when its previous one has completed */
+struct vuser
+{
+    struct wheel_entry timer;   /* end of the think time (first, so that entries are users) */
+    unsigned int id;    /* flow ID - 1 of its requests */
+    unsigned int server_id; /* server of its requests */
+    struct generator *g;    /* generator of its requests */
+    struct vuser *done_next;    /* next user in the done stack of the generator */
+};
+
+/* results of a concurrency level of the closed loop */
+struct closed_level
+{
+    unsigned long long duration_ns;
+    atomic_ullong num_flow; /* flows completed */
+    atomic_ullong bytes;    /* bytes of flows completed */
+    struct histogram fct;   /* FCT of flows completed (us) */
+};
+
+struct generator *generators = NULL;    /* request generators */
+pthread_barrier_t generator_barrier;    /* generators start together after calibration */
+struct conn_list *connection_lists = NULL;  /* connection pools (num_server per generator) */
+struct vuser *vusers = NULL;    /* closed loop: virtual users of the largest level */
+struct closed_level *closed_levels = NULL;  /* closed loop: results of each level */
+atomic_uint cur_level;  /* closed loop: level being run */
+
+/* live statistics, reported every report_interval_ms */
+atomic_ullong flow_started;    /* flow requests generated so far */
+atomic_ullong flow_completed;  /* flows completed so far */
+atomic_ullong rx_bytes; /* bytes of flows completed so far */
+struct interval_histogram interval_fct; /* FCT of flows completed in the current interval */
+pthread_t reporter_thread;  /* thread printing live statistics */
+bool reporter_stop = false; /* whether the reporter should stop */
+pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;  /* protect reporter_stop */
+pthread_cond_t reporter_cond;   /* signaled to stop the reporter (CLOCK_MONOTONIC) */
 
 /* print usage of the program */
 void print_usage(char *program);
@@ -67,12 +157,52 @@ void read_args(int argc, char *argv[]);
 void read_config(char *file_name);
 /* set request variables */
 void set_req_variables();
-/* receive traffic from established connections */
-void *listen_connection(void *ptr);
-/* generate flow requests */
+/* sample the next request of a generator */
+void gen_request(struct generator *g, struct request *req);
+/* complete a flow received on a connection (called by receiver threads) */
+void flow_done(struct conn_node *node, struct flow_metadata *flow);
+/* use a connection established in the background (called by receiver threads) */
+void conn_ready(struct conn_node *node, bool connected);
+/* replace an established connection closed while requests wait for one (called by receiver threads) */
+void conn_closed(struct conn_node *node);
+/* open a connection in the background for a waiting request unless one is on its way or the pool is at its cap */
+void open_pending_conn(struct conn_list *list);
+/* send waiting requests on a held connection while it has room, then give the connection back to the pool */
+void serve_conn(struct conn_node *node);
+/* send a flow request that has waited 'wait_ns' for a held connection and record its start time */
+void send_flow_req(struct conn_node *node, struct flow_metadata *flow, unsigned long long wait_ns);
+/* generate flow requests with all generators */
 void run_requests();
+/* main loop of a generator */
+void *run_generator(void *ptr);
 /* generate a flow request to the server */
-void run_request(unsigned int req_id);
+void run_request(struct generator *g, unsigned int server_id, struct flow_metadata *flow);
+/* a flow request is dropped as no connection can be established for it */
+void drop_flow(struct flow_metadata *flow);
+/* parse a comma-separated list of virtual users per server, return false if it fails */
+bool parse_closed_levels(char *arg);
+/* create virtual users and their signaling */
+void init_closed_loop();
+/* main loop of a generator in the closed loop */
+void run_closed_loop(struct generator *g);
+/* issue the next request of a virtual user */
+void run_vuser(struct vuser *u);
+/* let the generator of a virtual user know that its request has completed (called by receiver threads) */
+void vuser_done(struct vuser *u);
+/* print the results of all the levels of the closed loop */
+void print_closed_levels();
+/* queue the FCT of a completed flow for the log writer */
+void log_flow(struct conn_node *node, struct flow_metadata *flow, unsigned long long stop_ns);
+/* start the thread printing live statistics */
+void start_reporter();
+/* stop the thread printing live statistics */
+void stop_reporter();
+/* main loop of the reporter */
+void *run_reporter(void *ptr);
+/* measure the RTT to a server with empty flows on an idle connection (ns, 0 if it fails) */
+unsigned long long probe_rtt(struct conn_node *node);
+/* open the connections expected to be busy at the target load (Little's law) before traffic starts */
+void prewarm_pools();
 /* terminate all existing connections */
 void exit_connections();
 /* terminate a connection */
@@ -86,70 +216,89 @@ int main(int argc, char *argv[])
 {
     unsigned int i = 0;
     struct conn_node *ptr = NULL;
+    struct timeval tv;
 
     /* read program arguments */
     read_args(argc, argv);
 
-    /* set seed value for random number generation */
+    /* set seed value for random number generation (generator i uses seed + i) */
     if (seed == 0)
     {
-        gettimeofday(&tv_start, NULL);
-        srand((tv_start.tv_sec*1000000) + tv_start.tv_usec);
+        gettimeofday(&tv, NULL);
+        seed = (tv.tv_sec*1000000) + tv.tv_usec;
     }
-    else
-        srand(seed);
 
     /* read configuration file */
     read_config(config_file_name);
     /* set request variables */
     set_req_variables();
 
-    /* calculate usleep overhead */
-    usleep_overhead_us = get_usleep_overhead(20);
-    if (verbose_mode)
+    /* flows are logged as they complete, start the writer before other threads (to take SIGINT and SIGTERM) */
+    if (!init_flow_log(fct_log_name, log_format, true))
     {
-        printf("===========================================\n");
-        printf("The usleep overhead is %u us\n", usleep_overhead_us);
-        printf("===========================================\n");
+        cleanup();
+        error("Error: init_flow_log");
+    }
+
+    /* statistics of flows are kept as they complete */
+    fct_stats = new_flow_stats();
+    if (!fct_stats)
+    {
+        cleanup();
+        error("Error: new_flow_stats");
+    }
+
+    /* start threads to receive traffic */
+    if (!init_receivers(num_receivers, flow_done, conn_ready, conn_closed))
+    {
+        cleanup();
+        error("Error: init_receivers");
     }
 
     /* we use calloc here to implicitly initialize struct conn_list as 0 */
-    connection_lists = (struct conn_list*)calloc(num_server, sizeof(struct conn_list));
+    connection_lists = (struct conn_list*)calloc(num_generators * num_server, sizeof(struct conn_list));
     if (!connection_lists)
     {
         cleanup();
         error("Error: calloc connection_lists");
     }
+    for (i = 0; i < num_generators; i++)
+        generators[i].lists = &connection_lists[i * num_server];
+    if (num_closed_levels > 0)
+        init_closed_loop();
 
-    /* initialize connection pool and establish connections to servers */
-    for (i = 0; i < num_server; i++)
+    /* initialize connection pools and establish connections to servers */
+    for (i = 0; i < num_generators * num_server; i++)
     {
         /* initialize server IP and port information */
-        if (!init_conn_list(&connection_lists[i], i, server_addr[i], server_port[i]))
+        if (!init_conn_list(&connection_lists[i], i % num_server, server_addr[i % num_server], server_port[i % num_server]) ||
+            !set_conn_list_depth(&connection_lists[i], conn_depth, mux_mode))
         {
             cleanup();
             error("Error: init_conn_list");
         }
-        /* establish TG_PAIR_INIT_CONN connections to server_addr[i]:server_port[i] */
-        if (!insert_conn_list(&connection_lists[i], TG_PAIR_INIT_CONN))
+        /* the cap of a server is shared by the pools of all generators */
+        if (max_conn > 0)
+            set_conn_list_max(&connection_lists[i], max((max_conn + num_generators - 1) / num_generators, 1));
+        /* establish TG_PAIR_INIT_CONN connections to the server */
+        if (!insert_conn_list(&connection_lists[i], (max_conn > 0) ? min(TG_PAIR_INIT_CONN, connection_lists[i].max_len) : TG_PAIR_INIT_CONN))
         {
             cleanup();
             error("Error: insert_conn_list");
         }
     }
+    if (prewarm_mode)
+        prewarm_pools();
 
-    /* start threads to receive traffic */
-    for (i = 0; i < num_server; i++)
+    /* receive traffic from established connections */
+    for (i = 0; i < num_generators * num_server; i++)
     {
-        ptr = connection_lists[i].head;
-        while (true)
+        for (ptr = connection_lists[i].head; ptr; ptr = ptr->next)
         {
-            if (!ptr)
-                break;
-            else
+            if (!receiver_add_conn(ptr))
             {
-                pthread_create(&(ptr->thread), NULL, listen_connection, (void*)ptr);
-                ptr = ptr->next;
+                cleanup();
+                error("Error: receiver_add_conn");
             }
         }
     }
@@ -157,7 +306,9 @@ int main(int argc, char *argv[])
     printf("===========================================\n");
     printf("Start to generate requests\n");
     printf("===========================================\n");
-    gettimeofday(&tv_start, NULL);
+    traffic_start_ns = get_mono_ns();
+    if (report_interval_ms > 0)
+        start_reporter();
     run_requests();
 
     /* close existing connections */
@@ -165,11 +316,17 @@ int main(int argc, char *argv[])
     printf("Exit connections\n");
     printf("===========================================\n");
     exit_connections();
-    gettimeofday(&tv_end, NULL);
+    traffic_end_ns = get_mono_ns();
+    if (report_interval_ms > 0)
+        stop_reporter();
 
     printf("===========================================\n");
-    for (i = 0; i < num_server; i++)
+    for (i = 0; i < num_generators * num_server; i++)
+    {
+        if (num_generators > 1 && i % num_server == 0)
+            printf("Generator %u:\n", i / num_server);
         print_conn_list(&connection_lists[i]);
+    }
     printf("===========================================\n");
     print_statistic();
 
@@ -199,8 +356,25 @@ void print_usage(char *program)
     printf("-n <number>     number of requests (instead of -t)\n");
     printf("-t <time>       time in seconds (instead of -n)\n");
     printf("-l <file>       log file with flow completion times (default %s)\n", fct_log_name);
+    printf("-o <format>     format of the log file: text, text-ns (FCT in ns as the last column), text-ext\n");
+    printf("                (text-ns with TTFB, transfer time and wait) or binary (default %s)\n", log_format_name(TG_LOG_TEXT));
     printf("-s <seed>       seed to generate random numbers (default current time)\n");
     printf("-r <file>       python script to parse result files\n");
+    printf("-w <num>        threads receiving traffic from all connections (default %d)\n", TG_DEFAULT_RECEIVERS);
+    printf("-m              stream requests: sample each request when it is generated and log each flow\n");
+    printf("                when it completes, so memory does not grow with the number of requests\n");
+    printf("-g <num>        threads generating requests, each an independent Poisson stream (default %d)\n", TG_DEFAULT_GENERATORS);
+    printf("-p <mode>       wait for request arrivals: sleep, spin (sleep then busy-poll) or rt (spin with\n");
+    printf("                mlockall and SCHED_FIFO) (default %s)\n", wait_mode_name(TG_WAIT_SLEEP));
+    printf("-i <ms>         print live statistics every <ms> milliseconds (default no)\n");
+    printf("-k <users>      closed loop with <users> virtual users per server instead of Poisson arrivals (-b is\n");
+    printf("                not needed). A comma-separated list (e.g. 1,4,16) runs each level for -t s or -n requests\n");
+    printf("-u <us>         average think time of virtual users (exponential) (default 0)\n");
+    printf("-d <depth>      outstanding requests per connection, answered in order (pipelining) (default 1,\n");
+    printf("                max %d)\n", TG_MAX_DEPTH);
+    printf("-x              multiplex outstanding requests: the server interleaves their responses as frames\n");
+    printf("-C <num>        at most <num> connections per server, requests wait in a FIFO queue (default no limit)\n");
+    printf("-W              prewarm: open the connections needed at the target load before traffic starts\n");
     printf("-v              give more detailed output (verbose)\n");
     printf("-h              display help information\n");
 }
@@ -323,6 +497,144 @@ void read_args(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
         }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-w") == 0)
+        {
+            if (i+1 < argc && (unsigned int)strtoul(argv[i+1], NULL, 10) > 0)
+            {
+                num_receivers = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read number of receiver threads\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-o") == 0)
+        {
+            if (i+1 < argc && parse_log_format(argv[i+1], &log_format))
+            {
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read log format\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-m") == 0)
+        {
+            stream_mode = true;
+            i++;
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-g") == 0)
+        {
+            if (i+1 < argc && (unsigned int)strtoul(argv[i+1], NULL, 10) > 0)
+            {
+                num_generators = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read number of generator threads\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-p") == 0)
+        {
+            if (i+1 < argc && parse_wait_mode(argv[i+1], &wait_mode))
+            {
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read wait mode\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-i") == 0)
+        {
+            if (i+1 < argc)
+            {
+                report_interval_ms = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read report interval\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-k") == 0)
+        {
+            if (i+1 < argc && parse_closed_levels(argv[i+1]))
+            {
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read virtual users per server\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-u") == 0)
+        {
+            if (i+1 < argc)
+            {
+                think_time_us = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read think time\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-d") == 0)
+        {
+            if (i+1 < argc && (unsigned int)strtoul(argv[i+1], NULL, 10) > 0 && (unsigned int)strtoul(argv[i+1], NULL, 10) <= TG_MAX_DEPTH)
+            {
+                conn_depth = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read outstanding requests per connection\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-x") == 0)
+        {
+            mux_mode = true;
+            i++;
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-C") == 0)
+        {
+            if (i+1 < argc)
+            {
+                max_conn = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read maximum number of connections per server\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-W") == 0)
+        {
+            prewarm_mode = true;
+            i++;
+        }
         else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-v") == 0)
         {
             verbose_mode = true;
@@ -341,7 +653,8 @@ void read_args(int argc, char *argv[])
         }
     }
 
-    if (load < 0)
+    /* the closed loop has no arrival rate */
+    if (load < 0 && num_closed_levels == 0)
     {
         printf("You need to specify the average RX bandwidth (-b)\n");
         error = true;
@@ -532,25 +845,38 @@ void read_config(char *file_name)
             printf("Rate: %uMbps, Prob: %u\n", rate_value[0], rate_prob[0]);
     }
 
+    /* samplers built once from the configuration */
+    if (!init_alias_table(&dscp_dist, dscp_value, dscp_prob, num_dscp) || !init_alias_table(&rate_dist, rate_value, rate_prob, num_rate))
+    {
+        cleanup();
+        error("Error: init_alias_table");
+    }
+
 }
 
 /* set request variables */
 void set_req_variables()
 {
-    int i = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    struct generator *g = NULL;
+    struct request req;
     unsigned long req_size_total = 0;
-    unsigned long req_interval_total = 0;
+    double req_interval_total = 0;  /* ns */
+    double duration_ns = 0; /* arrival time of the last request */
     unsigned long rate_total = 0;
     double dscp_total = 0;
 
-    /* calculate average request arrival interval */
-    if (load > 0)
+    /* calculate average request arrival interval (the closed loop has none) */
+    if (num_closed_levels > 0)
+        period_ns = 0;
+    else if (load > 0)
     {
-        period_us = avg_cdf(req_size_dist) * 8 / load / TG_GOODPUT_RATIO;
-        if (period_us <= 0)
+        period_ns = avg_cdf(req_size_dist) * 8000 / load / TG_GOODPUT_RATIO;
+        if (period_ns <= 0)
         {
             cleanup();
-            error("Error: period_us is not positive");
+            error("Error: period_ns is not positive");
         }
     }
     else
@@ -559,38 +885,94 @@ void set_req_variables()
         error("Error: load is not positive");
     }
 
-    /* transfer time to the number of requests */
-    if (req_total_num == 0 && req_total_time > 0)
-        req_total_num = max((unsigned long)req_total_time * 1000000 / period_us, 1);
+    /* transfer time to the number of requests (in streaming mode and the closed loop, generators stop when the time is up) */
+    if (req_total_num == 0 && req_total_time > 0 && !stream_mode && num_closed_levels == 0)
+        req_total_num = max((unsigned long)(req_total_time * 1000000000.0 / period_ns), 1);
+
+    /* each generator is an independent Poisson stream at 1/num_generators of the rate with its own seed */
+    generators = (struct generator*)calloc(num_generators, sizeof(struct generator));
+    if (!generators)
+    {
+        cleanup();
+        error("Error: calloc generators");
+    }
+
+    for (j = 0; j < num_generators; j++)
+    {
+        g = &generators[j];
+        g->id = j;
+        g->seed = seed + j;
+        g->rand_state = g->seed;
+        g->done_fd = -1;
+        g->req_first = (j > 0) ? generators[j - 1].req_first + generators[j - 1].req_num : 0;
+        g->req_num = req_total_num / num_generators + ((j < req_total_num % num_generators) ? 1 : 0);
+        if (verbose_mode && num_generators > 1)
+            printf("Generator %u: %u requests, seed %u\n", j, g->req_num, g->seed);
+    }
+
+    /* virtual users sample their requests on the fly */
+    if (num_closed_levels > 0)
+    {
+        printf("===========================================\n");
+        printf("Closed loop with");
+        for (i = 0; i < num_closed_levels; i++)
+            printf("%s %u", (i > 0) ? "," : "", closed_users[i]);
+        printf(" virtual users per server and %u us average think time\n", think_time_us);
+        if (req_total_num > 0)
+            printf("Each level generates %u requests\n", req_total_num);
+        else
+            printf("Each level lasts %u s\n", req_total_time);
+        return;
+    }
+
+    /* requests are sampled by generators */
+    if (stream_mode)
+    {
+        printf("===========================================\n");
+        if (req_total_num > 0)
+            printf("We generate %u requests in total (sampled on the fly)\n", req_total_num);
+        else
+            printf("We generate requests for %u s (sampled on the fly)\n", req_total_time);
+        printf("The average request arrival interval is %.3f us\n", period_ns/1000);
+        printf("The expected experiment duration is %lu s\n",
+               (req_total_num > 0) ? (unsigned long)(req_total_num * period_ns / 1000000000) : req_total_time);
+        return;
+    }
 
     /* request variables */
     req_size = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
     req_server_id = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
     req_dscp = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
     req_rate = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
-    req_sleep_us = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
-    req_start_time = (struct timeval*)calloc(req_total_num, sizeof(struct timeval));
-    req_stop_time = (struct timeval*)calloc(req_total_num, sizeof(struct timeval));
+    req_arrival_ns = (double*)calloc(req_total_num, sizeof(double));
 
-    if (!req_size || !req_server_id || !req_dscp || !req_rate || !req_sleep_us || !req_start_time || !req_stop_time)
+    if (!req_size || !req_server_id || !req_dscp || !req_rate || !req_arrival_ns)
     {
         cleanup();
         error("Error: calloc per-request variables");
     }
 
-    for (i = 0; i < req_total_num; i++)
+    for (j = 0; j < num_generators; j++)
     {
-        req_size[i] = gen_random_cdf(req_size_dist);    /* flow size */
-        req_server_id[i] = rand() % num_server; /* server ID */
-        server_req_count[req_server_id[i]]++;   /* per-server request number */
-        req_dscp[i] = gen_value_weight(dscp_value, dscp_prob, num_dscp, dscp_prob_total);    /* flow DSCP */
-        req_rate[i] = gen_value_weight(rate_value, rate_prob, num_rate, rate_prob_total);   /* flow sending rate */
-        req_sleep_us[i] = poission_gen_interval(1.0/period_us); /* sleep interval based on poission process */
+        g = &generators[j];
+        for (i = g->req_first; i < g->req_first + g->req_num; i++)
+        {
+            gen_request(g, &req);
+            req_size[i] = req.size;
+            req_server_id[i] = req.server_id;
+            server_req_count[req.server_id]++;  /* per-server request number */
+            req_dscp[i] = req.dscp;
+            req_rate[i] = req.rate;
+            req_arrival_ns[i] = (i > g->req_first) ? req_arrival_ns[i - 1] + req.interval_ns : req.interval_ns;
+
+            req_size_total += req.size;
+            req_interval_total += req.interval_ns;
+            dscp_total += req.dscp;
+            rate_total += req.rate;
+        }
 
-        req_size_total += req_size[i];
-        req_interval_total += req_sleep_us[i];
-        dscp_total += req_dscp[i];
-        rate_total += req_rate[i];
+        if (g->req_num > 0)
+            duration_ns = max(duration_ns, req_arrival_ns[g->req_first + g->req_num - 1]);
     }
 
     printf("===========================================\n");
@@ -600,138 +982,685 @@ void set_req_variables()
         printf("%s:%u    %u requests\n", server_addr[i], server_port[i], server_req_count[i]);
 
     printf("===========================================\n");
-    printf("The average request arrival interval is %lu us\n", req_interval_total/req_total_num);
+    printf("The average request arrival interval is %.3f us\n", req_interval_total/req_total_num/num_generators/1000);
     printf("The average request size is %lu bytes\n", req_size_total/req_total_num);
     printf("The average DSCP value is %.2f\n", dscp_total/req_total_num);
     printf("The average flow sending rate is %lu Mbps\n", rate_total/req_total_num);
-    printf("The expected experiment duration is %lu s\n", req_interval_total/1000000);
+    printf("The expected experiment duration is %lu s\n", (unsigned long)(duration_ns/1000000000));
+}
+
+/* sample the next request of a generator */
+void gen_request(struct generator *g, struct request *req)
+{
+    /* the stream of a generator only depends on its seed */
+    req->size = gen_random_cdf_r(req_size_dist, &(g->rand_state));
+    req->server_id = rand_r(&(g->rand_state)) % num_server;
+    req->dscp = gen_alias_value_r(&dscp_dist, &(g->rand_state));
+    req->rate = gen_alias_value_r(&rate_dist, &(g->rand_state));
+    /* arrival interval based on poission process (none in the closed loop) */
+    req->interval_ns = (period_ns > 0) ? poission_gen_interval_r(1.0/(period_ns * num_generators), &(g->rand_state)) : 0;
 }
 
-/* receive traffic from established connections */
-void *listen_connection(void *ptr)
+/* complete a flow received on a connection (called by receiver threads) */
+void flow_done(struct conn_node *node, struct flow_metadata *flow)
+{
+    struct closed_level *level = NULL;
+    struct vuser *u = NULL;
+    unsigned long long stop_ns = get_mono_ns();
+
+    log_flow(node, flow, stop_ns);
+    if (num_closed_levels > 0)
+    {
+        level = &closed_levels[atomic_load(&cur_level)];
+        atomic_fetch_add_explicit(&(level->num_flow), 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&(level->bytes), flow->size, memory_order_relaxed);
+        histogram_add(&(level->fct), (stop_ns - node->start_ns) / 1000);
+        u = &vusers[flow->id - 1];
+    }
+
+    /* the connection may carry a waiting request from now on (if nobody else holds it) */
+    atomic_fetch_add(&(node->list->flow_finished), 1);
+    if (finish_conn_req(node))
+        serve_conn(node);
+
+    /* the connection is free again before the user issues its next request */
+    if (u)
+        vuser_done(u);
+}
+
+/* use a connection established in the background (called by receiver threads) */
+void conn_ready(struct conn_node *node, bool connected)
 {
-    struct conn_node *node = (struct conn_node*)ptr;
     struct flow_metadata flow;
-    char read_buf[TG_MAX_READ] = {0};
 
-    while (true)
+    if (connected)
+        serve_conn(node);
+    /* as with a blocking connect(), a request that cannot get a new connection is dropped */
+    else if (dequeue_pending_flow(node->list, &flow, true, NULL))
     {
-        if (!read_flow_metadata(node->sockfd, &flow))
-        {
-            perror("Error: read meatadata");
-            break;
-        }
+        drop_flow(&flow);
+        if (verbose_mode)
+            printf("Cannot establish a new connection to %s:%hu\n", node->list->ip, node->list->port);
+    }
+}
 
-        if (read_exact(node->sockfd, read_buf, flow.size, TG_MAX_READ, true) != flow.size)
-        {
-            perror("Error: receive flow");
-            break;
-        }
+/* replace an established connection closed while requests wait for one (called by receiver threads) */
+void conn_closed(struct conn_node *node)
+{
+    /* otherwise requests queued at the cap wait for a connection that will never come back */
+    open_pending_conn(node->list);
+}
 
-        node->busy = false;
-        pthread_mutex_lock(&(node->list->lock));
-        /* not the special flow ID */
-        if (flow.id != 0)
-        {
-            node->list->flow_finished++;
-            node->list->available_len++;
-        }
-        /* Ohterwise, it's a special flow ID to terminate connection.
-           So this connection will no longer be available. */
-        pthread_mutex_unlock(&(node->list->lock));
+/* open a connection in the background for a waiting request unless one is on its way or the pool is at its cap */
+void open_pending_conn(struct conn_list *list)
+{
+    struct conn_node *node = NULL;
+    struct flow_metadata dropped;
 
-        /* a special flow ID to terminate persistent connection */
-        if (flow.id == 0)
-            break;
-        else
-            gettimeofday(&req_stop_time[flow.id - 1], NULL);
+    if (atomic_load(&(list->pending_len)) <= atomic_load(&(list->connecting)) || conn_list_full(list))
+        return;
+
+    node = insert_conn_list_async(list);
+    if (node && receiver_add_pending_conn(node))
+    {
+        if (verbose_mode)
+            printf("[%u] Establish a new connection to %s:%hu (available/live = %u/%u)\n", atomic_fetch_add(&num_new_conn, 1) + 1, list->ip, list->port, atomic_load(&(list->available_len)), atomic_load(&(list->live_len)));
+        return;
     }
 
-    close(node->sockfd);
-    node->connected = false;
-    node->busy = false;
+    cancel_conn_node(node);
+    if (verbose_mode)
+        printf("Cannot establish a new connection to %s:%hu\n", list->ip, list->port);
+    if (dequeue_pending_flow(list, &dropped, true, NULL))
+        drop_flow(&dropped);
+}
 
-    return (void*)0;
+/* send waiting requests on a held connection while it has room, then give the connection back to the pool */
+void serve_conn(struct conn_node *node)
+{
+    struct flow_metadata flow;
+    unsigned long long wait_ns;
+
+    while (conn_node_outstanding(node) < node->list->depth && dequeue_pending_flow(node->list, &flow, false, &wait_ns))
+        send_flow_req(node, &flow, wait_ns);
+    release_conn_list(node);
+}
+
+/* send a flow request that has waited 'wait_ns' for a held connection and record its start time */
+void send_flow_req(struct conn_node *node, struct flow_metadata *flow, unsigned long long wait_ns)
+{
+    struct flow_metadata req = *flow;
+
+    if (node->list->mux)
+        req.tos |= TG_FLOW_MUX;
+    start_conn_req(node, flow->id, wait_ns);
+    if (!write_flow_req(node->sockfd, &req))
+        perror("Error: generate request");
 }
 
-/* generate flow requests */
+/* generate flow requests with all generators */
 void run_requests()
 {
     unsigned int i = 0;
+
+    if (pthread_barrier_init(&generator_barrier, NULL, num_generators) != 0)
+    {
+        cleanup();
+        error("Error: pthread_barrier_init");
+    }
+
+    for (i = 0; i < num_generators; i++)
+    {
+        if (pthread_create(&(generators[i].thread), NULL, run_generator, (void*)&generators[i]) != 0)
+        {
+            cleanup();
+            error("Error: pthread_create");
+        }
+    }
+
+    for (i = 0; i < num_generators; i++)
+        pthread_join(generators[i].thread, NULL);
+    pthread_barrier_destroy(&generator_barrier);
+
+    if (!verbose_mode && report_interval_ms == 0 && num_closed_levels == 0)
+        printf("\n");
+}
+
+/* main loop of a generator */
+void *run_generator(void *ptr)
+{
+    struct generator *g = (struct generator*)ptr;
+    unsigned int i = 0;
     unsigned int k = 1;
-    unsigned int sleep_us = 0;
+    unsigned long long start_ns;
+    unsigned long long late_ns;
+    unsigned long long deadline_ns;
+    double offset_ns = 0;   /* arrival time of the request (relative to start_ns) */
+    unsigned int req_id;
+    struct request req;
+    struct flow_metadata flow;
+
+    if (wait_mode == TG_WAIT_REALTIME && !set_realtime_thread())
+        printf("Cannot run generator %u with real-time priority, only spin\n", g->id);
+    if (wait_mode != TG_WAIT_SLEEP)
+    {
+        init_precise_clock(&(g->clock));
+        if (verbose_mode)
+            printf("The initial spin threshold of generator %u is %.3f us\n", g->id, (double)precise_clock_threshold(&(g->clock)) / 1000);
+    }
+
+    pthread_barrier_wait(&generator_barrier);
+    if (num_closed_levels > 0)
+    {
+        run_closed_loop(g);
+        return (void*)0;
+    }
 
-    for (i = 0; i < req_total_num; i++)
+    start_ns = get_mono_ns();
+    for (i = 0; req_total_num == 0 || i < g->req_num; i++)
     {
-        sleep_us += req_sleep_us[i];
-        if (sleep_us > usleep_overhead_us)
+        req_id = g->req_first + i;
+        if (stream_mode)
         {
-            usleep(sleep_us - usleep_overhead_us);
-            sleep_us = 0;
+            gen_request(g, &req);
+            offset_ns += req.interval_ns;
+            /* with -t, the stream ends when the time is up */
+            if (req_total_num == 0 && offset_ns >= req_total_time * 1000000000.0)
+                break;
+        }
+        else
+        {
+            req.size = req_size[req_id];
+            req.server_id = req_server_id[req_id];
+            req.dscp = req_dscp[req_id];
+            req.rate = req_rate[req_id];
+            offset_ns = req_arrival_ns[req_id];
         }
-        run_request(i);
 
-        if (!verbose_mode && i + 1 >= k * req_total_num / 100)
+        flow.id = (req_id % UINT_MAX) + 1;  /* we reserve flow ID 0 for special usage */
+        flow.size = req.size;
+        flow.tos = req.dscp << 2;   /* ToS = DSCP * 4 */
+        flow.rate = req.rate;
+        g->req_count++;
+        g->req_size_total += req.size;
+
+        /* absolute deadlines: late wake-ups shorten the next sleep instead of adding up as drift */
+        deadline_ns = start_ns + (unsigned long long)offset_ns;
+        if (wait_mode == TG_WAIT_SLEEP)
+            late_ns = sleep_until_ns(deadline_ns);
+        else
+            late_ns = precise_sleep_until_ns(&(g->clock), deadline_ns);
+        g->late_ns_total += late_ns;
+        g->late_ns_max = max(g->late_ns_max, late_ns);
+        atomic_fetch_add_explicit(&flow_started, 1, memory_order_relaxed);
+        run_request(g, req.server_id, &flow);
+
+        /* the first generator shows the progress of all (live reports show more) */
+        if (!verbose_mode && report_interval_ms == 0 && g->id == 0 && g->req_num > 0 && i + 1 >= k * g->req_num / 100)
         {
-            display_progress(i + 1, req_total_num);
+            display_progress(i + 1, g->req_num);
             k++;
         }
     }
-    if (!verbose_mode)
-        printf("\n");
+
+    return (void*)0;
 }
 
 /* generate a flow request to the server */
-void run_request(unsigned int req_id)
+void run_request(struct generator *g, unsigned int server_id, struct flow_metadata *flow)
 {
-    unsigned int server_id = req_server_id[req_id];
-    int sockfd;
-    struct flow_metadata flow;
-    struct conn_node* node = search_conn_list(&connection_lists[server_id]);
+    struct conn_list *list = &(g->lists[server_id]);
+    struct conn_node *node = NULL;
     unsigned int active_connections = 0;
     unsigned int i = 0;
 
-    flow.id = req_id + 1;   /* we reserve flow ID 0 for special usage */
-    flow.size = req_size[req_id];
-    flow.tos = req_dscp[req_id] << 2;   /* ToS = DSCP * 4 */
-    flow.rate = req_rate[req_id];
+    /* requests that are already waiting go first */
+    if (atomic_load(&(list->pending_len)) == 0)
+        node = acquire_conn_list(list);
 
-    /* cannot find available connection. Need to establish new connections. */
+    /* cannot find available connection. Wait for a new connection established in the background. */
     if (!node)
     {
-        if (insert_conn_list(&connection_lists[server_id], 1))
+        if (!enqueue_pending_flow(list, flow))
         {
-            node = connection_lists[server_id].tail;
-            if (verbose_mode)
-                printf("[%u] Establish a new connection to %s:%u (available/total = %u/%u)\n", ++num_new_conn, server_addr[server_id], server_port[server_id], node->list->available_len, node->list->len);
-            pthread_create(&(node->thread), NULL, listen_connection, (void*)node);
-        }
-        else
-        {
-            if (verbose_mode)
-                printf("Cannot establish a new connection to %s:%u\n", server_addr[server_id], server_port[server_id]);
+            drop_flow(flow);
             return;
         }
+
+        /* every waiting request has a connection on its way, unless the pool is at its cap */
+        open_pending_conn(list);
+
+        /* a connection may have been released in the meantime */
+        if ((node = acquire_conn_list(list)))
+            serve_conn(node);
+        return;
     }
 
-    if (verbose_mode && (req_id % 100 == 0))
+    if (verbose_mode && (flow->id % 100 == 0))
     {
         active_connections = 0;
-        for (i = 0; i< num_server; i++)
-            active_connections += connection_lists[i].len - connection_lists[i].available_len;
+        for (i = 0; i < num_generators * num_server; i++)
+            active_connections += atomic_load(&(connection_lists[i].live_len)) - atomic_load(&(connection_lists[i].available_len));
         printf("Concurrent active connections: %u\n", active_connections);
     }
 
-    /* Send request and record start time */
-    gettimeofday(&req_start_time[req_id], NULL);
-    sockfd = node->sockfd;
-    node->busy = true;
-    pthread_mutex_lock(&(node->list->lock));
-    node->list->available_len--;
-    pthread_mutex_unlock(&(node->list->lock));
+    /* Send request and record start time, the connection stays out of the pool while it is full */
+    send_flow_req(node, flow, 0);
+    release_conn_list(node);
+}
 
-    if (!write_flow_req(sockfd, &flow))
-        perror("Error: generate request");
+/* a flow request is dropped as no connection can be established for it */
+void drop_flow(struct flow_metadata *flow)
+{
+    /* the user would wait forever otherwise */
+    if (num_closed_levels > 0)
+        vuser_done(&vusers[flow->id - 1]);
+}
+
+/* parse a comma-separated list of virtual users per server, return false if it fails */
+bool parse_closed_levels(char *arg)
+{
+    char *token = NULL;
+    char *end = NULL;
+    unsigned long users;
+
+    num_closed_levels = 0;
+    for (token = arg; *token != '\0'; token = end + 1)
+    {
+        users = strtoul(token, &end, 10);
+        if (end == token || users == 0 || users > TG_CONN_CHUNK_SIZE * TG_CONN_MAX_CHUNK || num_closed_levels >= TG_CLOSED_MAX_LEVELS)
+            return false;
+        closed_users[num_closed_levels++] = (unsigned int)users;
+        if (*end == '\0')
+            return true;
+        else if (*end != ',')
+            return false;
+    }
+
+    return false;
+}
+
+/* create virtual users and their signaling */
+void init_closed_loop()
+{
+    unsigned int max_users = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < num_closed_levels; i++)
+        max_users = max(max_users, closed_users[i]);
+
+    vusers = (struct vuser*)calloc(max_users * num_server, sizeof(struct vuser));
+    closed_levels = (struct closed_level*)calloc(num_closed_levels, sizeof(struct closed_level));
+    if (!vusers || !closed_levels)
+    {
+        cleanup();
+        error("Error: calloc virtual users");
+    }
+    atomic_init(&cur_level, 0);
+
+    /* users of a level are spread over servers, then over generators */
+    for (i = 0; i < max_users * num_server; i++)
+    {
+        vusers[i].id = i;
+        vusers[i].server_id = i % num_server;
+        vusers[i].g = &generators[(i / num_server) % num_generators];
+    }
+
+    for (i = 0; i < num_generators; i++)
+    {
+        atomic_init(&(generators[i].done_head), NULL);
+        generators[i].done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        generators[i].wheel = (struct timer_wheel*)malloc(sizeof(struct timer_wheel));
+        if (generators[i].done_fd < 0 || !generators[i].wheel)
+        {
+            cleanup();
+            error("Error: create the signaling of virtual users");
+        }
+    }
+}
+
+/* main loop of a generator in the closed loop */
+void run_closed_loop(struct generator *g)
+{
+    struct wheel_entry *e = NULL;
+    struct wheel_entry *next_e = NULL;
+    struct vuser *u = NULL;
+    struct vuser *next_u = NULL;
+    struct closed_level *level = NULL;
+    struct pollfd pfd;
+    struct timespec ts;
+    unsigned long long start_ns, now_ns, stop_ns, wake_ns, val;
+    unsigned long long issued;
+    unsigned int outstanding;
+    unsigned int i, j;
+    bool stopping;
+
+    pfd.fd = g->done_fd;
+    pfd.events = POLLIN;
+
+    for (i = 0; i < num_closed_levels; i++)
+    {
+        /* levels start together, after the previous one has drained */
+        if (i > 0)
+            pthread_barrier_wait(&generator_barrier);
+        start_ns = get_mono_ns();
+        stop_ns = (req_total_num == 0) ? start_ns + req_total_time * 1000000000ULL : 0;
+        init_timer_wheel(g->wheel, start_ns);
+        issued = 0;
+        outstanding = 0;
+        stopping = false;
+
+        /* all the users start at once */
+        for (j = 0; j < closed_users[i] * num_server && (req_total_num == 0 || issued < g->req_num); j++)
+        {
+            if (vusers[j].g != g)
+                continue;
+            run_vuser(&vusers[j]);
+            issued++;
+            outstanding++;
+        }
+
+        while (true)
+        {
+            now_ns = get_mono_ns();
+            if ((stop_ns > 0 && now_ns >= stop_ns) || (req_total_num > 0 && issued >= g->req_num))
+                stopping = true;
+
+            /* users whose request has completed think, then issue the next one */
+            if (read(g->done_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                perror("Error: read() in run_closed_loop()");
+            for (u = atomic_exchange(&(g->done_head), NULL); u; u = next_u)
+            {
+                next_u = u->done_next;
+                outstanding--;
+                if (stopping)
+                    continue;
+                u->timer.expire_ns = now_ns;
+                if (think_time_us > 0)
+                    u->timer.expire_ns += (unsigned long long)poission_gen_interval_r(1.0 / (think_time_us * 1000.0), &(g->rand_state));
+                timer_wheel_add(g->wheel, &(u->timer));
+            }
+
+            for (e = timer_wheel_expire(g->wheel, now_ns); e && !stopping; e = next_e)
+            {
+                next_e = e->next;
+                run_vuser((struct vuser*)e);
+                issued++;
+                outstanding++;
+                if (req_total_num > 0 && issued >= g->req_num)
+                    stopping = true;
+            }
+
+            /* users still thinking when the level ends stay idle */
+            if (stopping && outstanding == 0)
+                break;
+
+            /* sleep until a request completes, a think time ends or the level ends */
+            wake_ns = (stopping) ? 0 : timer_wheel_next(g->wheel);
+            if (!stopping && stop_ns > 0)
+                wake_ns = (wake_ns > 0) ? min(wake_ns, stop_ns) : stop_ns;
+            if (wake_ns > 0)
+            {
+                wake_ns = (wake_ns > now_ns) ? wake_ns - now_ns : 0;
+                ts.tv_sec = wake_ns / 1000000000;
+                ts.tv_nsec = wake_ns % 1000000000;
+            }
+            if (ppoll(&pfd, 1, (wake_ns > 0) ? &ts : NULL, NULL) < 0 && errno != EINTR)
+                perror("Error: ppoll() in run_closed_loop()");
+        }
+
+        /* the first generator reports the level once all generators have drained it */
+        pthread_barrier_wait(&generator_barrier);
+        if (g->id == 0)
+        {
+            level = &closed_levels[i];
+            level->duration_ns = get_mono_ns() - start_ns;
+            printf("%u users per server: %.0f requests/s  goodput %llu Mbps  FCT average %.0f us  p99 %llu us\n",
+                   closed_users[i], atomic_load(&(level->num_flow)) * 1000000000.0 / max(level->duration_ns, 1),
+                   atomic_load(&(level->bytes)) * 8000 / max(level->duration_ns, 1), histogram_mean(&(level->fct)),
+                   histogram_percentile(&(level->fct), 0.99));
+            fflush(stdout);
+            atomic_store(&cur_level, min(i + 1, num_closed_levels - 1));
+        }
+    }
+}
+
+/* issue the next request of a virtual user */
+void run_vuser(struct vuser *u)
+{
+    struct generator *g = u->g;
+    struct request req;
+    struct flow_metadata flow;
+
+    gen_request(g, &req);
+    flow.id = u->id + 1;    /* the completion finds the user by flow ID */
+    flow.size = req.size;
+    flow.tos = req.dscp << 2;
+    flow.rate = req.rate;
+    g->req_count++;
+    g->req_size_total += req.size;
+    atomic_fetch_add_explicit(&flow_started, 1, memory_order_relaxed);
+    run_request(g, u->server_id, &flow);
+}
+
+/* let the generator of a virtual user know that its request has completed (called by receiver threads) */
+void vuser_done(struct vuser *u)
+{
+    struct generator *g = u->g;
+    struct vuser *head = atomic_load(&(g->done_head));
+    unsigned long long val = 1;
+
+    /* lock-free push, the generator takes the whole stack at once */
+    do
+    {
+        u->done_next = head;
+    } while (!atomic_compare_exchange_weak(&(g->done_head), &head, u));
+
+    /* only the first completion since the generator last looked needs a wake-up */
+    if (!head && write(g->done_fd, &val, sizeof(val)) < 0)
+        perror("Error: write() in vuser_done()");
+}
+
+/* print the results of all the levels of the closed loop */
+void print_closed_levels()
+{
+    struct closed_level *level = NULL;
+    unsigned int i;
+
+    printf("Closed loop (think time %u us):\n", think_time_us);
+    printf("%12s %12s %12s %14s %12s %12s %12s\n", "users/server", "requests", "requests/s", "goodput", "avg FCT", "p50 FCT", "p99 FCT");
+    for (i = 0; i < num_closed_levels; i++)
+    {
+        level = &closed_levels[i];
+        printf("%12u %12llu %12.0f %9llu Mbps %9.0f us %9llu us %9llu us\n", closed_users[i], atomic_load(&(level->num_flow)),
+               atomic_load(&(level->num_flow)) * 1000000000.0 / max(level->duration_ns, 1),
+               atomic_load(&(level->bytes)) * 8000 / max(level->duration_ns, 1), histogram_mean(&(level->fct)),
+               histogram_percentile(&(level->fct), 0.5), histogram_percentile(&(level->fct), 0.99));
+    }
+}
+
+/* queue the FCT of a completed flow for the log writer */
+void log_flow(struct conn_node *node, struct flow_metadata *flow, unsigned long long stop_ns)
+{
+    struct log_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.size = flow->size;
+    set_log_fct_ns(&r, stop_ns - node->start_ns);
+    r.ttfb_ns = node->header_ns - node->start_ns;
+    r.wait_ns = node->wait_ns;
+    r.dscp = flow->tos >> 2;
+    r.rate = flow->rate;
+    set_log_goodput(&r);
+    flow_stats_add(fct_stats, &r);
+    flow_log_push(&r);
+
+    if (report_interval_ms > 0)
+    {
+        interval_histogram_add(&interval_fct, r.fct_us);
+        atomic_fetch_add_explicit(&rx_bytes, r.size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&flow_completed, 1, memory_order_relaxed);
+    }
+}
+
+/* start the thread printing live statistics */
+void start_reporter()
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&reporter_thread, NULL, run_reporter, NULL) != 0)
+    {
+        cleanup();
+        error("Error: pthread_create");
+    }
+}
+
+/* stop the thread printing live statistics */
+void stop_reporter()
+{
+    pthread_mutex_lock(&reporter_lock);
+    reporter_stop = true;
+    pthread_cond_signal(&reporter_cond);
+    pthread_mutex_unlock(&reporter_lock);
+
+    pthread_join(reporter_thread, NULL);
+    pthread_cond_destroy(&reporter_cond);
+}
+
+/* main loop of the reporter */
+void *run_reporter(void *ptr)
+{
+    unsigned long long start_ns = get_mono_ns();
+    unsigned long long last_ns = start_ns, now_ns, deadline_ns = start_ns;
+    unsigned long long started, completed, bytes;
+    unsigned long long last_started = 0, last_completed = 0, last_bytes = 0;
+    unsigned int len, available, waiting;
+    unsigned int i, j;
+    struct histogram *fct = NULL;
+    struct timespec ts;
+    bool stop = false;
+
+    while (!stop)
+    {
+        /* absolute deadlines, so that printing does not make the intervals drift */
+        deadline_ns += report_interval_ms * 1000000ULL;
+        ts.tv_sec = deadline_ns / 1000000000;
+        ts.tv_nsec = deadline_ns % 1000000000;
+        pthread_mutex_lock(&reporter_lock);
+        while (!reporter_stop && pthread_cond_timedwait(&reporter_cond, &reporter_lock, &ts) == 0);
+        stop = reporter_stop;
+        pthread_mutex_unlock(&reporter_lock);
+
+        now_ns = get_mono_ns();
+        fct = swap_interval_histogram(&interval_fct);
+        started = atomic_load(&flow_started);
+        completed = atomic_load(&flow_completed);
+        bytes = atomic_load(&rx_bytes);
+
+        /* time, goodput, flows started, completed and outstanding, FCT of the flows completed in the interval */
+        printf("[%8.3f s] RX goodput %llu Mbps  flows started %llu  completed %llu  outstanding %llu  FCT p50 %llu us  p99 %llu us\n",
+               (now_ns - start_ns) / 1000000000.0, (bytes - last_bytes) * 8000 / max(now_ns - last_ns, 1),
+               started - last_started, completed - last_completed, started - min(completed, started),
+               histogram_percentile(fct, 0.5), histogram_percentile(fct, 0.99));
+
+        /* connection pools of all generators to each server */
+        for (i = 0; i < num_server; i++)
+        {
+            len = available = waiting = 0;
+            for (j = 0; j < num_generators; j++)
+            {
+                len += atomic_load(&(connection_lists[j * num_server + i].len));
+                available += atomic_load(&(connection_lists[j * num_server + i].available_len));
+                waiting += atomic_load(&(connection_lists[j * num_server + i].pending_len));
+            }
+            printf("             %s:%u  connections %u  available %u  waiting requests %u\n",
+                   server_addr[i], server_port[i], len, available, waiting);
+        }
+        fflush(stdout);
+
+        last_ns = now_ns;
+        last_started = started;
+        last_completed = completed;
+        last_bytes = bytes;
+    }
+
+    return (void*)0;
+}
+
+/* measure the RTT to a server with empty flows on an idle connection (ns, 0 if it fails) */
+unsigned long long probe_rtt(struct conn_node *node)
+{
+    struct flow_metadata flow, echo;
+    unsigned long long start_ns, rtt_ns = 0;
+    unsigned int i;
+
+    /* the connection is not in a receiver yet, so read the responses here */
+    flow.id = UINT_MAX;
+    flow.size = 0;
+    flow.tos = 0;
+    flow.rate = 0;
+    for (i = 0; node && i < TG_PROBE_RTT_NUM; i++)
+    {
+        start_ns = get_mono_ns();
+        if (!write_flow_req(node->sockfd, &flow) || !read_flow_metadata(node->sockfd, &echo))
+        {
+            printf("Error: probe RTT to %s:%hu in probe_rtt()\n", node->list->ip, node->list->port);
+            return 0;
+        }
+        rtt_ns = (i == 0) ? get_mono_ns() - start_ns : min(rtt_ns, get_mono_ns() - start_ns);
+    }
+
+    return rtt_ns;
+}
+
+/* open the connections expected to be busy at the target load (Little's law) before traffic starts */
+void prewarm_pools()
+{
+    struct conn_list *list = NULL;
+    unsigned long long rtt_ns;
+    unsigned int i, j, num, max_users = 0;
+    double arrival_rate, hold_s;
+
+    for (i = 0; i < num_closed_levels; i++)
+        max_users = max(max_users, closed_users[i]);
+
+    for (i = 0; i < num_server; i++)
+    {
+        rtt_ns = probe_rtt(connection_lists[i].head);
+
+        /* each virtual user has at most one outstanding request */
+        if (num_closed_levels > 0)
+            num = (max_users + num_generators - 1) / num_generators;
+        /* requests spread evenly over servers and generators, and hold a connection for an RTT
+           and their transfer at the target load */
+        else
+        {
+            arrival_rate = 1000000000.0 / (period_ns * num_server * num_generators);
+            hold_s = rtt_ns / 1000000000.0 + avg_cdf(req_size_dist) * 8 / (load * 1000000);
+            num = (unsigned int)ceil(arrival_rate * hold_s);
+        }
+        num = max((num + conn_depth - 1) / conn_depth, 1);
+
+        for (j = 0; j < num_generators; j++)
+        {
+            list = &connection_lists[j * num_server + i];
+            if (list->max_len > 0)
+                num = min(num, list->max_len);
+            if (num > atomic_load(&(list->len)) && !insert_conn_list(list, num - atomic_load(&(list->len))))
+            {
+                cleanup();
+                error("Error: insert_conn_list");
+            }
+        }
+
+        printf("Prewarm %u connections per generator to %s:%u (probe RTT %.1f us)\n", atomic_load(&(connection_lists[i].len)),
+               server_addr[i], server_port[i], rtt_ns / 1000.0);
+    }
 }
 
 /* Terminate all existing connections */
@@ -741,9 +1670,12 @@ void exit_connections()
     struct conn_node *ptr = NULL;
     unsigned int num = 0;
 
-    /* Start threads to receive traffic */
-    for (i = 0; i < num_server; i++)
+    for (i = 0; i < num_generators * num_server; i++)
     {
+        /* let waiting requests and background connect() calls finish first */
+        while (atomic_load(&(connection_lists[i].pending_len)) > 0 || atomic_load(&(connection_lists[i].connecting)) > 0)
+            usleep(1000);
+
         num = 0;
         ptr = connection_lists[i].head;
         while (true)
@@ -754,16 +1686,21 @@ void exit_connections()
             {
                 if (ptr->connected)
                 {
+                    /* the response terminating a multiplexed connection may overtake the others */
+                    while (mux_mode && ptr->connected && conn_node_outstanding(ptr) > 0)
+                        usleep(1000);
                     exit_connection(ptr);
                     num++;
                 }
                 ptr = ptr->next;
             }
         }
-        wait_conn_list(&connection_lists[i]);
         if (verbose_mode)
-            printf("Exit %u/%u connections to %s:%u\n", num, connection_lists[i].len, server_addr[i], server_port[i]);
+            printf("Exit %u/%u connections to %s:%u\n", num, connection_lists[i].len, connection_lists[i].ip, connection_lists[i].port);
     }
+
+    /* wait for the servers to close all connections */
+    wait_receivers();
 }
 
 /* Terminate a connection */
@@ -773,16 +1710,13 @@ void exit_connection(struct conn_node *node)
     struct flow_metadata flow;
     flow.id = 0;   /* a special flow ID to terminate connection */
     flow.size = 100;
-    flow.tos = 0;
+    flow.tos = (node && node->list->mux) ? TG_FLOW_MUX : 0;  /* a multiplexed connection expects a framed response */
     flow.rate = 0;
 
     if (!node)
         return;
 
     sockfd = node->sockfd;
-    pthread_mutex_lock(&(node->list->lock));
-    node->list->available_len--;
-    pthread_mutex_unlock(&(node->list->lock));
 
     if (!write_flow_req(sockfd, &flow))
         perror("Error: generate request");
@@ -790,41 +1724,49 @@ void exit_connection(struct conn_node *node)
 
 void print_statistic()
 {
-    unsigned long long duration_us = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec;
+    unsigned long long duration_us = max((traffic_end_ns - traffic_start_ns) / 1000, 1);
     unsigned long long req_size_total = 0;
-    unsigned long long fct_us;
-    unsigned int flow_goodput_mbps;    /* per-flow goodput (Mbps) */
+    unsigned long long req_count = 0;
+    unsigned long long flow_logged = 0;
     unsigned int goodput_mbps; /* total goodput (Mbps) */
-    unsigned int i = 0;
-    FILE *fd = NULL;
-
-    fd = fopen(fct_log_name, "w");
-    if (!fd)
-        error("Error: open the FCT result file");
+    unsigned long long late_ns_total = 0;
+    unsigned long long late_ns_max = 0;
+    unsigned int j = 0;
 
-    for (i = 0; i < req_total_num; i++)
+    for (j = 0; j < num_generators; j++)
     {
-        req_size_total += req_size[i];
-        if ((req_stop_time[i].tv_sec == 0) && (req_stop_time[i].tv_usec == 0))
-        {
-            printf("Unfinished flow request %u\n", i);
-            continue;
-        }
-
-        fct_us = (req_stop_time[i].tv_sec - req_start_time[i].tv_sec) * 1000000 + req_stop_time[i].tv_usec - req_start_time[i].tv_usec;
-        if (fct_us > 0)
-            flow_goodput_mbps = req_size[i] * 8 / fct_us;
-        else
-            flow_goodput_mbps = 0;
-
-        /* size (bytes), FCT(us), DSCP, sending rate (Mbps), goodput (Mbps) */
-        fprintf(fd, "%u %llu %u %u %u\n", req_size[i], fct_us, req_dscp[i], req_rate[i], flow_goodput_mbps);
+        req_count += generators[j].req_count;
+        req_size_total += generators[j].req_size_total;
+        late_ns_total += generators[j].late_ns_total;
+        late_ns_max = max(late_ns_max, generators[j].late_ns_max);
     }
 
-    fclose(fd);
+    /* flows have been logged as they completed */
+    flow_logged = stop_flow_log();
+    if (flow_logged < req_count)
+        printf("Unfinished flow requests: %llu\n", req_count - flow_logged);
+    if (stream_mode)
+        printf("We generate %llu requests in total\n", req_count);
+
     goodput_mbps = req_size_total * 8 / duration_us;
     printf("The actual RX throughput is %u Mbps\n", (unsigned int)(goodput_mbps/TG_GOODPUT_RATIO));
     printf("The actual duration is %llu s\n", duration_us/1000000);
+    if (num_closed_levels > 0)
+    {
+        printf("===========================================\n");
+        print_closed_levels();
+    }
+    else
+        printf("The average lateness of request arrivals is %.3f us (max %.3f us)\n",
+               (double)late_ns_total / max(req_count, 1) / 1000, (double)late_ns_max / 1000);
+    for (j = 0; j < num_generators && wait_mode != TG_WAIT_SLEEP && num_closed_levels == 0; j++)
+    {
+        if (num_generators > 1)
+            printf("Generator %u: ", j);
+        print_precise_clock(&(generators[j].clock));
+    }
+    printf("===========================================\n");
+    print_flow_stats(fct_stats, "flows");
     printf("===========================================\n");
     printf("Write FCT results to %s\n", fct_log_name);
 }
@@ -840,9 +1782,11 @@ void cleanup()
 
     free(dscp_value);
     free(dscp_prob);
+    free_alias_table(&dscp_dist);
 
     free(rate_value);
     free(rate_prob);
+    free_alias_table(&rate_dist);
 
     free_cdf(req_size_dist);
     free(req_size_dist);
@@ -851,16 +1795,16 @@ void cleanup()
     free(req_server_id);
     free(req_dscp);
     free(req_rate);
-    free(req_sleep_us);
-    free(req_start_time);
-    free(req_stop_time);
+    free(req_arrival_ns);
+    free_flow_stats(fct_stats);
+    fct_stats = NULL;
 
     if (connection_lists)
     {
         if (verbose_mode)
             printf("===========================================\n");
 
-        for(i = 0; i < num_server; i++)
+        for(i = 0; i < num_generators * num_server; i++)
         {
             if (verbose_mode)
                 printf("Clear connection list %u to %s:%u\n", i, connection_lists[i].ip, connection_lists[i].port);
@@ -868,4 +1812,14 @@ void cleanup()
         }
     }
     free(connection_lists);
+
+    for (i = 0; generators && i < num_generators; i++)
+    {
+        if (generators[i].done_fd >= 0)
+            close(generators[i].done_fd);
+        free(generators[i].wheel);
+    }
+    free(generators);
+    free(vusers);
+    free(closed_levels);
 }
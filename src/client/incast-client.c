@@ -13,16 +13,35 @@
 
 #include "../common/common.h"
 #include "../common/cdf.h"
+#include "../common/alias.h"
 #include "../common/conn.h"
+#include "../common/receiver.h"
+#include "../common/clock.h"
+#include "../common/log_format.h"
+#include "../common/flow_stats.h"
+#include "../common/histogram.h"
 
 /* the structure of a flow request */
 struct flow_request
 {
     struct conn_node *node;
     struct flow_metadata metadata;
+    char buf[TG_METADATA_SIZE]; /* metadata encoded before the request is sent */
+};
+
+/* connections held for the requests to a server: the refill thread puts them, the generator takes them */
+struct conn_reserve
+{
+    struct conn_node **nodes;   /* ring of held connections (mask + 1 entries, allocated once) */
+    unsigned int mask;  /* size of the ring - 1 (a power of 2) */
+    unsigned int target;    /* connections to keep reserved */
+    atomic_uint head;   /* connections taken by the generator so far */
+    atomic_uint tail;   /* connections put by the refill thread so far */
 };
 
 bool verbose_mode = false;  /* by default, we don't give more detailed output */
+unsigned int num_receivers = TG_DEFAULT_RECEIVERS;  /* number of threads receiving traffic from all connections */
+unsigned int num_dispatchers = 0;   /* threads sending the flows of a request (0: the generator sends them back-to-back) */
 
 char config_file_name[80] = {0};    /* configuration file name */
 char dist_file_name[80] = {0};  /* size distribution file name */
@@ -33,20 +52,29 @@ char rct_log_name[80] = {0};    /* request completion times (RCT) log file name
 char fct_log_name[80] = {0};    /* request flow completion times (FCT) log file name */
 char result_script_name[80] = {0};  /* name of script file to parse final results */
 int seed = 0;   /* random seed */
-unsigned int usleep_overhead_us = 0;    /* usleep overhead */
-struct timeval tv_start, tv_end;    /* start and end time of traffic */
+enum wait_mode wait_mode = TG_WAIT_SLEEP;   /* how the generator waits for request arrivals */
+enum log_format log_format = TG_LOG_TEXT;   /* format of the RCT and FCT logs */
+struct precise_clock arrival_clock; /* hybrid sleep/spin wait of the generator */
+unsigned long long arrival_late_ns_total = 0;  /* total time requests are generated after their arrival time */
+unsigned long long arrival_late_ns_max = 0;    /* maximum time a request is generated after its arrival time */
+atomic_uint req_in_flight;  /* requests dispatched and not completed yet */
+unsigned int req_in_flight_max = 0; /* maximum number of requests in flight at once */
+unsigned long long traffic_start_ns, traffic_end_ns;    /* start and end time of traffic (CLOCK_MONOTONIC) */
 
 /* per-server variables */
 unsigned int num_server = 0;    /* total number of servers */
 unsigned int *server_port = NULL;   /* ports of servers */
 char (*server_addr)[20] = NULL; /* IP addresses of servers */
 unsigned int *server_flow_count = NULL; /* the number of flows generated by each server */
+struct conn_reserve *reserves = NULL;   /* connections reserved for the requests to each server */
+unsigned int num_unreserved_flow = 0;   /* flows that found no reserved connection */
 
 unsigned int num_fanout = 0;    /* number of fanouts */
 unsigned int *fanout_size = NULL;
 unsigned int *fanout_prob = NULL;
 unsigned int fanout_prob_total = 0;
 unsigned int max_fanout_size = 1;
+struct alias_table fanout_dist; /* sampler of fanouts */
 
 unsigned int num_dscp = 0;  /* number of DSCP */
 unsigned int *dscp_value = NULL;
@@ -57,13 +85,15 @@ unsigned int num_rate = 0;  /* number of sending rates */
 unsigned int *rate_value = NULL;
 unsigned int *rate_prob = NULL;
 unsigned int rate_prob_total = 0;
+struct alias_table dscp_dist;   /* sampler of DSCP values */
+struct alias_table rate_dist;   /* sampler of sending rates */
 
 double load = -1;   /* network load (mbps) */
 unsigned int req_total_num = 0; /* total number of requests to generate */
 unsigned int flow_total_num = 0;    /* total number of flows */
 unsigned int req_total_time = 0;    /* total time to generate requests */
 struct cdf_table *req_size_dist = NULL;
-unsigned int period_us;  /* average request arrival interval (us) */
+double period_ns; /* average request arrival interval (in nanoseconds) */
 
 /* per-request variables */
 unsigned int *req_size = NULL;  /* request size */
@@ -71,18 +101,44 @@ unsigned int *req_fanout = NULL;    /* request fanout size */
 unsigned int **req_server_flow_count = NULL;    /* number of flows (of this request) generated by each server */
 unsigned int *req_dscp = NULL;  /* DSCP of request */
 unsigned int *req_rate = NULL;  /* sending rate of request */
-unsigned int *req_sleep_us = NULL;  /* sleep time interval */
-struct timeval *req_start_time = NULL;  /* start time of request */
-struct timeval *req_stop_time = NULL;   /* stop time of request */
+double *req_interval_ns = NULL;  /* arrival interval (in nanoseconds) */
+unsigned long long *req_arrival_ns = NULL;  /* scheduled arrival time of request (CLOCK_MONOTONIC) */
+unsigned long long *req_start_ns = NULL;    /* dispatch time of request (CLOCK_MONOTONIC) */
+unsigned long long *req_send_first_ns = NULL;   /* send time of the first flow dispatched back-to-back (CLOCK_MONOTONIC, 0: none) */
+unsigned long long *req_send_last_ns = NULL;    /* send time of the last flow dispatched back-to-back (CLOCK_MONOTONIC) */
+unsigned long long *req_stop_ns = NULL; /* stop time of request (CLOCK_MONOTONIC, 0: unfinished) */
+atomic_ullong *req_header_ns = NULL;    /* arrival time of the first metadata of request (CLOCK_MONOTONIC, 0: none) */
+atomic_uint *req_flows_left = NULL;    /* flows of request that are not completed yet */
 
 /* per-flow variables */
 unsigned int *flow_req_id = NULL;   /* request ID of the flow */
-struct timeval *flow_start_time = NULL; /* start time of flow */
-struct timeval *flow_stop_time = NULL;  /* stop time of flow */
+unsigned long long *flow_start_ns = NULL;   /* start time of flow (CLOCK_MONOTONIC) */
+unsigned long long *flow_stop_ns = NULL;    /* stop time of flow (CLOCK_MONOTONIC, 0: unfinished) */
+unsigned long long *flow_header_ns = NULL;  /* arrival time of the metadata of flow (CLOCK_MONOTONIC) */
+unsigned long long *flow_wait_ns = NULL;    /* time flow waited for a connection before it was sent (ns) */
 
 struct conn_list *connection_lists = NULL;  /* connection pool */
 unsigned int global_flow_id = 0;
 
+/* flows of the request being sent that have a connection (max_fanout_size entries, allocated once) */
+struct flow_request *flow_reqs = NULL;
+unsigned int flow_reqs_num = 0; /* number of flows of the request being sent */
+
+/* dispatcher pool */
+pthread_t *dispatchers = NULL;  /* threads of the dispatcher pool */
+unsigned int num_started_dispatchers = 0;   /* dispatchers to stop */
+pthread_barrier_t dispatch_start;   /* releases the dispatchers to send the flows of a request */
+pthread_barrier_t dispatch_done;    /* the dispatchers have sent all the flows of a request */
+bool dispatch_stop = false; /* the dispatchers exit when they are released */
+
+/* refill thread of the reservation sets */
+pthread_t refill_thread;
+bool refill_started = false;
+bool refill_stop = false;   /* the refill thread exits */
+bool refill_kicked = false; /* a reservation set may be short */
+pthread_mutex_t refill_lock = PTHREAD_MUTEX_INITIALIZER;    /* protect refill_stop and refill_kicked */
+pthread_cond_t refill_cond = PTHREAD_COND_INITIALIZER;  /* signaled on refill_stop and refill_kicked */
+
 /* print usage of the program */
 void print_usage(char *program);
 /* read command line arguments */
@@ -91,14 +147,44 @@ void read_args(int argc, char *argv[]);
 void read_config(char *file_name);
 /* set request variables */
 void set_req_variables();
-/* receive traffic from established connections */
-void *listen_connection(void *ptr);
+/* complete a flow received on a connection (called by receiver threads) */
+void flow_done(struct conn_node *node, struct flow_metadata *flow);
+/* use a connection established in the background (called by receiver threads) */
+void conn_ready(struct conn_node *node, bool connected);
+/* send waiting flows on a held connection, then give the connection back to the pool */
+void serve_conn(struct conn_node *node);
 /* generate incast requests */
 void run_incast_requests();
-/* generate a incast request to some servers */
-void run_incast_request(unsigned int req_id);
-/* generate a flow request to a server */
-void *run_flow(void *ptr);
+/* dispatch a incast request that arrives at 'arrival_ns' to some servers, without waiting for connections */
+void run_incast_request(unsigned int req_id, unsigned long long arrival_ns);
+/* queue a flow until a connection to the server is available, and open one in the background if needed */
+void wait_flow(struct conn_list *list, struct flow_metadata *flow);
+/* open a connection to a server in the background and return true if it succeeds */
+bool open_conn(struct conn_list *list);
+/* size the reservation sets from the largest share of a server in a request */
+void init_reserves();
+/* take up to 'num' reserved connections to a server into flow_reqs and return how many */
+unsigned int take_reserved_conn(unsigned int server_id, unsigned int num);
+/* top up the reservation sets from the pools, and open connections in the background if the pools are empty */
+void refill_reserves();
+/* fill the reservation sets and start the refill thread */
+void start_refill();
+/* wake the refill thread up */
+void kick_refill();
+/* refill the reservation sets when kicked or every TG_REFILL_INTERVAL_US */
+void *run_refill(void *ptr);
+/* stop the refill thread and give the reserved connections back */
+void stop_refill();
+/* send the flows of the request in flow_reqs, on the generator or the dispatcher pool */
+void dispatch_flows();
+/* send the pre-encoded request of a flow and record its start time */
+void send_flow(struct flow_request *f);
+/* start the threads of the dispatcher pool */
+void start_dispatchers();
+/* send a share of the flows of every request (a thread of the dispatcher pool) */
+void *run_dispatcher(void *ptr);
+/* stop the threads of the dispatcher pool */
+void stop_dispatchers();
 /* terminate all existing connections */
 void exit_connections();
 /* terminate a connection */
@@ -112,6 +198,7 @@ int main(int argc, char *argv[])
 {
     unsigned int i = 0;
     struct conn_node *ptr = NULL;
+    struct timeval tv;
 
     /* read program arguments */
     read_args(argc, argv);
@@ -119,8 +206,8 @@ int main(int argc, char *argv[])
     /* set seed value for random number generation */
     if (seed == 0)
     {
-        gettimeofday(&tv_start, NULL);
-        srand((tv_start.tv_sec*1000000) + tv_start.tv_usec);
+        gettimeofday(&tv, NULL);
+        srand((tv.tv_sec*1000000) + tv.tv_usec);
     }
     else
         srand(seed);
@@ -130,13 +217,19 @@ int main(int argc, char *argv[])
     /* set request variables */
     set_req_variables();
 
-    /* calculate usleep overhead */
-    usleep_overhead_us = get_usleep_overhead(20);
-    if (verbose_mode)
+    /* a request is prepared in place, so sending it allocates nothing */
+    flow_reqs = (struct flow_request*)calloc(max_fanout_size, sizeof(struct flow_request));
+    if (!flow_reqs)
     {
-        printf("===========================================\n");
-        printf("The usleep overhead is %u us\n", usleep_overhead_us);
-        printf("===========================================\n");
+        cleanup();
+        error("Error: calloc flow requests");
+    }
+
+    /* start threads to receive traffic */
+    if (!init_receivers(num_receivers, flow_done, conn_ready, NULL))
+    {
+        cleanup();
+        error("Error: init_receivers");
     }
 
     /* we use calloc here to implicitly initialize struct conn_list as 0 */
@@ -164,35 +257,38 @@ int main(int argc, char *argv[])
             print_conn_list(&connection_lists[i]);
     }
 
-    /* start threads to receive traffic */
+    /* receive traffic from established connections */
     for (i = 0; i < num_server; i++)
     {
-        ptr = connection_lists[i].head;
-        while (true)
+        for (ptr = connection_lists[i].head; ptr; ptr = ptr->next)
         {
-            if (!ptr)
-                break;
-            else
+            if (!receiver_add_conn(ptr))
             {
-                pthread_create(&(ptr->thread), NULL, listen_connection, (void*)ptr);
-                ptr = ptr->next;
+                cleanup();
+                error("Error: receiver_add_conn");
             }
         }
     }
+    init_reserves();
 
     printf("===========================================\n");
     printf("Start to generate requests\n");
     printf("===========================================\n");
-    gettimeofday(&tv_start, NULL);
+    start_dispatchers();
+    start_refill();
+    traffic_start_ns = get_mono_ns();
     global_flow_id =  0;
+    atomic_init(&req_in_flight, 0);
     run_incast_requests();
+    stop_dispatchers();
+    stop_refill();
 
     /* close existing connections */
     printf("===========================================\n");
     printf("Exit connections\n");
     printf("===========================================\n");
     exit_connections();
-    gettimeofday(&tv_end, NULL);
+    traffic_end_ns = get_mono_ns();
 
     printf("===========================================\n");
     for (i = 0; i < num_server; i++)
@@ -233,8 +329,16 @@ void print_usage(char *program)
     printf("-n <number>     number of requests (instead of -t)\n");
     printf("-t <time>       time in seconds (instead of -n)\n");
     printf("-l <prefix>     log file name prefix (default %s)\n", log_prefix);
+    printf("-o <format>     format of the log files: text, text-ns (completion times in ns as the last column),\n");
+    printf("                text-ext (text-ns with TTFB, transfer time, wait and send skew) or binary (.bin\n");
+    printf("                instead of .txt) (default %s)\n", log_format_name(TG_LOG_TEXT));
     printf("-s <seed>       seed to generate random numbers (default current time)\n");
     printf("-r <file>       python script to parse result files\n");
+    printf("-w <num>        threads receiving traffic from all connections (default %d)\n", TG_DEFAULT_RECEIVERS);
+    printf("-p <mode>       wait for request arrivals: sleep, spin (sleep then busy-poll) or rt (spin with\n");
+    printf("                mlockall and SCHED_FIFO) (default %s)\n", wait_mode_name(TG_WAIT_SLEEP));
+    printf("-D <num>        threads sending the flows of each request together (default 0: the generator sends\n");
+    printf("                them back-to-back)\n");
     printf("-v              give more detailed output (verbose)\n");
     printf("-h              display help information\n");
 }
@@ -361,6 +465,60 @@ void read_args(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
         }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-w") == 0)
+        {
+            if (i+1 < argc && (unsigned int)strtoul(argv[i+1], NULL, 10) > 0)
+            {
+                num_receivers = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read number of receiver threads\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-D") == 0)
+        {
+            if (i+1 < argc)
+            {
+                num_dispatchers = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read number of dispatcher threads\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-o") == 0)
+        {
+            if (i+1 < argc && parse_log_format(argv[i+1], &log_format))
+            {
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read log format\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-p") == 0)
+        {
+            if (i+1 < argc && parse_wait_mode(argv[i+1], &wait_mode))
+            {
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read wait mode\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
         else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-v") == 0)
         {
             verbose_mode = true;
@@ -401,6 +559,13 @@ void read_args(int argc, char *argv[])
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
+
+    /* binary logs are not text files */
+    if (log_format == TG_LOG_BINARY)
+    {
+        strcpy(strrchr(fct_log_name, '.'), ".bin");
+        strcpy(strrchr(rct_log_name, '.'), ".bin");
+    }
 }
 
 /* read configuration file */
@@ -612,25 +777,35 @@ void read_config(char *file_name)
         if (verbose_mode)
             printf("Rate: %uMbps, Prob: %u\n", rate_value[0], rate_prob[0]);
     }
+
+    /* samplers built once from the configuration */
+    if (!init_alias_table(&dscp_dist, dscp_value, dscp_prob, num_dscp) || !init_alias_table(&rate_dist, rate_value, rate_prob, num_rate) ||
+        !init_alias_table(&fanout_dist, fanout_size, fanout_prob, num_fanout))
+    {
+        cleanup();
+        error("Error: init_alias_table");
+    }
 }
 
 /* set request variables */
 void set_req_variables()
 {
     unsigned int i, k, server_id, flow_id = 0;
+    double sizes[TG_CDF_BATCH]; /* request sizes, drawn in batches */
+    unsigned int num_sizes = 0, next_size = 0;
     unsigned long req_size_total = 0;
     double req_dscp_total = 0;
     unsigned long req_rate_total = 0;
-    unsigned long req_interval_total = 0;
+    double req_interval_total = 0;  /* ns */
 
     /* calculate average request arrival interval */
     if (load > 0)
     {
-        period_us = avg_cdf(req_size_dist) * 8 / load / TG_GOODPUT_RATIO;
-        if (period_us <= 0)
+        period_ns = avg_cdf(req_size_dist) * 8000 / load / TG_GOODPUT_RATIO;
+        if (period_ns <= 0)
         {
             cleanup();
-            error("Error: period_us is not positive");
+            error("Error: period_ns is not positive");
         }
     }
     else
@@ -641,7 +816,7 @@ void set_req_variables()
 
     /* transfer time to the number of requests */
     if (req_total_num == 0 && req_total_time > 0)
-        req_total_num = max((unsigned long)req_total_time * 1000000 / period_us, 1);
+        req_total_num = max((unsigned long)(req_total_time * 1000000000.0 / period_ns), 1);
 
     /*per-request variables */
     req_size = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
@@ -649,16 +824,26 @@ void set_req_variables()
     req_server_flow_count = (unsigned int**)calloc(req_total_num, sizeof(unsigned int*));
     req_dscp = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
     req_rate = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
-    req_sleep_us = (unsigned int*)calloc(req_total_num, sizeof(unsigned int));
-    req_start_time = (struct timeval*)calloc(req_total_num, sizeof(struct timeval));
-    req_stop_time = (struct timeval*)calloc(req_total_num, sizeof(struct timeval));
-
-    if (!req_size || !req_fanout || !req_server_flow_count || !req_dscp || !req_rate || !req_sleep_us || !req_start_time || !req_stop_time)
+    req_interval_ns = (double*)calloc(req_total_num, sizeof(double));
+    req_arrival_ns = (unsigned long long*)calloc(req_total_num, sizeof(unsigned long long));
+    req_start_ns = (unsigned long long*)calloc(req_total_num, sizeof(unsigned long long));
+    req_send_first_ns = (unsigned long long*)calloc(req_total_num, sizeof(unsigned long long));
+    req_send_last_ns = (unsigned long long*)calloc(req_total_num, sizeof(unsigned long long));
+    req_stop_ns = (unsigned long long*)calloc(req_total_num, sizeof(unsigned long long));
+    req_header_ns = (atomic_ullong*)calloc(req_total_num, sizeof(atomic_ullong));
+    req_flows_left = (atomic_uint*)calloc(req_total_num, sizeof(atomic_uint));
+
+    if (!req_size || !req_fanout || !req_server_flow_count || !req_dscp || !req_rate || !req_interval_ns || !req_arrival_ns || !req_start_ns || !req_send_first_ns || !req_send_last_ns || !req_stop_ns || !req_header_ns || !req_flows_left)
     {
         cleanup();
         error("Error: calloc per-request variables");
     }
 
+    /* request fanouts, DSCP values and sending rates */
+    gen_alias_values(&fanout_dist, req_fanout, req_total_num);
+    gen_alias_values(&dscp_dist, req_dscp, req_total_num);
+    gen_alias_values(&rate_dist, req_rate, req_total_num);
+
     /* per request */
     for (i = 0; i < req_total_num; i++)
     {
@@ -669,16 +854,20 @@ void set_req_variables()
             error("Error: calloc per-request variables");
         }
 
-        req_size[i] = gen_random_cdf(req_size_dist);    /* request size */
-        req_fanout[i] = gen_value_weight(fanout_size, fanout_prob, num_fanout, fanout_prob_total);  /* request fanout */
-        req_dscp[i] = gen_value_weight(dscp_value, dscp_prob, num_dscp, dscp_prob_total);    /* request DSCP */
-        req_rate[i] = gen_value_weight(rate_value, rate_prob, num_rate, rate_prob_total);   /* sending rate */
-        req_sleep_us[i] = poission_gen_interval(1.0/period_us); /* sleep interval based on poission process */
+        if (next_size == num_sizes)
+        {
+            num_sizes = min(req_total_num - i, TG_CDF_BATCH);
+            gen_random_cdf_n(req_size_dist, sizes, num_sizes);
+            next_size = 0;
+        }
+        req_size[i] = sizes[next_size++];   /* request size */
+        req_interval_ns[i] = poission_gen_interval(1.0/period_ns);  /* arrival interval based on poission process */
+        atomic_init(&req_flows_left[i], req_fanout[i]);
 
         req_size_total += req_size[i];
         req_dscp_total += req_dscp[i];
         req_rate_total += req_rate[i];
-        req_interval_total += req_sleep_us[i];
+        req_interval_total += req_interval_ns[i];
         flow_total_num += req_fanout[i];
 
         /* each flow in this request */
@@ -692,10 +881,12 @@ void set_req_variables()
 
     /* per-flow variables */
     flow_req_id = (unsigned int*)calloc(flow_total_num, sizeof(unsigned int));
-    flow_start_time = (struct timeval*)calloc(flow_total_num, sizeof(struct timeval));
-    flow_stop_time = (struct timeval*)calloc(flow_total_num, sizeof(struct timeval));
+    flow_start_ns = (unsigned long long*)calloc(flow_total_num, sizeof(unsigned long long));
+    flow_stop_ns = (unsigned long long*)calloc(flow_total_num, sizeof(unsigned long long));
+    flow_header_ns = (unsigned long long*)calloc(flow_total_num, sizeof(unsigned long long));
+    flow_wait_ns = (unsigned long long*)calloc(flow_total_num, sizeof(unsigned long long));
 
-    if (!flow_req_id || !flow_start_time || !flow_stop_time)
+    if (!flow_req_id || !flow_start_ns || !flow_stop_ns || !flow_header_ns || !flow_wait_ns)
     {
         cleanup();
         error("Error: calloc per-flow variables");
@@ -717,64 +908,72 @@ void set_req_variables()
         printf("%s:%u    %u flows\n", server_addr[i], server_port[i], server_flow_count[i]);
 
     printf("===========================================\n");
-    printf("The average request arrival interval is %lu us\n", req_interval_total/req_total_num);
+    printf("The average request arrival interval is %.3f us\n", req_interval_total/req_total_num/1000);
     printf("The average request size is %lu bytes\n", req_size_total/req_total_num);
     printf("The average flow size is %lu bytes\n", req_size_total/flow_total_num);
     printf("The average request fanout size is %.2f\n", (double)flow_total_num/req_total_num);
     printf("The average request DSCP value is %.2f\n", req_dscp_total/req_total_num);
     printf("The average request sending rate is %lu Mbps\n", req_rate_total/req_total_num);
-    printf("The expected experiment duration is %lu s\n", req_interval_total/1000000);
+    printf("The expected experiment duration is %lu s\n", (unsigned long)(req_interval_total/1000000000));
 }
 
-/* receive traffic from established connections */
-void *listen_connection(void *ptr)
+/* complete a flow received on a connection (called by receiver threads) */
+void flow_done(struct conn_node *node, struct flow_metadata *flow)
 {
-    struct conn_node *node = (struct conn_node*)ptr;
-    struct flow_metadata flow;
-    char read_buf[TG_MAX_READ] = {0};
+    unsigned long long now_ns = get_mono_ns();
+    unsigned int req_id = flow_req_id[flow->id - 1];
+    unsigned long long first_ns = 0;
 
-    while (true)
+    flow_stop_ns[flow->id - 1] = now_ns;
+    flow_header_ns[flow->id - 1] = node->header_ns;
+    flow_wait_ns[flow->id - 1] = node->wait_ns;
+
+    /* the first byte of a request is the first metadata of its flows */
+    while (!atomic_compare_exchange_weak(&req_header_ns[req_id], &first_ns, node->header_ns))
     {
-        if (!read_flow_metadata(node->sockfd, &flow))
-        {
-            perror("Error: read meatadata");
+        if (first_ns != 0 && first_ns <= node->header_ns)
             break;
-        }
+    }
 
-        if (read_exact(node->sockfd, read_buf, flow.size, TG_MAX_READ, true) != flow.size)
-        {
-            perror("Error: receive flow");
-            break;
-        }
+    /* requests overlap, so the last flow of a request (on any receiver) completes it */
+    if (atomic_fetch_sub(&req_flows_left[req_id], 1) == 1)
+    {
+        req_stop_ns[req_id] = now_ns;
+        atomic_fetch_sub(&req_in_flight, 1);
+    }
 
-        node->busy = false;
-        pthread_mutex_lock(&(node->list->lock));
+    /* the connection may carry a waiting flow from now on */
+    atomic_fetch_add(&(node->list->flow_finished), 1);
+    if (finish_conn_req(node))
+        serve_conn(node);
+}
 
-        /* not the special flow ID */
-        if (flow.id != 0)
-        {
-            node->list->flow_finished++;
-            node->list->available_len++;
-        }
-        /* Ohterwise, it's a special flow ID to terminate connection.
-           So this connection will no longer be available. */
-        pthread_mutex_unlock(&(node->list->lock));
+/* use a connection established in the background (called by receiver threads) */
+void conn_ready(struct conn_node *node, bool connected)
+{
+    struct flow_metadata flow;
 
-        /* a special flow ID to terminate persistent connection */
-        if (flow.id == 0)
-            break;
-        else
-        {
-            gettimeofday(&flow_stop_time[flow.id - 1], NULL);
-            gettimeofday(&req_stop_time[flow_req_id[flow.id - 1]], NULL);
-        }
-    }
+    if (connected)
+        serve_conn(node);
+    /* its request will never complete */
+    else if (dequeue_pending_flow(node->list, &flow, true, NULL))
+        printf("Error: cannot establish a new connection to %s:%hu for flow %u\n", node->list->ip, node->list->port, flow.id);
+}
 
-    close(node->sockfd);
-    node->connected = false;
-    node->busy = false;
+/* send waiting flows on a held connection, then give the connection back to the pool */
+void serve_conn(struct conn_node *node)
+{
+    struct flow_metadata flow;
+    unsigned long long wait_ns;
 
-    return (void*)0;
+    while (conn_node_outstanding(node) < node->list->depth && dequeue_pending_flow(node->list, &flow, false, &wait_ns))
+    {
+        flow_start_ns[flow.id - 1] = get_mono_ns();
+        start_conn_req(node, flow.id, wait_ns);
+        if (!write_flow_req(node->sockfd, &flow))
+            perror("Error: write metadata");
+    }
+    release_conn_list(node);
 }
 
 /* generate incast requests */
@@ -782,23 +981,35 @@ void run_incast_requests()
 {
     unsigned int i = 0;
     unsigned int k = 1;
-    unsigned int req_duration_us = 0;
-    int sleep_us = 0;
-    struct timeval req_tv_start, req_tv_end;
+    unsigned long long start_ns;
+    unsigned long long late_ns;
+    double offset_ns = 0;   /* arrival time of the next request (relative to start_ns) */
 
-    for (i = 0; i < req_total_num; i++)
+    if (wait_mode == TG_WAIT_REALTIME && !set_realtime_thread())
+        printf("Cannot run the generator with real-time priority, only spin\n");
+    if (wait_mode != TG_WAIT_SLEEP)
     {
-        gettimeofday(&req_tv_start, NULL);
-        run_incast_request(i);
-        gettimeofday(&req_tv_end, NULL);
-        req_duration_us = (req_tv_end.tv_sec - req_tv_start.tv_sec) * 1000000 + req_tv_end.tv_usec - req_tv_start.tv_usec;
-
-        sleep_us = sleep_us + req_sleep_us[i];
-        if (sleep_us > usleep_overhead_us + req_duration_us)
+        init_precise_clock(&arrival_clock);
+        if (verbose_mode)
         {
-            usleep(sleep_us - usleep_overhead_us - req_duration_us);
-            sleep_us = 0;
+            printf("===========================================\n");
+            printf("The initial spin threshold is %.3f us\n", (double)precise_clock_threshold(&arrival_clock) / 1000);
+            printf("===========================================\n");
         }
+    }
+
+    start_ns = get_mono_ns();
+    for (i = 0; i < req_total_num; i++)
+    {
+        /* absolute deadlines: the time spent on a request and late wake-ups do not add up as drift */
+        if (wait_mode == TG_WAIT_SLEEP)
+            late_ns = sleep_until_ns(start_ns + (unsigned long long)offset_ns);
+        else
+            late_ns = precise_sleep_until_ns(&arrival_clock, start_ns + (unsigned long long)offset_ns);
+        arrival_late_ns_total += late_ns;
+        arrival_late_ns_max = max(arrival_late_ns_max, late_ns);
+        run_incast_request(i, start_ns + (unsigned long long)offset_ns);
+        offset_ns += req_interval_ns[i];
 
         if (!verbose_mode && i + 1 >= k * req_total_num / 100)
         {
@@ -810,130 +1021,378 @@ void run_incast_requests()
         printf("\n");
 }
 
-/* generate a incast request to some servers */
-void run_incast_request(unsigned int req_id)
+/* dispatch a incast request that arrives at 'arrival_ns' to some servers, without waiting for connections */
+void run_incast_request(unsigned int req_id, unsigned long long arrival_ns)
 {
-    unsigned int conn_id, num_conn, num_conn_new = 0;
-    unsigned int i, k = 0;
-    struct flow_request *flow_reqs = (struct flow_request*)malloc(req_fanout[req_id] * sizeof(struct flow_request));
-    pthread_t *threads = (pthread_t*)malloc(req_fanout[req_id] * sizeof(pthread_t));
-    struct conn_node **incast_server_conn = NULL;   /* per-server incast connections */
-    struct conn_node *tail_node = NULL;
-
-    if (!flow_reqs || !threads)
+    struct conn_list *list = NULL;
+    struct conn_node *node = NULL;
+    struct flow_metadata flow;
+    unsigned int tos = req_dscp[req_id] * 4;    /* ToS = 4 * DSCP */
+    unsigned int i, k, num_reserved, in_flight;
+
+    req_arrival_ns[req_id] = arrival_ns;
+    req_start_ns[req_id] = get_mono_ns();
+    in_flight = atomic_fetch_add(&req_in_flight, 1) + 1;
+    req_in_flight_max = max(req_in_flight_max, in_flight);
+
+    flow_reqs_num = 0;
+    for (i = 0; i < num_server; i++)
     {
-        perror("Error: malloc");
-        free(flow_reqs);
-        free(threads);
+        list = &connection_lists[i];
+        num_reserved = take_reserved_conn(i, req_server_flow_count[req_id][i]);
+        for (k = 0; k < req_server_flow_count[req_id][i]; k++)
+        {
+            flow.id = ++global_flow_id; /* reserve flow ID 0 to terminate connections */
+            flow.size = req_size[req_id]/req_fanout[req_id];
+            flow.tos = tos;
+            flow.rate = req_rate[req_id];
+
+            /* more flows than reserved connections (e.g. overlapping requests) wait for one */
+            if (k >= num_reserved)
+            {
+                num_unreserved_flow++;
+                wait_flow(list, &flow);
+                continue;
+            }
+
+            /* do everything but the write before the first flow is sent */
+            node = flow_reqs[flow_reqs_num].node;
+            flow_reqs[flow_reqs_num].metadata = flow;
+            encode_flow_metadata(flow_reqs[flow_reqs_num].buf, &flow);
+            if (setsockopt(node->sockfd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0)
+                perror("Error: set IP_TOS option");
+            flow_reqs_num++;
+        }
+    }
+
+    if (flow_reqs_num > 0)
+    {
+        dispatch_flows();
+        /* flows sent later from the pool measure queueing, so only these count towards the send skew */
+        req_send_first_ns[req_id] = req_send_last_ns[req_id] = flow_start_ns[flow_reqs[0].metadata.id - 1];
+        for (i = 1; i < flow_reqs_num; i++)
+        {
+            req_send_first_ns[req_id] = min(req_send_first_ns[req_id], flow_start_ns[flow_reqs[i].metadata.id - 1]);
+            req_send_last_ns[req_id] = max(req_send_last_ns[req_id], flow_start_ns[flow_reqs[i].metadata.id - 1]);
+        }
+    }
+    kick_refill();
+}
+
+/* queue a flow until a connection to the server is available, and open one in the background if needed */
+void wait_flow(struct conn_list *list, struct flow_metadata *flow)
+{
+    struct conn_node *node = NULL;
+    struct flow_metadata dropped;
+
+    if (!enqueue_pending_flow(list, flow))
+    {
+        printf("Error: cannot queue flow %u to %s:%hu\n", flow->id, list->ip, list->port);
         return;
     }
 
-    conn_id = 0;
-    /* pre-establish all connections of this incast request*/
-    for (i = 0; i < num_server; i++)
+    /* every waiting flow has a connection on its way */
+    if (atomic_load(&(list->pending_len)) > atomic_load(&(list->connecting)) && !open_conn(list))
     {
-        num_conn = req_server_flow_count[req_id][i];
-        if (num_conn == 0)  /* no connection to this server */
-            continue;
+        if (dequeue_pending_flow(list, &dropped, true, NULL))
+            printf("Error: cannot establish a new connection to %s:%hu for flow %u\n", list->ip, list->port, dropped.id);
+    }
 
-        num_conn_new = max(num_conn - connection_lists[i].available_len, 0);    /* number of new connections we need to establish */
-        if (num_conn_new > 0)
-        {
-            tail_node = connection_lists[i].tail;
-            /* establish new connections */
-            if (insert_conn_list(&connection_lists[i], num_conn_new))
-            {
-                /* start listen_connection threads on new established connections */
-                while (true)
-                {
-                    tail_node = tail_node->next;
-                    if (tail_node)
-                        pthread_create(&(tail_node->thread), NULL, listen_connection, (void*)tail_node);
-                    else
-                        break;
-                }
+    /* a connection may have been released in the meantime */
+    if ((node = acquire_conn_list(list)))
+        serve_conn(node);
+}
 
-                if (verbose_mode)
-                    printf("Establish %u new connections to %s:%u (available/total = %u/%u)\n", num_conn_new, server_addr[i], server_port[i], connection_lists[i].available_len, connection_lists[i].len);
-            }
-            else
-            {
-                if (verbose_mode)
-                    printf("Cannot establish %u new connections to %s:%u (available/total = %u/%u)\n", num_conn_new, server_addr[i], server_port[i], connection_lists[i].available_len, connection_lists[i].len);
+/* open a connection to a server in the background and return true if it succeeds */
+bool open_conn(struct conn_list *list)
+{
+    struct conn_node *node = insert_conn_list_async(list);
 
-                perror("Error: insert_conn_list");
-                free(flow_reqs);
-                free(threads);
-                return;
-            }
+    if (node && receiver_add_pending_conn(node))
+    {
+        if (verbose_mode)
+            printf("Establish a new connection to %s:%hu (available/total = %u/%u)\n", list->ip, list->port, atomic_load(&(list->available_len)), atomic_load(&(list->len)));
+        return true;
+    }
+
+    cancel_conn_node(node);
+    return false;
+}
+
+/* size the reservation sets from the largest share of a server in a request */
+void init_reserves()
+{
+    unsigned int i, k;
+    struct conn_reserve *res = NULL;
+
+    reserves = (struct conn_reserve*)calloc(num_server, sizeof(struct conn_reserve));
+    if (!reserves)
+    {
+        cleanup();
+        error("Error: calloc reserves");
+    }
+
+    for (i = 0; i < num_server; i++)
+    {
+        res = &reserves[i];
+        /* requests are generated in advance, so we know how many flows to a server a request can have */
+        for (k = 0; k < req_total_num; k++)
+            res->target = max(res->target, req_server_flow_count[k][i]);
+
+        res->mask = 1;
+        while (res->mask < res->target)
+            res->mask <<= 1;
+        res->mask--;
+
+        res->nodes = (struct conn_node**)calloc(res->mask + 1, sizeof(struct conn_node*));
+        if (!res->nodes)
+        {
+            cleanup();
+            error("Error: calloc reserved connections");
         }
+        atomic_init(&(res->head), 0);
+        atomic_init(&(res->tail), 0);
+    }
+}
+
+/* take up to 'num' reserved connections to a server into flow_reqs and return how many */
+unsigned int take_reserved_conn(unsigned int server_id, unsigned int num)
+{
+    struct conn_reserve *res = &reserves[server_id];
+    unsigned int head = atomic_load_explicit(&(res->head), memory_order_relaxed);
+    unsigned int i;
+
+    num = min(num, atomic_load_explicit(&(res->tail), memory_order_acquire) - head);
+    for (i = 0; i < num; i++)
+        flow_reqs[flow_reqs_num + i].node = res->nodes[(head + i) & res->mask];
+
+    /* the refill thread may reuse the slots from now on */
+    atomic_store_explicit(&(res->head), head + num, memory_order_release);
+    return num;
+}
 
-        incast_server_conn = search_n_conn_list(&connection_lists[i], num_conn);
-        if (incast_server_conn)
+/* top up the reservation sets from the pools, and open connections in the background if the pools are empty */
+void refill_reserves()
+{
+    unsigned int i, tail, reserved;
+    struct conn_reserve *res = NULL;
+    struct conn_list *list = NULL;
+    struct conn_node *node = NULL;
+
+    for (i = 0; i < num_server; i++)
+    {
+        res = &reserves[i];
+        list = &connection_lists[i];
+        tail = atomic_load_explicit(&(res->tail), memory_order_relaxed);
+        while ((reserved = tail - atomic_load_explicit(&(res->head), memory_order_acquire)) < res->target)
         {
-            for (k = 0; k < num_conn; k++)
+            node = acquire_conn_list(list);
+            if (!node)
             {
-                flow_reqs[conn_id].node = incast_server_conn[k];
-                flow_reqs[conn_id].metadata.id = global_flow_id + 1; /* reserve flow ID 0 to terminate connections */
-                flow_reqs[conn_id].metadata.size = req_size[req_id]/req_fanout[req_id];
-                flow_reqs[conn_id].metadata.tos = req_dscp[req_id] * 4;  /* ToS = 4 * DSCP */
-                flow_reqs[conn_id].metadata.rate = req_rate[req_id];
-                conn_id++;
-                global_flow_id++;
+                /* new connections join the pool once established, and the next refill takes them */
+                while (atomic_load(&(list->connecting)) < res->target - reserved && open_conn(list));
+                break;
             }
-            free(incast_server_conn);
+
+            /* flows waiting for a connection go first */
+            if (atomic_load(&(list->pending_len)) > 0)
+            {
+                serve_conn(node);
+                continue;
+            }
+
+            res->nodes[tail & res->mask] = node;
+            atomic_store_explicit(&(res->tail), ++tail, memory_order_release);
         }
-        else
+    }
+}
+
+/* fill the reservation sets and start the refill thread */
+void start_refill()
+{
+    refill_reserves();
+    if (pthread_create(&refill_thread, NULL, run_refill, NULL) != 0)
+    {
+        cleanup();
+        error("Error: pthread_create refill thread");
+    }
+    refill_started = true;
+}
+
+/* wake the refill thread up */
+void kick_refill()
+{
+    pthread_mutex_lock(&refill_lock);
+    refill_kicked = true;
+    pthread_cond_signal(&refill_cond);
+    pthread_mutex_unlock(&refill_lock);
+}
+
+/* refill the reservation sets when kicked or every TG_REFILL_INTERVAL_US */
+void *run_refill(void *ptr)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&refill_lock);
+    while (!refill_stop)
+    {
+        refill_kicked = false;
+        pthread_mutex_unlock(&refill_lock);
+        refill_reserves();
+        pthread_mutex_lock(&refill_lock);
+
+        /* connections released by receivers are only picked up on the next kick or timeout */
+        if (!refill_kicked && !refill_stop)
         {
-            perror("Error: search_n_conn_list");
-            free(flow_reqs);
-            free(threads);
-            return;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += TG_REFILL_INTERVAL_US * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&refill_cond, &refill_lock, &deadline);
         }
     }
+    pthread_mutex_unlock(&refill_lock);
+
+    return (void*)0;
+}
+
+/* stop the refill thread and give the reserved connections back */
+void stop_refill()
+{
+    unsigned int i, head, tail;
+
+    if (!refill_started)
+        return;
 
-    if (conn_id != req_fanout[req_id])
+    pthread_mutex_lock(&refill_lock);
+    refill_stop = true;
+    pthread_cond_signal(&refill_cond);
+    pthread_mutex_unlock(&refill_lock);
+    pthread_join(refill_thread, NULL);
+    refill_started = false;
+
+    /* a reserved connection serves the flows still waiting before it goes back to the pool */
+    for (i = 0; i < num_server; i++)
     {
-        perror("Error: no enough connections");
-        free(flow_reqs);
-        free(threads);
+        tail = atomic_load(&(reserves[i].tail));
+        for (head = atomic_load(&(reserves[i].head)); head != tail; head++)
+            serve_conn(reserves[i].nodes[head & reserves[i].mask]);
+        atomic_store(&(reserves[i].head), tail);
+    }
+}
+
+/* send the flows of the request in flow_reqs, on the generator or the dispatcher pool */
+void dispatch_flows()
+{
+    unsigned int i;
+
+    if (num_started_dispatchers == 0)
+    {
+        for (i = 0; i < flow_reqs_num; i++)
+            send_flow(&flow_reqs[i]);
         return;
     }
 
-    gettimeofday(&req_start_time[req_id], NULL);
-    /* generate requests to servers */
-    for (i = 0; i < req_fanout[req_id]; i++)
-        pthread_create(&threads[i], NULL, run_flow, (void*)(&flow_reqs[i]));
+    /* barriers order flow_reqs between the generator and the dispatchers */
+    pthread_barrier_wait(&dispatch_start);
+    pthread_barrier_wait(&dispatch_done);
+}
 
-    for (i = 0; i < req_fanout[req_id]; i++)
-        pthread_join(threads[i], NULL);
+/* send the pre-encoded request of a flow and record its start time */
+void send_flow(struct flow_request *f)
+{
+    int n;
 
-    free(flow_reqs);
-    free(threads);
+    flow_start_ns[f->metadata.id - 1] = get_mono_ns();
+    start_conn_req(f->node, f->metadata.id, 0);
+    /* the ToS is already set, so a request is a single write() */
+    n = write(f->node->sockfd, f->buf, TG_METADATA_SIZE);
+    if (n != TG_METADATA_SIZE)
+    {
+        n = max(n, 0);
+        if (write_exact(f->node->sockfd, f->buf + n, TG_METADATA_SIZE - n, TG_METADATA_SIZE, 0, f->metadata.tos, 0, false) != TG_METADATA_SIZE - n)
+            perror("Error: write metadata");
+    }
+
+    /* the connection stays out of the pool until its flow completes */
+    release_conn_list(f->node);
 }
 
-/* Generate a flow request to a server */
-void *run_flow(void *ptr)
+/* start the threads of the dispatcher pool */
+void start_dispatchers()
 {
-    struct flow_request f = *(struct flow_request*)ptr;
-    struct conn_node *node = f.node;
-    int sockfd = node->sockfd;
+    unsigned long i;
 
-    /* Send request and record start time */
-    if (f.metadata.id > 0)
-        gettimeofday(&flow_start_time[f.metadata.id - 1], NULL);
+    if (num_dispatchers == 0)
+        return;
 
-    node->busy = true;
-    pthread_mutex_lock(&(node->list->lock));
-    node->list->available_len--;
-    pthread_mutex_unlock(&(node->list->lock));
+    dispatchers = (pthread_t*)calloc(num_dispatchers, sizeof(pthread_t));
+    if (!dispatchers)
+    {
+        cleanup();
+        error("Error: calloc dispatchers");
+    }
 
-    if (!write_flow_req(sockfd, &(f.metadata)))
-        perror("Error: write metadata");
+    /* the generator waits on the barriers with the dispatchers */
+    if (pthread_barrier_init(&dispatch_start, NULL, num_dispatchers + 1) != 0 ||
+        pthread_barrier_init(&dispatch_done, NULL, num_dispatchers + 1) != 0)
+    {
+        cleanup();
+        error("Error: pthread_barrier_init");
+    }
+
+    for (i = 0; i < num_dispatchers; i++)
+    {
+        if (pthread_create(&dispatchers[i], NULL, run_dispatcher, (void*)i) != 0)
+        {
+            cleanup();
+            error("Error: pthread_create dispatcher");
+        }
+    }
+    num_started_dispatchers = num_dispatchers;
+
+    if (verbose_mode)
+        printf("Start %u threads to send the flows of each request\n", num_dispatchers);
+}
+
+/* send a share of the flows of every request (a thread of the dispatcher pool) */
+void *run_dispatcher(void *ptr)
+{
+    unsigned int id = (unsigned int)(unsigned long)ptr;
+    unsigned int i;
+
+    while (true)
+    {
+        pthread_barrier_wait(&dispatch_start);
+        if (dispatch_stop)
+            break;
+
+        for (i = id; i < flow_reqs_num; i += num_dispatchers)
+            send_flow(&flow_reqs[i]);
+        pthread_barrier_wait(&dispatch_done);
+    }
 
     return (void*)0;
 }
 
+/* stop the threads of the dispatcher pool */
+void stop_dispatchers()
+{
+    unsigned int i;
+
+    if (num_started_dispatchers == 0)
+        return;
+
+    dispatch_stop = true;
+    pthread_barrier_wait(&dispatch_start);
+    for (i = 0; i < num_started_dispatchers; i++)
+        pthread_join(dispatchers[i], NULL);
+    num_started_dispatchers = 0;
+
+    pthread_barrier_destroy(&dispatch_start);
+    pthread_barrier_destroy(&dispatch_done);
+}
+
 /* terminate all existing connections */
 void exit_connections()
 {
@@ -941,9 +1400,12 @@ void exit_connections()
     struct conn_node *ptr = NULL;
     unsigned int num = 0;
 
-    /* start threads to receive traffic */
     for (i = 0; i < num_server; i++)
     {
+        /* let waiting flows and background connect() calls finish first */
+        while (atomic_load(&(connection_lists[i].pending_len)) > 0 || atomic_load(&(connection_lists[i].connecting)) > 0)
+            usleep(1000);
+
         num = 0;
         ptr = connection_lists[i].head;
         while (true)
@@ -960,38 +1422,43 @@ void exit_connections()
                 ptr = ptr->next;
             }
         }
-        wait_conn_list(&connection_lists[i]);
         if (verbose_mode)
             printf("Exit %u/%u connections to %s:%u\n", num, connection_lists[i].len, server_addr[i], server_port[i]);
     }
+
+    /* wait for the servers to close all connections */
+    wait_receivers();
 }
 
 /* terminate a connection */
 void exit_connection(struct conn_node *node)
 {
-    struct flow_request req;
-    req.node = node;
-    req.metadata.id = 0;
-    req.metadata.size = 100;
-    req.metadata.tos = 0;
-    req.metadata.rate = 0;
-
-    run_flow((void*)&req);
+    struct flow_metadata metadata;
+    metadata.id = 0;
+    metadata.size = 100;
+    metadata.tos = 0;
+    metadata.rate = 0;
+
+    if (!write_flow_req(node->sockfd, &metadata))
+        perror("Error: write metadata");
 }
 
 void print_statistic()
 {
-    unsigned long long duration_us = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec;
+    unsigned long long duration_us = max((traffic_end_ns - traffic_start_ns) / 1000, 1);
     unsigned long long req_size_total = 0;
-    unsigned long long fct_us, rct_us;
-    unsigned int flow_goodput_mbps, req_goodput_mbps;   /* per-flow/request goodput (Mbps) */
+    struct log_record r;
+    struct flow_stats *rct_stats = new_flow_stats();
+    struct flow_stats *fct_stats = new_flow_stats();
+    struct histogram *skew_hist = (struct histogram*)calloc(1, sizeof(struct histogram));   /* send skew (ns) */
     unsigned int goodput_mbps;  /* total goodput (Mbps) */
     unsigned int req_id;
     unsigned int i = 0;
     FILE *fd = NULL;
 
+    memset(&r, 0, sizeof(r));
     fd = fopen(rct_log_name, "w");
-    if (!fd)
+    if (!fd || !begin_log_file(fd, log_format, TG_LOG_REQUEST))
     {
         cleanup();
         error("Error: open the RCT result file");
@@ -1000,25 +1467,34 @@ void print_statistic()
     for (i = 0; i < req_total_num; i++)
     {
         req_size_total += req_size[i];
-        if ((req_stop_time[i].tv_sec == 0) && (req_stop_time[i].tv_usec == 0))
+        if (req_stop_ns[i] == 0)
         {
             printf("Unfinished request %u\n", i);
             continue;
         }
 
-        rct_us = (req_stop_time[i].tv_sec - req_start_time[i].tv_sec) * 1000000 + req_stop_time[i].tv_usec - req_start_time[i].tv_usec;
-        if (rct_us > 0)
-            req_goodput_mbps = req_size[i] * 8 / rct_us;
-        else
-            req_goodput_mbps = 0;
-
-        /* request size, RCT(us), DSCP, sending rate (Mbps), goodput (Mbps), fanout */
-        fprintf(fd, "%u %llu %u %u %u %u\n", req_size[i], rct_us, req_dscp[i], req_rate[i], req_goodput_mbps, req_fanout[i]);
+        /* the RCT runs from the dispatch, the lateness of the dispatch is the wait */
+        set_log_fct_ns(&r, req_stop_ns[i] - req_start_ns[i]);
+        r.wait_ns = req_start_ns[i] - min(req_arrival_ns[i], req_start_ns[i]);
+        r.ttfb_ns = atomic_load(&req_header_ns[i]) - req_start_ns[i];
+        r.size = req_size[i];
+        r.dscp = req_dscp[i];
+        r.rate = req_rate[i];
+        r.fanout = req_fanout[i];
+        /* send skew: how far apart the "synchronized" flows actually left */
+        r.skew_ns = req_send_last_ns[i] - req_send_first_ns[i];
+        set_log_goodput(&r);
+        flow_stats_add(rct_stats, &r);
+        /* a request with no reserved connection was not sent back-to-back at all */
+        if (skew_hist && req_send_first_ns[i] > 0)
+            histogram_add(skew_hist, r.skew_ns);
+        write_log_record(fd, &r, log_format, TG_LOG_REQUEST);
     }
     fclose(fd);
+    r.skew_ns = 0;
 
     fd = fopen(fct_log_name, "w");
-    if (!fd)
+    if (!fd || !begin_log_file(fd, log_format, TG_LOG_FLOW))
     {
         cleanup();
         error("Error: open the FCT result file");
@@ -1026,27 +1502,47 @@ void print_statistic()
 
     for (i = 0; i < flow_total_num; i++)
     {
-        if ((flow_stop_time[i].tv_sec == 0) && (flow_stop_time[i].tv_usec == 0))
+        if (flow_stop_ns[i] == 0)
         {
             printf("Unfinished flow %u\n", i);
             continue;
         }
 
-        fct_us = (flow_stop_time[i].tv_sec - flow_start_time[i].tv_sec) * 1000000 + flow_stop_time[i].tv_usec - flow_start_time[i].tv_usec;
         req_id = flow_req_id[i];
-        if (fct_us > 0)
-            flow_goodput_mbps = req_size[req_id] / req_fanout[req_id] * 8 / fct_us;
-        else
-            flow_goodput_mbps = 0;
-
-        /* flow size, FCT(us), DSCP, sending rate (Mbps), goodput (Mbps) */
-        fprintf(fd, "%u %llu %u %u %u\n", req_size[req_id]/req_fanout[req_id], fct_us, req_dscp[req_id], req_rate[req_id], flow_goodput_mbps);
+        set_log_fct_ns(&r, flow_stop_ns[i] - flow_start_ns[i]);
+        r.ttfb_ns = flow_header_ns[i] - flow_start_ns[i];
+        r.size = req_size[req_id]/req_fanout[req_id];
+        r.dscp = req_dscp[req_id];
+        r.rate = req_rate[req_id];
+        r.fanout = 0;
+        r.wait_ns = flow_wait_ns[i];
+        set_log_goodput(&r);
+        flow_stats_add(fct_stats, &r);
+        write_log_record(fd, &r, log_format, TG_LOG_FLOW);
     }
     fclose(fd);
 
     goodput_mbps = req_size_total * 8 / duration_us;
     printf("The actual RX throughput is %u Mbps\n", (unsigned int)(goodput_mbps/TG_GOODPUT_RATIO));
     printf("The actual duration is %llu s\n", duration_us/1000000);
+    printf("The average lateness of request arrivals is %.3f us (max %.3f us)\n",
+           (double)arrival_late_ns_total / max(req_total_num, 1) / 1000, (double)arrival_late_ns_max / 1000);
+    if (wait_mode != TG_WAIT_SLEEP)
+        print_precise_clock(&arrival_clock);
+    printf("At most %u requests were in flight at once\n", req_in_flight_max);
+    printf("%u flows found no reserved connection and waited for one\n", num_unreserved_flow);
+    if (skew_hist)
+    {
+        printf("The send skew of flows sent back-to-back is %.3f us on average (p50 %.3f us, p99 %.3f us, max %.3f us)\n",
+               histogram_mean(skew_hist) / 1000, (double)histogram_percentile(skew_hist, 0.5) / 1000,
+               (double)histogram_percentile(skew_hist, 0.99) / 1000, (double)histogram_max(skew_hist) / 1000);
+        free(skew_hist);
+    }
+    printf("===========================================\n");
+    print_flow_stats(rct_stats, "requests");
+    print_flow_stats(fct_stats, "flows");
+    free_flow_stats(rct_stats);
+    free_flow_stats(fct_stats);
     printf("===========================================\n");
     printf("Write RCT results to %s\n", rct_log_name);
     printf("Write FCT results to %s\n", fct_log_name);
@@ -1061,14 +1557,24 @@ void cleanup()
     free(server_addr);
     free(server_flow_count);
 
+    if (reserves)
+    {
+        for (i = 0; i < num_server; i++)
+            free(reserves[i].nodes);
+    }
+    free(reserves);
+
     free(fanout_size);
     free(fanout_prob);
+    free_alias_table(&fanout_dist);
 
     free(dscp_value);
     free(dscp_prob);
+    free_alias_table(&dscp_dist);
 
     free(rate_value);
     free(rate_prob);
+    free_alias_table(&rate_dist);
 
     free_cdf(req_size_dist);
     free(req_size_dist);
@@ -1077,9 +1583,14 @@ void cleanup()
     free(req_fanout);
     free(req_dscp);
     free(req_rate);
-    free(req_sleep_us);
-    free(req_start_time);
-    free(req_stop_time);
+    free(req_interval_ns);
+    free(req_arrival_ns);
+    free(req_start_ns);
+    free(req_send_first_ns);
+    free(req_send_last_ns);
+    free(req_stop_ns);
+    free(req_header_ns);
+    free(req_flows_left);
 
     if (req_server_flow_count)
     {
@@ -1089,8 +1600,13 @@ void cleanup()
     free(req_server_flow_count);
 
     free(flow_req_id);
-    free(flow_start_time);
-    free(flow_stop_time);
+    free(flow_start_ns);
+    free(flow_stop_ns);
+    free(flow_header_ns);
+    free(flow_wait_ns);
+
+    free(flow_reqs);
+    free(dispatchers);
 
     if (connection_lists)
     {
@@ -10,6 +10,7 @@
 #include <sys/time.h>
 
 #include "../common/common.h"
+#include "../common/clock.h"
 
 char server_ip[16] = {0};   /* sender IP address */
 char read_buf[TG_MAX_READ] = {1};
@@ -27,11 +28,12 @@ void read_args(int argc, char *argv[]);
 int main(int argc, char *argv[])
 {
     unsigned int i = 0;
-    struct timeval tv_start, tv_end;    /* start and end time */
+    unsigned long long start_ns;    /* start time (CLOCK_MONOTONIC) */
     int sockfd; /* socket */
     int sock_opt = 1;
     struct sockaddr_in serv_addr;   /* server address */
     unsigned int fct_us;
+    unsigned int ttfb_us;   /* time to first byte */
     unsigned int goodput_mbps;
     flow.size = 1024;  /* flow size in bytes */
     flow.tos = 0;  /* ToS value of flows */
@@ -68,23 +70,23 @@ int main(int argc, char *argv[])
         if (!set_flow_tos)
             flow.tos += 4;
 
-        gettimeofday(&tv_start, NULL);
+        start_ns = get_mono_ns();
 
         if (!write_flow_req(sockfd, &flow))
             error("Error: generate request");
 
         if (!read_flow_metadata(sockfd, &flow))
             error("Error: read metadata");
+        ttfb_us = (get_mono_ns() - start_ns) / 1000;
 
         if (read_exact(sockfd, read_buf, flow.size, TG_MAX_READ, true) != flow.size)
             error("Error: receive flow");
 
-        gettimeofday(&tv_end, NULL);
-        fct_us = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + (tv_end.tv_usec - tv_start.tv_usec);
+        fct_us = max((get_mono_ns() - start_ns) / 1000, 1);
         goodput_mbps = flow.size * 8 / fct_us;
 
         printf("Flow: ID: %u\nSize: %u bytes ToS: %u Rate: %u Mbps\n", flow.id, flow.size, flow.tos, flow.rate);
-        printf("FCT: %u us Goodput: %u Mbps\n", fct_us, goodput_mbps);
+        printf("FCT: %u us TTFB: %u us Goodput: %u Mbps\n", fct_us, ttfb_us, goodput_mbps);
     }
 
     close(sockfd);
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "alias.h"
+
+/* random bits of a draw of rand() */
+#define TG_RAND_BITS 31
+
+/* draw a uniform integer in [0, bound) with rand_r('seed'), or rand() if 'seed' is NULL (1 <= bound <= 2^62) */
+static unsigned long long rand_below(unsigned long long bound, unsigned int *seed)
+{
+    unsigned long long range, limit, r;
+    bool wide = bound > (1ULL << TG_RAND_BITS);
+
+    /* reject the top draws that would make the modulo biased */
+    range = 1ULL << (wide ? 2 * TG_RAND_BITS : TG_RAND_BITS);
+    limit = range - range % bound;
+    do
+    {
+        r = seed ? rand_r(seed) : rand();
+        if (wide)
+            r = (r << TG_RAND_BITS) | (unsigned long long)(seed ? rand_r(seed) : rand());
+    } while (r >= limit);
+
+    return r % bound;
+}
+
+/* draw a value with rand_r('seed'), or rand() if 'seed' is NULL */
+static unsigned int draw_value(struct alias_table *table, unsigned int *seed)
+{
+    /* a column and a slot in it with a single draw */
+    unsigned long long slot = rand_below(table->len * table->total, seed);
+    unsigned int col = slot / table->total;
+
+    return (slot % table->total < table->keep[col]) ? table->values[col] : table->aliases[col];
+}
+
+/* build a table drawing vals[i] with probability weights[i] / (sum of weights), return true if it succeeds */
+bool init_alias_table(struct alias_table *table, unsigned int *vals, unsigned int *weights, unsigned int len)
+{
+    unsigned long long *scaled = NULL;  /* len * weight of the part of each value not placed yet */
+    unsigned int *small = NULL, *large = NULL;  /* columns below and at least the average */
+    unsigned int num_small = 0, num_large = 0;
+    unsigned int i, s, l;
+
+    if (!table || !vals || !weights || len == 0)
+        return false;
+
+    memset(table, 0, sizeof(struct alias_table));
+    for (i = 0; i < len; i++)
+        table->total += weights[i];
+    if (table->total == 0 || table->total > (1ULL << 2 * TG_RAND_BITS) / len)
+    {
+        printf("Error: invalid total weight %llu in init_alias_table()\n", table->total);
+        return false;
+    }
+
+    table->len = len;
+    table->values = (unsigned int*)malloc(len * sizeof(unsigned int));
+    table->aliases = (unsigned int*)malloc(len * sizeof(unsigned int));
+    table->keep = (unsigned long long*)malloc(len * sizeof(unsigned long long));
+    scaled = (unsigned long long*)malloc(len * sizeof(unsigned long long));
+    small = (unsigned int*)malloc(len * sizeof(unsigned int));
+    large = (unsigned int*)malloc(len * sizeof(unsigned int));
+    if (!table->values || !table->aliases || !table->keep || !scaled || !small || !large)
+    {
+        perror("Error: malloc in init_alias_table()");
+        free(scaled);
+        free(small);
+        free(large);
+        free_alias_table(table);
+        return false;
+    }
+
+    /* each column holds 'total' slots, i.e. the average of the scaled weights */
+    for (i = 0; i < len; i++)
+    {
+        table->values[i] = vals[i];
+        table->aliases[i] = vals[i];
+        scaled[i] = (unsigned long long)weights[i] * len;
+        if (scaled[i] < table->total)
+            small[num_small++] = i;
+        else
+            large[num_large++] = i;
+    }
+
+    /* fill the rest of a small column with a large value */
+    while (num_small > 0 && num_large > 0)
+    {
+        s = small[--num_small];
+        l = large[--num_large];
+        table->keep[s] = scaled[s];
+        table->aliases[s] = vals[l];
+        scaled[l] -= table->total - scaled[s];
+        if (scaled[l] < table->total)
+            small[num_small++] = l;
+        else
+            large[num_large++] = l;
+    }
+
+    /* the columns left are exactly full (integer weights leave no rounding error) */
+    while (num_large > 0)
+        table->keep[large[--num_large]] = table->total;
+    while (num_small > 0)
+        table->keep[small[--num_small]] = table->total;
+
+    free(scaled);
+    free(small);
+    free(large);
+    return true;
+}
+
+/* free resources of a table */
+void free_alias_table(struct alias_table *table)
+{
+    if (!table)
+        return;
+
+    free(table->values);
+    free(table->aliases);
+    free(table->keep);
+    table->values = NULL;
+    table->aliases = NULL;
+    table->keep = NULL;
+    table->len = 0;
+}
+
+/* randomly generate a value with the random state 'seed' (rand_r()) */
+unsigned int gen_alias_value_r(struct alias_table *table, unsigned int *seed)
+{
+    return draw_value(table, seed);
+}
+
+/* fill 'values' with 'num' random values (rand()) */
+void gen_alias_values(struct alias_table *table, unsigned int *values, unsigned int num)
+{
+    unsigned int i;
+
+    for (i = 0; i < num; i++)
+        values[i] = draw_value(table, NULL);
+}
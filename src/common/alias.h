@@ -0,0 +1,31 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* values drawn with probabilities proportional to integer weights in O(1), with Vose's alias method.
+   Each of the 'len' columns has 'total' (the sum of weights) slots: the first 'keep' slots give the
+   value of the column and the rest its alias. Everything is integer, so draws are exactly unbiased. */
+struct alias_table
+{
+    unsigned int *values;   /* value of each column */
+    unsigned int *aliases;  /* value of the rest of each column */
+    unsigned long long *keep;   /* slots of each column that give its own value */
+    unsigned int len;   /* number of columns */
+    unsigned long long total;   /* slots per column (sum of weights) */
+};
+
+/* build a table drawing vals[i] with probability weights[i] / (sum of weights), return true if it succeeds */
+bool init_alias_table(struct alias_table *table, unsigned int *vals, unsigned int *weights, unsigned int len);
+
+/* free resources of a table */
+void free_alias_table(struct alias_table *table);
+
+/* randomly generate a value with the random state 'seed' (rand_r()) */
+unsigned int gen_alias_value_r(struct alias_table *table, unsigned int *seed);
+
+/* fill 'values' with 'num' random values (rand()) */
+void gen_alias_values(struct alias_table *table, unsigned int *values, unsigned int num);
+
+#endif
@@ -11,6 +11,7 @@ void init_cdf(struct cdf_table *table)
     table->max_entry = TG_CDF_TABLE_ENTRY;
     table->min_cdf = 0;
     table->max_cdf = 1;
+    table->keys = NULL;
 
     if (!(table->entries))
         perror("Error: malloc entries in init_cdf()");
@@ -20,7 +21,10 @@ void init_cdf(struct cdf_table *table)
 void free_cdf(struct cdf_table *table)
 {
     if (table)
+    {
         free(table->entries);
+        free(table->keys);
+    }
 }
 
 /* get CDF distribution from a given file */
@@ -63,6 +67,18 @@ void load_cdf(struct cdf_table *table, char *file_name)
         table->num_entry++;
     }
     fclose(fd);
+
+    /* the first entry whose CDF reaches x is the first whose running maximum does,
+       so a binary search over the running maximum finds the same entry as a linear scan */
+    free(table->keys);
+    table->keys = (double*)malloc((table->num_entry > 0 ? table->num_entry : 1) * sizeof(double));
+    if (!(table->keys))
+    {
+        perror("Error: malloc keys in load_cdf()");
+        return;
+    }
+    for (i = 0; i < table->num_entry; i++)
+        table->keys[i] = (i > 0 && table->keys[i-1] > table->entries[i].cdf) ? table->keys[i-1] : table->entries[i].cdf;
 }
 
 /* print CDF distribution information */
@@ -119,26 +135,70 @@ double rand_range(double min, double max)
     return min + rand() * (max - min) / RAND_MAX;
 }
 
+/* get the first entry whose CDF is at least 'x' (num_entry if none) */
+static int search_cdf(struct cdf_table *table, double x)
+{
+    int lo = 0, hi = table->num_entry, mid;
+
+    /* tables that are not loaded from a file have no keys */
+    if (!(table->keys))
+    {
+        while (lo < hi && x > table->entries[lo].cdf)
+            lo++;
+        return lo;
+    }
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (table->keys[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* get the value of CDF distribution at cumulative probability 'x' */
+static double value_cdf(struct cdf_table *table, double x)
+{
+    int i = search_cdf(table, x);
+
+    if (i == table->num_entry)
+        return table->entries[table->num_entry-1].value;
+    else if (i == 0)
+        return interpolate(x, 0, 0, table->entries[i].cdf, table->entries[i].value);
+    else
+        return interpolate(x, table->entries[i-1].cdf, table->entries[i-1].value, table->entries[i].cdf, table->entries[i].value);
+}
+
 /* generate a random value based on CDF distribution */
 double gen_random_cdf(struct cdf_table *table)
 {
-    int i = 0;
-    double x = rand_range(table->min_cdf, table->max_cdf);
-    /* printf("%f %f %f\n", x, table->min_cdf, table->max_cdf); */
+    if (!table)
+        return 0;
+
+    return value_cdf(table, rand_range(table->min_cdf, table->max_cdf));
+}
 
+/* generate a random value based on CDF distribution with the random state 'seed' (rand_r()) */
+double gen_random_cdf_r(struct cdf_table *table, unsigned int *seed)
+{
     if (!table)
         return 0;
 
-    for (i = 0; i < table->num_entry; i++)
-    {
-        if (x <= table->entries[i].cdf)
-        {
-            if (i == 0)
-                return interpolate(x, 0, 0, table->entries[i].cdf, table->entries[i].value);
-            else
-                return interpolate(x, table->entries[i-1].cdf, table->entries[i-1].value, table->entries[i].cdf, table->entries[i].value);
-        }
-    }
+    return value_cdf(table, table->min_cdf + rand_r(seed) * (table->max_cdf - table->min_cdf) / RAND_MAX);
+}
+
+/* fill 'values' with 'num' random values based on CDF distribution */
+void gen_random_cdf_n(struct cdf_table *table, double *values, unsigned int num)
+{
+    unsigned int i;
+
+    if (!table)
+        return;
 
-    return table->entries[table->num_entry-1].value;
+    for (i = 0; i < num; i++)
+        values[i] = value_cdf(table, rand_range(table->min_cdf, table->max_cdf));
 }
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 
 #define TG_CDF_TABLE_ENTRY 32
+/* number of values a caller of gen_random_cdf_n() typically draws at a time */
+#define TG_CDF_BATCH 256
 
 struct cdf_entry
 {
@@ -20,6 +22,7 @@ struct cdf_table
     int max_entry;  /* maximum number of entries in CDF table */
     double min_cdf; /* minimum value of CDF (default 0) */
     double max_cdf; /* maximum value of CDF (default 1) */
+    double *keys;   /* running maximum of the CDF column, binary searched by samplers (built by load_cdf()) */
 };
 
 /* initialize a CDF distribution */
@@ -40,4 +43,10 @@ double avg_cdf(struct cdf_table *table);
 /* Generate a random value based on CDF distribution */
 double gen_random_cdf(struct cdf_table *table);
 
+/* Generate a random value based on CDF distribution with the random state 'seed' (rand_r()) */
+double gen_random_cdf_r(struct cdf_table *table, unsigned int *seed);
+
+/* fill 'values' with 'num' random values based on CDF distribution */
+void gen_random_cdf_n(struct cdf_table *table, double *values, unsigned int num);
+
 #endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "clock.h"
+
+static const char *wait_mode_names[] = {"sleep", "spin", "rt"};
+
+/* get current time of the monotonic clock in nanoseconds */
+unsigned long long get_mono_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* sleep until 'deadline_ns' of the monotonic clock and return how late we wake up (ns) */
+unsigned long long sleep_until_ns(unsigned long long deadline_ns)
+{
+    struct timespec ts;
+    unsigned long long now_ns = get_mono_ns();
+
+    /* a deadline that has passed is served right away, so we catch up instead of drifting */
+    if (deadline_ns > now_ns)
+    {
+        ts.tv_sec = deadline_ns / 1000000000;
+        ts.tv_nsec = deadline_ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        now_ns = get_mono_ns();
+    }
+
+    return (now_ns > deadline_ns) ? now_ns - deadline_ns : 0;
+}
+
+/* parse the name of a wait mode and return true if it succeeds */
+bool parse_wait_mode(char *name, enum wait_mode *mode)
+{
+    int i = 0;
+
+    for (i = TG_WAIT_SLEEP; i <= TG_WAIT_REALTIME; i++)
+    {
+        if (!strcmp(name, wait_mode_names[i]))
+        {
+            *mode = (enum wait_mode)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* get the name of a wait mode */
+const char *wait_mode_name(enum wait_mode mode)
+{
+    return wait_mode_names[mode];
+}
+
+/* lock the memory of the process and run the calling thread with SCHED_FIFO, return true if both succeed */
+bool set_realtime_thread()
+{
+    struct sched_param param;
+    bool result = true;
+    int err;
+
+    /* no page fault in the middle of a wait */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        perror("Error: mlockall() in set_realtime_thread()");
+        result = false;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+    {
+        errno = err;
+        perror("Error: pthread_setschedparam() in set_realtime_thread()");
+        result = false;
+    }
+
+    return result;
+}
+
+/* add an overshoot sample, smoothed like the RTT estimator of TCP (RFC 6298) */
+static void update_precise_clock(struct precise_clock *c, unsigned long long overshoot_ns)
+{
+    double sample = min(overshoot_ns, TG_PRECISE_MAX_OVERSHOOT_NS);
+
+    if (overshoot_ns > precise_clock_threshold(c))
+        c->num_miss++;
+
+    c->overshoot_dev_ns = c->overshoot_dev_ns * 3 / 4 + fabs(c->overshoot_ns - sample) / 4;
+    c->overshoot_ns = c->overshoot_ns * 7 / 8 + sample / 8;
+    c->overshoot_max_ns = max(c->overshoot_max_ns, overshoot_ns);
+    c->num_sleep++;
+}
+
+/* initialize and calibrate the hybrid sleep/spin wait of the calling thread */
+void init_precise_clock(struct precise_clock *c)
+{
+    unsigned long long overshoot_ns;
+    int i = 0;
+
+    if (!c)
+        return;
+
+    memset(c, 0, sizeof(struct precise_clock));
+    for (i = 0; i < TG_PRECISE_CALIB_ITER; i++)
+    {
+        overshoot_ns = sleep_until_ns(get_mono_ns() + TG_PRECISE_CALIB_NS);
+        if (i == 0)
+        {
+            c->overshoot_ns = min(overshoot_ns, TG_PRECISE_MAX_OVERSHOOT_NS);
+            c->overshoot_dev_ns = c->overshoot_ns / 2;
+        }
+        else
+            update_precise_clock(c, overshoot_ns);
+    }
+
+    /* calibration sleeps are not part of the statistics */
+    c->overshoot_max_ns = 0;
+    c->num_sleep = 0;
+    c->num_miss = 0;
+}
+
+/* how long before a deadline the hybrid wait stops sleeping and starts spinning (ns) */
+unsigned long long precise_clock_threshold(struct precise_clock *c)
+{
+    return (unsigned long long)(c->overshoot_ns + 4 * c->overshoot_dev_ns);
+}
+
+/* wait until 'deadline_ns' of the monotonic clock by sleeping then spinning and return how late we are (ns) */
+unsigned long long precise_sleep_until_ns(struct precise_clock *c, unsigned long long deadline_ns)
+{
+    unsigned long long threshold_ns = precise_clock_threshold(c);
+    unsigned long long now_ns = get_mono_ns();
+    unsigned long long wake_ns, spin_start_ns;
+
+    /* every sleep is a new sample, so the threshold follows the load of the machine */
+    if (deadline_ns > now_ns + threshold_ns)
+    {
+        wake_ns = deadline_ns - threshold_ns;
+        now_ns = wake_ns + sleep_until_ns(wake_ns);
+        update_precise_clock(c, now_ns - wake_ns);
+    }
+
+    spin_start_ns = now_ns;
+    while (now_ns < deadline_ns)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        now_ns = get_mono_ns();
+    }
+    c->spin_ns_total += now_ns - spin_start_ns;
+
+    return now_ns - deadline_ns;
+}
+
+/* print the calibration and statistics of the hybrid sleep/spin wait */
+void print_precise_clock(struct precise_clock *c)
+{
+    printf("The estimated sleep overshoot is %.3f us (deviation %.3f us, max %.3f us), spin threshold %.3f us\n",
+           c->overshoot_ns / 1000, c->overshoot_dev_ns / 1000, (double)c->overshoot_max_ns / 1000,
+           (double)precise_clock_threshold(c) / 1000);
+    printf("Sleeps: %llu  overshooting the threshold: %llu  time spent spinning: %.3f s\n",
+           c->num_sleep, c->num_miss, (double)c->spin_ns_total / 1000000000);
+}
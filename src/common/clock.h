@@ -0,0 +1,60 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* ways to wait for a deadline */
+enum wait_mode
+{
+    TG_WAIT_SLEEP,  /* clock_nanosleep() only */
+    TG_WAIT_SPIN,   /* clock_nanosleep() until a calibrated threshold before the deadline, then busy-poll */
+    TG_WAIT_REALTIME    /* TG_WAIT_SPIN with locked memory and SCHED_FIFO */
+};
+
+/* number of sleeps to calibrate the overshoot of clock_nanosleep() at start */
+#define TG_PRECISE_CALIB_ITER 64
+/* length of each calibration sleep (ns) */
+#define TG_PRECISE_CALIB_NS 10000
+/* largest overshoot sample taken into account, so one preemption does not disable sleeping (ns) */
+#define TG_PRECISE_MAX_OVERSHOOT_NS 200000
+
+/* state of the hybrid sleep/spin wait of a thread, calibrated on every sleep */
+struct precise_clock
+{
+    double overshoot_ns;    /* smoothed overshoot of clock_nanosleep() */
+    double overshoot_dev_ns;    /* smoothed mean deviation of the overshoot */
+    unsigned long long overshoot_max_ns;    /* largest overshoot seen */
+    unsigned long long num_sleep;   /* number of sleeps (samples) */
+    unsigned long long num_miss;    /* sleeps that overshoot the spin threshold */
+    unsigned long long spin_ns_total;   /* time spent spinning */
+};
+
+/* get current time of the monotonic clock in nanoseconds */
+unsigned long long get_mono_ns();
+
+/* sleep until 'deadline_ns' of the monotonic clock and return how late we wake up (ns) */
+unsigned long long sleep_until_ns(unsigned long long deadline_ns);
+
+/* parse the name of a wait mode and return true if it succeeds */
+bool parse_wait_mode(char *name, enum wait_mode *mode);
+
+/* get the name of a wait mode */
+const char *wait_mode_name(enum wait_mode mode);
+
+/* lock the memory of the process and run the calling thread with SCHED_FIFO, return true if both succeed */
+bool set_realtime_thread();
+
+/* initialize and calibrate the hybrid sleep/spin wait of the calling thread */
+void init_precise_clock(struct precise_clock *c);
+
+/* how long before a deadline the hybrid wait stops sleeping and starts spinning (ns) */
+unsigned long long precise_clock_threshold(struct precise_clock *c);
+
+/* wait until 'deadline_ns' of the monotonic clock by sleeping then spinning and return how late we are (ns) */
+unsigned long long precise_sleep_until_ns(struct precise_clock *c, unsigned long long deadline_ns);
+
+/* print the calibration and statistics of the hybrid sleep/spin wait */
+void print_precise_clock(struct precise_clock *c);
+
+#endif
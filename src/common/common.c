@@ -9,11 +9,13 @@
 #include <math.h>
 
 #include "common.h"
+#include "payload.h"
+#include "pacing.h"
+#include "clock.h"
 
-/* buffer to use w/o rate limiting */
-static char max_write_buf[TG_MAX_WRITE] = {0};
-/* buffer to use with rate limiting */
-static char min_write_buf[TG_MIN_WRITE] = {0};
+/* write exactly 'count' bytes from 'buf' or, if 'buf' is NULL, from the payload path */
+static unsigned int write_exact_from(int fd, char *buf, struct payload_ctx *payload, size_t count, size_t max_per_write,
+    unsigned int rate_mbps, unsigned int tos, unsigned int sleep_overhead_us, bool dummy_buf);
 
 /*
  * This function attemps to read exactly count bytes from file descriptor fd
@@ -81,26 +83,32 @@ unsigned int read_exact(int fd, char *buf, size_t count, size_t max_per_read, bo
  */
 unsigned int write_exact(int fd, char *buf, size_t count, size_t max_per_write,
     unsigned int rate_mbps, unsigned int tos, unsigned int sleep_overhead_us, bool dummy_buf)
+{
+    return write_exact_from(fd, buf, NULL, count, max_per_write, rate_mbps, tos, sleep_overhead_us, dummy_buf);
+}
+
+/* write exactly 'count' bytes from 'buf' or, if 'buf' is NULL, from the payload path */
+static unsigned int write_exact_from(int fd, char *buf, struct payload_ctx *payload, size_t count, size_t max_per_write,
+    unsigned int rate_mbps, unsigned int tos, unsigned int sleep_overhead_us, bool dummy_buf)
 {
     unsigned int bytes_total_write = 0; /* total number of bytes that have been written */
     unsigned int bytes_to_write = 0;    /* maximum number of bytes to write in next send() call */
     char *cur_buf = NULL;   /* current location */
     int n;  /* number of bytes read in current read() call */
-    struct timeval tv_start, tv_end;    /* start and end time of write */
+    unsigned long long start_ns;    /* start time of write */
     long sleep_us = 0;  /* sleep time (us) */
     long write_us = 0;  /* time used for write() */
 
-    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0)
+    if (tos != TG_TOS_KEEP && setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0)
         printf("Error: set IP_TOS option in write_exact()");
 
     while (count > 0)
     {
         bytes_to_write = (count > max_per_write) ? max_per_write : count;
         cur_buf = (dummy_buf) ? buf : (buf + bytes_total_write);
-        gettimeofday(&tv_start, NULL);
-        n = write(fd, cur_buf, bytes_to_write);
-        gettimeofday(&tv_end, NULL);
-        write_us = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec;
+        start_ns = get_mono_ns();
+        n = (buf) ? write(fd, cur_buf, bytes_to_write) : write_payload(fd, payload, bytes_to_write);
+        write_us = (get_mono_ns() - start_ns) / 1000;
         sleep_us += (rate_mbps) ? n * 8 / rate_mbps - write_us : 0;
 
         if (n <= 0)
@@ -124,6 +132,38 @@ unsigned int write_exact(int fd, char *buf, size_t count, size_t max_per_write,
     return bytes_total_write;
 }
 
+/* fill in a TG_METADATA_SIZE-byte buffer with the metadata of a flow */
+void encode_flow_metadata(char *buf, struct flow_metadata *f)
+{
+    memcpy(buf + offsetof(struct flow_metadata, id), &(f->id), sizeof(f->id));
+    memcpy(buf + offsetof(struct flow_metadata, size), &(f->size), sizeof(f->size));
+    memcpy(buf + offsetof(struct flow_metadata, tos),  &(f->tos), sizeof(f->tos));
+    memcpy(buf + offsetof(struct flow_metadata, rate), &(f->rate), sizeof(f->rate));
+}
+
+/* extract the metadata of a flow from a TG_METADATA_SIZE-byte buffer */
+void decode_flow_metadata(char *buf, struct flow_metadata *f)
+{
+    memcpy(&(f->id), buf + offsetof(struct flow_metadata, id), sizeof(f->id));
+    memcpy(&(f->size), buf + offsetof(struct flow_metadata, size), sizeof(f->size));
+    memcpy(&(f->tos), buf + offsetof(struct flow_metadata, tos), sizeof(f->tos));
+    memcpy(&(f->rate), buf + offsetof(struct flow_metadata, rate), sizeof(f->rate));
+}
+
+/* fill in a TG_FRAME_HEADER_SIZE-byte buffer with a frame header */
+void encode_frame_header(char *buf, struct frame_header *h)
+{
+    memcpy(buf + offsetof(struct frame_header, id), &(h->id), sizeof(h->id));
+    memcpy(buf + offsetof(struct frame_header, len), &(h->len), sizeof(h->len));
+}
+
+/* extract a frame header from a TG_FRAME_HEADER_SIZE-byte buffer */
+void decode_frame_header(char *buf, struct frame_header *h)
+{
+    memcpy(&(h->id), buf + offsetof(struct frame_header, id), sizeof(h->id));
+    memcpy(&(h->len), buf + offsetof(struct frame_header, len), sizeof(h->len));
+}
+
 /* read the metadata of a flow and return true if it succeeds. */
 bool read_flow_metadata(int fd, struct flow_metadata *f)
 {
@@ -136,10 +176,7 @@ bool read_flow_metadata(int fd, struct flow_metadata *f)
         return false;
 
     /* extract metadata */
-    memcpy(&(f->id), buf + offsetof(struct flow_metadata, id), sizeof(f->id));
-    memcpy(&(f->size), buf + offsetof(struct flow_metadata, size), sizeof(f->size));
-    memcpy(&(f->tos), buf + offsetof(struct flow_metadata, tos), sizeof(f->tos));
-    memcpy(&(f->rate), buf + offsetof(struct flow_metadata, rate), sizeof(f->rate));
+    decode_flow_metadata(buf, f);
 
     return true;
 }
@@ -153,24 +190,22 @@ bool write_flow_req(int fd, struct flow_metadata *f)
         return false;
 
     /* fill in metadata */
-    memcpy(buf + offsetof(struct flow_metadata, id), &(f->id), sizeof(f->id));
-    memcpy(buf + offsetof(struct flow_metadata, size), &(f->size), sizeof(f->size));
-    memcpy(buf + offsetof(struct flow_metadata, tos),  &(f->tos), sizeof(f->tos));
-    memcpy(buf + offsetof(struct flow_metadata, rate), &(f->rate), sizeof(f->rate));
+    encode_flow_metadata(buf, f);
 
-    /* write the request into the socket */
-    if (write_exact(fd, buf, TG_METADATA_SIZE, TG_METADATA_SIZE, 0, f->tos, 0, false) == TG_METADATA_SIZE)
+    /* write the request into the socket (TG_FLOW_MUX is not a ToS bit) */
+    if (write_exact(fd, buf, TG_METADATA_SIZE, TG_METADATA_SIZE, 0, f->tos & ~TG_FLOW_MUX, 0, false) == TG_METADATA_SIZE)
         return true;
     else
         return false;
 }
 
 /* write a flow (response) into a socket and return true if it succeeds */
-bool write_flow(int fd, struct flow_metadata *f, unsigned int sleep_overhead_us)
+bool write_flow(int fd, struct flow_metadata *f, struct payload_ctx *payload, unsigned int sleep_overhead_us)
 {
-    char *write_buf = NULL;  /* buffer to hold the real content of the flow */
     unsigned int max_per_write = 0;
+    unsigned int rate = f ? f->rate : 0;    /* rate enforced in user space */
     unsigned int result = 0;
+    unsigned long long start_ns;
 
     if (!f)
         return false;
@@ -182,21 +217,27 @@ bool write_flow(int fd, struct flow_metadata *f, unsigned int sleep_overhead_us)
         return false;
     }
 
-    /* use min_write_buf with rate limiting */
-    if (f->rate > 0)
+    /* let the kernel pace the flow, and remove the rate limit of a previous flow */
+    if (get_pacing_engine() == TG_PACING_KERNEL && payload && (f->rate > 0 || payload->kernel_paced))
     {
-        write_buf = min_write_buf;
-        max_per_write = TG_MIN_WRITE;
+        payload->kernel_paced = set_pacing_rate(fd, f->rate) && f->rate > 0;
+        if (payload->kernel_paced)
+            rate = 0;
     }
-    /* use max_write_buf w/o rate limiting */
+
+    /* use small writes with rate limiting */
+    if (rate > 0)
+        max_per_write = TG_MIN_WRITE;
     else
-    {
-        write_buf = max_write_buf;
         max_per_write = TG_MAX_WRITE;
-    }
 
     /* generate the flow response */
-    result = write_exact(fd, write_buf, f->size, max_per_write, f->rate, f->tos, sleep_overhead_us, true);
+    start_ns = get_mono_ns();
+    result = write_exact_from(fd, NULL, payload, f->size, max_per_write, rate, f->tos, sleep_overhead_us, true);
+    if (payload && payload->zerocopy)
+        reap_payload_completions(fd, payload);
+    if (f->rate > 0 && result == f->size)
+        log_pacing_rate(fd, f, get_mono_ns() - start_ns);
     if (result == f->size)
         return true;
     else
@@ -206,6 +247,50 @@ bool write_flow(int fd, struct flow_metadata *f, unsigned int sleep_overhead_us)
     }
 }
 
+/* write a flow (response) as frames of a multiplexed connection and return true if it succeeds */
+bool write_flow_frames(int fd, struct flow_metadata *f, struct payload_ctx *payload)
+{
+    char buf[TG_FRAME_HEADER_SIZE + TG_METADATA_SIZE] = {0};    /* frame header and the metadata it carries */
+    char meta_buf[TG_METADATA_SIZE] = {0};
+    struct frame_header h;
+    unsigned long long total, sent = 0;  /* the metadata and a payload near UINT_MAX bytes do not fit 32 bits */
+    unsigned int tos, meta_len, head_len;
+
+    if (!f)
+        return false;
+
+    /* like a response without frames, the flow starts with its metadata */
+    encode_flow_metadata(meta_buf, f);
+    total = (unsigned long long)TG_METADATA_SIZE + f->size;
+    tos = f->tos & ~TG_FLOW_MUX;
+    h.id = f->id;
+
+    /* set the ToS once per flow rather than once per write of each frame */
+    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0)
+        printf("Error: set IP_TOS option in write_flow_frames()");
+
+    while (sent < total)
+    {
+        h.len = min(total - sent, TG_FRAME_MAX_LEN);
+        encode_frame_header(buf, &h);
+        meta_len = (sent < TG_METADATA_SIZE) ? min(TG_METADATA_SIZE - sent, h.len) : 0;
+        memcpy(buf + TG_FRAME_HEADER_SIZE, meta_buf + sent, meta_len);
+        head_len = TG_FRAME_HEADER_SIZE + meta_len;
+
+        if (write_exact(fd, buf, head_len, head_len, 0, TG_TOS_KEEP, 0, false) != head_len ||
+            write_exact_from(fd, NULL, payload, h.len - meta_len, TG_MAX_WRITE, 0, TG_TOS_KEEP, 0, true) != h.len - meta_len)
+        {
+            printf("Error: write_exact() in write_flow_frames() only successfully writes %llu of %llu bytes.\n", sent, total);
+            return false;
+        }
+        sent += h.len;
+    }
+
+    if (payload && payload->zerocopy)
+        reap_payload_completions(fd, payload);
+    return true;
+}
+
 /* print error information */
 void error(char *msg)
 {
@@ -234,42 +319,33 @@ double poission_gen_interval(double avg_rate)
         return 0;
 }
 
+/* generate poission process arrival interval with the random state 'seed' (rand_r()) */
+double poission_gen_interval_r(double avg_rate, unsigned int *seed)
+{
+    if (avg_rate > 0)
+        return -logf(1.0 - (double)rand_r(seed) / RAND_MAX) / avg_rate;
+    else
+        return 0;
+}
+
 /* calculate usleep overhead */
 unsigned int get_usleep_overhead(int iter_num)
 {
     int i=0;
     unsigned int tot_sleep_us = 0;
-    struct timeval tv_start, tv_end;
+    unsigned long long start_ns;
 
     if (iter_num <= 0)
         return 0;
 
-    gettimeofday(&tv_start, NULL);
+    start_ns = get_mono_ns();
     for(i = 0; i < iter_num; i ++)
         usleep(0);
-    gettimeofday(&tv_end, NULL);
-    tot_sleep_us = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec;
+    tot_sleep_us = (get_mono_ns() - start_ns) / 1000;
 
     return tot_sleep_us/iter_num;
 }
 
-/* randomly generate value based on weights */
-unsigned int gen_value_weight(unsigned int *vals, unsigned int *weights, unsigned int len, unsigned int weight_total)
-{
-    unsigned int i = 0;
-    unsigned int val = rand() % weight_total;
-
-    for (i = 0; i < len; i++)
-    {
-        if (val < weights[i])
-            return vals[i];
-        else
-            val -= weights[i];
-    }
-
-    return vals[len - 1];
-}
-
 /* display progress */
 void display_progress(unsigned int num_finished, unsigned int num_total)
 {
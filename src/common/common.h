@@ -15,6 +15,22 @@ struct flow_metadata
 
 /* flow meata data size */
 #define TG_METADATA_SIZE (sizeof(struct flow_metadata))
+/* flag in the ToS field of a request: send the response as frames that may interleave with other responses */
+#define TG_FLOW_MUX 0x100
+
+/* header of a frame of a multiplexed response */
+struct frame_header
+{
+    unsigned int id;    /* ID of the flow */
+    unsigned int len;   /* bytes of the flow (echoed metadata, then payload) following the header */
+};
+
+/* frame header size */
+#define TG_FRAME_HEADER_SIZE (sizeof(struct frame_header))
+/* maximum number of flow bytes per frame */
+#define TG_FRAME_MAX_LEN (1 << 14)
+/* maximum number of outstanding requests per connection (pipelining or multiplexing) */
+#define TG_MAX_DEPTH 16
 /* default server port */
 #define TG_SERVER_PORT 5001
 /* default number of backlogged connections for listen() */
@@ -27,6 +43,14 @@ struct flow_metadata
 #define TG_MAX_READ (1 << 20)
 /* default initial number of TCP connections per pair */
 #define TG_PAIR_INIT_CONN 5
+/* the incast client tops up its reserved connections at least this often (us) */
+#define TG_REFILL_INTERVAL_US 1000
+/* number of empty flows to probe the RTT to a server before prewarming its connection pools */
+#define TG_PROBE_RTT_NUM 5
+/* default number of threads generating requests */
+#define TG_DEFAULT_GENERATORS 1
+/* maximum number of concurrency levels of a closed-loop run */
+#define TG_CLOSED_MAX_LEVELS 32
 /* default goodput / link capacity ratio */
 #define TG_GOODPUT_RATIO (1448.0 / (1500 + 14 + 4 + 8 + 12))
 
@@ -45,18 +69,38 @@ struct flow_metadata
 /* read exactly 'count' bytes from a socket 'fd' */
 unsigned int read_exact(int fd, char *buf, size_t count, size_t max_per_read, bool dummy_buf);
 
-/* write exactly 'count' bytes into a socket 'fd' */
+/* ToS for write_exact() that leaves the ToS of the socket as it is */
+#define TG_TOS_KEEP 0xffffffff
+
+/* write exactly 'count' bytes into a socket 'fd' (TG_TOS_KEEP: do not set the ToS) */
 unsigned int write_exact(int fd, char *buf, size_t count, size_t max_per_write,
     unsigned int rate_mbps, unsigned int tos, unsigned int sleep_overhead_us, bool dummy_buf);
 
+/* fill in a TG_METADATA_SIZE-byte buffer with the metadata of a flow */
+void encode_flow_metadata(char *buf, struct flow_metadata *f);
+
+/* extract the metadata of a flow from a TG_METADATA_SIZE-byte buffer */
+void decode_flow_metadata(char *buf, struct flow_metadata *f);
+
+/* fill in a TG_FRAME_HEADER_SIZE-byte buffer with a frame header */
+void encode_frame_header(char *buf, struct frame_header *h);
+
+/* extract a frame header from a TG_FRAME_HEADER_SIZE-byte buffer */
+void decode_frame_header(char *buf, struct frame_header *h);
+
 /* read the metadata of a flow from a socket and return true if it succeeds. */
 bool read_flow_metadata(int fd, struct flow_metadata *f);
 
 /* write a flow request into a socket and return true if it succeeds */
 bool write_flow_req(int fd, struct flow_metadata *f);
 
-/* write a flow (response) into a socket and return true if it succeeds */
-bool write_flow(int fd, struct flow_metadata *f, unsigned int sleep_overhead_us);
+struct payload_ctx;
+
+/* write a flow (response) with payload from 'payload' into a socket and return true if it succeeds */
+bool write_flow(int fd, struct flow_metadata *f, struct payload_ctx *payload, unsigned int sleep_overhead_us);
+
+/* write a flow (response) as frames of a multiplexed connection and return true if it succeeds */
+bool write_flow_frames(int fd, struct flow_metadata *f, struct payload_ctx *payload);
 
 /* print error information and terminate the program */
 void error(char *msg);
@@ -67,12 +111,12 @@ void remove_newline(char *str);
 /* generate poission process arrival interval */
 double poission_gen_interval(double avg_rate);
 
+/* generate poission process arrival interval with the random state 'seed' (rand_r()) */
+double poission_gen_interval_r(double avg_rate, unsigned int *seed);
+
 /* calculate usleep overhead */
 unsigned int get_usleep_overhead(int iter_num);
 
-/* randomly generate a value based on weights */
-unsigned int gen_value_weight(unsigned int *vals, unsigned int *weights, unsigned int len, unsigned int weight_total);
-
 /* display progress */
 void display_progress(unsigned int num_finished, unsigned int num_total);
 
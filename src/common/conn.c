@@ -1,25 +1,46 @@
 #include "conn.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+/* initialize connection and connect() to the server, in the background if 'async' */
+static bool open_conn_node(struct conn_node *node, int id, struct conn_list *list, bool async);
+
 /* initialize connection */
 bool init_conn_node(struct conn_node *node, int id, struct conn_list *list)
+{
+    if (node)
+        node->next = NULL;
+    return open_conn_node(node, id, list, false);
+}
+
+/* initialize connection and connect() to the server, in the background if 'async' */
+static bool open_conn_node(struct conn_node *node, int id, struct conn_list *list, bool async)
 {
     struct sockaddr_in serv_addr;
     int sock_opt = 1;
+    unsigned int i;
 
     if (!node)
         return false;
 
     node->id = id;
-    node->busy = false;
-    node->next = NULL;
+    atomic_init(&(node->depth_state), 0);
+    for (i = 0; i < TG_MAX_DEPTH; i++)
+        atomic_init(&(node->reqs[i].id), 0);
+    node->cur_req = NULL;
+    node->frame_len = 0;
     node->list = list;
-    node->connected = false;
+    atomic_init(&(node->connected), false);
+    atomic_init(&(node->free_next), 0);
+    node->meta_len = 0;
+    node->bytes_left = 0;
 
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
@@ -27,7 +48,7 @@ bool init_conn_node(struct conn_node *node, int id, struct conn_list *list)
     serv_addr.sin_port = htons(list->port);
 
     /* initialize server socket */
-    node->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    node->sockfd = socket(AF_INET, (async) ? SOCK_STREAM | SOCK_NONBLOCK : SOCK_STREAM, 0);
     if (node->sockfd < 0)
     {
         char msg[256] = {0};
@@ -52,15 +73,18 @@ bool init_conn_node(struct conn_node *node, int id, struct conn_list *list)
         return false;
     }
 
-    if (connect(node->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+    if (connect(node->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0 && !(async && errno == EINPROGRESS))
     {
         char msg[256] = {0};
+        close(node->sockfd);
         snprintf(msg, 256, "Error: connect() (to %s:%hu) in init_conn_node()", list->ip, list->port);
         perror(msg);
         return false;
     }
 
-    node->connected = true;
+    /* the caller sets 'connected' once an asynchronous connect() completes */
+    if (!async)
+        atomic_store(&(node->connected), true);
     return true;
 }
 
@@ -79,16 +103,140 @@ bool init_conn_list(struct conn_list *list, int index, char *ip, unsigned short
 
     list->index = index;
     list->port = port;
+    memset(list->chunks, 0, sizeof(list->chunks));
     list->head = NULL;
     list->tail = NULL;
-    list->len = 0;
-    list->available_len = 0;
-    list->flow_finished = 0;
+    atomic_init(&(list->len), 0);
+    atomic_init(&(list->live_len), 0);
+    list->max_len = 0;
+    list->dead_top = 0;
+    list->depth = 1;
+    list->mux = false;
+    atomic_init(&(list->free_top), 0);
+    atomic_init(&(list->available_len), 0);
+    atomic_init(&(list->flow_finished), 0);
+    atomic_init(&(list->connecting), 0);
+    atomic_init(&(list->pending_len), 0);
+    list->pending_head = NULL;
+    list->pending_tail = NULL;
+    list->num_wait_flow = 0;
+    list->num_drop_flow = 0;
+    list->wait_us_total = 0;
+    list->wait_us_max = 0;
     pthread_mutex_init(&(list->lock), NULL);
+    pthread_mutex_init(&(list->pending_lock), NULL);
 
     return true;
 }
 
+/* get the node of a connection ID */
+static inline struct conn_node *get_conn_node(struct conn_list *list, unsigned int id)
+{
+    return &(list->chunks[id / TG_CONN_CHUNK_SIZE][id % TG_CONN_CHUNK_SIZE]);
+}
+
+/* push a node into the free stack */
+static void push_free_conn(struct conn_list *list, struct conn_node *node)
+{
+    unsigned long long top = atomic_load(&(list->free_top));
+    unsigned long long new_top;
+
+    do
+    {
+        atomic_store_explicit(&(node->free_next), (unsigned int)top, memory_order_relaxed);
+        new_top = (((top >> 32) + 1) << 32) | (unsigned int)(node->id + 1);
+    } while (!atomic_compare_exchange_weak(&(list->free_top), &top, new_top));
+}
+
+/* pop a node from the free stack (NULL if empty) */
+static struct conn_node *pop_free_conn(struct conn_list *list)
+{
+    unsigned long long top = atomic_load(&(list->free_top));
+    unsigned long long new_top;
+    struct conn_node *node = NULL;
+
+    do
+    {
+        if ((unsigned int)top == 0)
+            return NULL;
+
+        /* nodes are never freed before clear_conn_list(), so reading a node popped by someone else is safe */
+        node = get_conn_node(list, (unsigned int)top - 1);
+        new_top = (((top >> 32) + 1) << 32) | atomic_load_explicit(&(node->free_next), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&(list->free_top), &top, new_top));
+
+    return node;
+}
+
+/* insert a node to the tail of the linked list, or reuse a dead one (list->lock held) */
+static struct conn_node *insert_conn_node(struct conn_list *list, bool async)
+{
+    unsigned int id = atomic_load(&(list->len));
+    unsigned int chunk = id / TG_CONN_CHUNK_SIZE;
+    unsigned int dead_next;
+    struct conn_node *new_node = NULL;
+
+    if (list->max_len > 0 && atomic_load(&(list->live_len)) >= list->max_len)
+    {
+        printf("Error: no more than %u connections to %s:%hu in insert_conn_node()\n", list->max_len, list->ip, list->port);
+        return NULL;
+    }
+
+    /* a dead node keeps its place in the linked list */
+    if (list->dead_top > 0)
+    {
+        new_node = get_conn_node(list, list->dead_top - 1);
+        /* open_conn_node() clears the link to the next dead node */
+        dead_next = atomic_load(&(new_node->free_next));
+        if (!open_conn_node(new_node, new_node->id, list, async))
+        {
+            atomic_store(&(new_node->free_next), dead_next);
+            return NULL;
+        }
+        list->dead_top = dead_next;
+        atomic_fetch_add(&(list->live_len), 1);
+        return new_node;
+    }
+
+    if (chunk >= TG_CONN_MAX_CHUNK)
+    {
+        printf("Error: too many connections to %s:%hu in insert_conn_node()\n", list->ip, list->port);
+        return NULL;
+    }
+
+    if (!list->chunks[chunk])
+    {
+        list->chunks[chunk] = (struct conn_node*)aligned_alloc(TG_CACHE_LINE_SIZE, TG_CONN_CHUNK_SIZE * sizeof(struct conn_node));
+        if (!list->chunks[chunk])
+        {
+            perror("Error: allocate connections in insert_conn_node()");
+            return NULL;
+        }
+        memset(list->chunks[chunk], 0, TG_CONN_CHUNK_SIZE * sizeof(struct conn_node));
+    }
+
+    /* the slot of a connection that cannot be opened is reused by the next one */
+    new_node = get_conn_node(list, id);
+    if (!open_conn_node(new_node, id, list, async))
+        return NULL;
+
+    /* if the list is empty */
+    if (id == 0)
+    {
+        list->head = new_node;
+        list->tail = new_node;
+    }
+    else
+    {
+        list->tail->next = new_node;
+        list->tail = new_node;
+    }
+    atomic_fetch_add(&(list->len), 1);
+    atomic_fetch_add(&(list->live_len), 1);
+
+    return new_node;
+}
+
 /* insert several nodes to the tail of the linked list */
 bool insert_conn_list(struct conn_list *list, int num)
 {
@@ -98,166 +246,391 @@ bool insert_conn_list(struct conn_list *list, int num)
     if (!list)
         return false;
 
+    pthread_mutex_lock(&(list->lock));
     for (i = 0; i < num; i++)
     {
-        new_node = (struct conn_node*)malloc(sizeof(struct conn_node));
-        if (!init_conn_node(new_node, list->len, list))
+        new_node = insert_conn_node(list, false);
+        if (!new_node)
         {
-            free(new_node);
+            pthread_mutex_unlock(&(list->lock));
             return false;
         }
-
-        /* if the list is empty */
-        if (list->len == 0)
-        {
-            list->head = new_node;
-            list->tail = new_node;
-        }
-        else
-        {
-            list->tail->next = new_node;
-            list->tail = new_node;
-        }
-        pthread_mutex_lock(&(list->lock));
-        list->len++;
-        list->available_len++;
-        pthread_mutex_unlock(&(list->lock));
+        atomic_fetch_add(&(list->available_len), 1);
+        push_free_conn(list, new_node);
     }
+    pthread_mutex_unlock(&(list->lock));
 
     return true;
 }
 
-/* search the first available connection (busy==false && connected==true) in the list. */
-struct conn_node *search_conn_list(struct conn_list *list)
+/* insert a node whose connection is established in the background (NULL if it fails) */
+struct conn_node *insert_conn_list_async(struct conn_list *list)
 {
-    struct conn_node *ptr = NULL;
+    struct conn_node *new_node = NULL;
 
-    if (!list || !(list->available_len))
+    if (!list)
         return NULL;
 
-    ptr = list->head;
-    while (true)
+    pthread_mutex_lock(&(list->lock));
+    new_node = insert_conn_node(list, true);
+    if (new_node)
+        atomic_fetch_add(&(list->connecting), 1);
+    pthread_mutex_unlock(&(list->lock));
+
+    return new_node;
+}
+
+/* finish the background connect() of a node and return true if the connection is established */
+bool finish_conn_node(struct conn_node *node)
+{
+    int sock_err = 0;
+    socklen_t len = sizeof(sock_err);
+
+    if (!node)
+        return false;
+
+    atomic_fetch_sub(&(node->list->connecting), 1);
+    if (getsockopt(node->sockfd, SOL_SOCKET, SO_ERROR, &sock_err, &len) < 0 || sock_err != 0)
     {
-        if (!ptr)
-            return NULL;
-        else if (!(ptr->busy) && ptr->connected)
-            return ptr;
-        else
-            ptr = ptr->next;
+        printf("Error: connect() (to %s:%hu) in finish_conn_node(): %s\n", node->list->ip, node->list->port, strerror(sock_err));
+        atomic_fetch_sub(&(node->list->live_len), 1);
+        return false;
     }
 
-    return NULL;
+    /* requests are written with blocking writes */
+    if (fcntl(node->sockfd, F_SETFL, fcntl(node->sockfd, F_GETFL, 0) & ~O_NONBLOCK) < 0)
+    {
+        perror("Error: clear O_NONBLOCK in finish_conn_node()");
+        atomic_fetch_sub(&(node->list->live_len), 1);
+        return false;
+    }
+
+    atomic_store(&(node->connected), true);
+    return true;
 }
 
-/* search N available connections in the list */
-struct conn_node **search_n_conn_list(struct conn_list *list, unsigned int num)
+/* give up a background connect() that was never handed to a receiver, the node is reused by the next insertion */
+void cancel_conn_node(struct conn_node *node)
 {
-    struct conn_node *ptr = NULL;
-    struct conn_node **result = NULL;
-    int i = 0;
+    if (!node)
+        return;
 
-    if (!list || list->available_len < num || !num)
-        return NULL;
+    close(node->sockfd);
+    atomic_fetch_sub(&(node->list->connecting), 1);
+    atomic_fetch_sub(&(node->list->live_len), 1);
+    recycle_conn_node(node);
+}
+
+/* close the socket of a connection, which no longer counts against the limit of its list */
+void close_conn_node(struct conn_node *node)
+{
+    if (!node)
+        return;
+
+    close(node->sockfd);
+    /* a failed background connect() is no longer counted by finish_conn_node() */
+    if (atomic_exchange(&(node->connected), false))
+        atomic_fetch_sub(&(node->list->live_len), 1);
+}
+
+/* let the next insertion reuse a dead node that is not in the free stack and that no receiver watches */
+void recycle_conn_node(struct conn_node *node)
+{
+    if (!node)
+        return;
+
+    pthread_mutex_lock(&(node->list->lock));
+    atomic_store(&(node->free_next), node->list->dead_top);
+    node->list->dead_top = node->id + 1;
+    pthread_mutex_unlock(&(node->list->lock));
+}
+
+/* limit the number of connections of a list (0: no limit) */
+void set_conn_list_max(struct conn_list *list, unsigned int max_len)
+{
+    if (list)
+        list->max_len = max_len;
+}
+
+/* whether a list has as many connections as it may have */
+bool conn_list_full(struct conn_list *list)
+{
+    return list && list->max_len > 0 && atomic_load(&(list->live_len)) >= list->max_len;
+}
+
+/* queue a flow request until a connection of the list becomes available */
+bool enqueue_pending_flow(struct conn_list *list, struct flow_metadata *flow)
+{
+    struct pending_flow *p = NULL;
+
+    if (!list || !flow)
+        return false;
 
-    result = (struct conn_node**)malloc(num * sizeof(struct conn_node*));
-    if (!result)
+    p = (struct pending_flow*)malloc(sizeof(struct pending_flow));
+    if (!p)
     {
-        perror("Error: malloc result in search_n_conn_list()");
-        return NULL;
+        perror("Error: malloc pending flow in enqueue_pending_flow()");
+        return false;
     }
 
-    ptr = list->head;
-    while (true)
+    p->flow = *flow;
+    p->enqueue_ns = get_mono_ns();
+    p->next = NULL;
+
+    pthread_mutex_lock(&(list->pending_lock));
+    if (list->pending_tail)
+        list->pending_tail->next = p;
+    else
+        list->pending_head = p;
+    list->pending_tail = p;
+    atomic_fetch_add(&(list->pending_len), 1);
+    pthread_mutex_unlock(&(list->pending_lock));
+
+    return true;
+}
+
+/* take the oldest queued flow request and its waiting time ('wait_ns' may be NULL),
+   return true if there is one ('drop': it will not be sent) */
+bool dequeue_pending_flow(struct conn_list *list, struct flow_metadata *flow, bool drop, unsigned long long *wait_ns)
+{
+    struct pending_flow *p = NULL;
+    unsigned long long wait = 0, wait_us;
+
+    /* fast path without the lock */
+    if (!list || atomic_load(&(list->pending_len)) == 0)
+        return false;
+
+    pthread_mutex_lock(&(list->pending_lock));
+    p = list->pending_head;
+    if (p)
     {
-        if (ptr)
-        {
-            if (!(ptr->busy) && ptr->connected)
-                result[i++] = ptr;
+        list->pending_head = p->next;
+        if (!list->pending_head)
+            list->pending_tail = NULL;
+        atomic_fetch_sub(&(list->pending_len), 1);
 
-            if (i < num)
-                ptr = ptr->next;
-            else
-                return result;
-        }
+        if (drop)
+            list->num_drop_flow++;
         else
         {
-            free(result);
-            return NULL;
+            wait = get_mono_ns() - p->enqueue_ns;
+            wait_us = wait / 1000;
+            list->num_wait_flow++;
+            list->wait_us_total += wait_us;
+            list->wait_us_max = max(list->wait_us_max, wait_us);
         }
     }
+    pthread_mutex_unlock(&(list->pending_lock));
 
-    return NULL;
+    if (!p)
+        return false;
+
+    if (flow)
+        *flow = p->flow;
+    if (wait_ns)
+        *wait_ns = wait;
+    free(p);
+    return true;
+}
+
+/* let connections of a list carry up to 'depth' outstanding requests, multiplexed if 'mux' */
+bool set_conn_list_depth(struct conn_list *list, unsigned int depth, bool mux)
+{
+    if (!list || depth == 0 || depth > TG_MAX_DEPTH)
+        return false;
+
+    list->depth = depth;
+    list->mux = mux;
+    return true;
 }
 
-/* wait for all threads in the linked list to finish */
-void wait_conn_list(struct conn_list *list)
+/* take a connection that can carry one more request (NULL if none) and hold it in O(1) */
+struct conn_node *acquire_conn_list(struct conn_list *list)
 {
-    struct conn_node *ptr = NULL;
-    struct timespec ts;
-    int s;
+    struct conn_node *node = NULL;
 
     if (!list)
+        return NULL;
+
+    while ((node = pop_free_conn(list)))
+    {
+        atomic_fetch_sub(&(list->available_len), 1);
+        /* drop connections closed while they were idle */
+        if (atomic_load(&(node->connected)))
+        {
+            atomic_fetch_or(&(node->depth_state), 1);
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/* take N available connections into 'nodes' and return true if it succeeds (all or nothing) */
+bool acquire_n_conn_list(struct conn_list *list, unsigned int num, struct conn_node **nodes)
+{
+    unsigned int i = 0;
+
+    if (!list || !nodes || !num || atomic_load(&(list->available_len)) < num)
+        return false;
+
+    for (i = 0; i < num; i++)
+    {
+        nodes[i] = acquire_conn_list(list);
+        if (!nodes[i])
+        {
+            while (i > 0)
+                release_conn_list(nodes[--i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* stop holding a connection: it goes back to its list, or waits for a completion if it is full */
+void release_conn_list(struct conn_node *node)
+{
+    unsigned int state;
+
+    if (!node)
+        return;
+
+    /* a full connection is held again by the receiver completing one of its requests (finish_conn_req()) */
+    state = atomic_fetch_and(&(node->depth_state), ~1U);
+    if ((state >> 1) >= node->list->depth)
+        return;
+
+    atomic_fetch_add(&(node->list->available_len), 1);
+    push_free_conn(node->list, node);
+}
+
+/* get the number of outstanding requests of a connection */
+unsigned int conn_node_outstanding(struct conn_node *node)
+{
+    return atomic_load(&(node->depth_state)) >> 1;
+}
+
+/* record a request about to be sent on a held connection after waiting 'wait_ns' for it */
+void start_conn_req(struct conn_node *node, unsigned int id, unsigned long long wait_ns)
+{
+    unsigned int i;
+
+    if (!node)
         return;
 
-    ptr = list->head;
-    while (true)
+    /* the receiver moves the times of a pipelined request into the node when its flow completes */
+    if (node->list->depth == 1 && !node->list->mux)
     {
-        if (!ptr)
-            break;
-        else
+        node->start_ns = get_mono_ns();
+        node->wait_ns = wait_ns;
+    }
+    else
+    {
+        /* a slot is freed before its request is counted as completed, so one is free */
+        for (i = 0; i < TG_MAX_DEPTH; i++)
         {
-            /* if this connection is active, we need to wait for long enough time */
-            if (ptr->connected)
-            {
-                s = pthread_join(ptr->thread, NULL);
-                if (s != 0)
-                {
-                    char msg[256] = {0};
-                    snprintf(msg, 256, "Error: pthread_join() (to %s:%hu) in wait_conn_list()",
-                             list->ip, list->port);
-                    perror(msg);
-                }
-            }
-            else
-            {
-                clock_gettime(CLOCK_REALTIME, &ts);
-                ts.tv_sec += 5;
-                s = pthread_timedjoin_np(ptr->thread, NULL, &ts);
-                if (s != 0)
-                {
-                    char msg[256] = {0};
-                    snprintf(msg, 256, "Error: pthread_timedjoin_np() (to %s:%hu) in wait_conn_list()",
-                             list->ip, list->port);
-                    perror(msg);
-                }
-            }
-            ptr = ptr->next;
+            if (atomic_load(&(node->reqs[i].id)) != 0)
+                continue;
+            node->reqs[i].start_ns = get_mono_ns();
+            node->reqs[i].header_ns = 0;
+            node->reqs[i].wait_ns = wait_ns;
+            node->reqs[i].meta_len = 0;
+            node->reqs[i].bytes_left = 0;
+            atomic_store(&(node->reqs[i].id), id);
+            break;
         }
     }
+
+    atomic_fetch_add(&(node->depth_state), 2);
+}
+
+/* find an outstanding request of a pipelined or multiplexed connection by flow ID (NULL if none) */
+struct conn_req *find_conn_req(struct conn_node *node, unsigned int id)
+{
+    unsigned int i;
+
+    for (i = 0; node && id != 0 && i < TG_MAX_DEPTH; i++)
+    {
+        if (atomic_load(&(node->reqs[i].id)) == id)
+            return &(node->reqs[i]);
+    }
+
+    return NULL;
+}
+
+/* move the times of a received request into the node and free its slot */
+void free_conn_req(struct conn_node *node, struct conn_req *req)
+{
+    if (!node || !req)
+        return;
+
+    node->start_ns = req->start_ns;
+    node->header_ns = req->header_ns;
+    node->wait_ns = req->wait_ns;
+    atomic_store(&(req->id), 0);
+}
+
+/* count a completed request and return true if the caller now holds the connection (it was full) */
+bool finish_conn_req(struct conn_node *node)
+{
+    unsigned int state, new_state;
+
+    if (!node)
+        return false;
+
+    state = atomic_load(&(node->depth_state));
+    do
+    {
+        new_state = state - 2;
+        /* nobody holds a full connection and it is not in the free stack, so take it */
+        if (!(state & 1) && (state >> 1) >= node->list->depth)
+            new_state |= 1;
+    } while (!atomic_compare_exchange_weak(&(node->depth_state), &state, new_state));
+
+    return !(state & 1) && (new_state & 1);
 }
 
 /* clear all the nodes in the linked list */
 void clear_conn_list(struct conn_list *list)
 {
-    struct conn_node *ptr = NULL;
-    struct conn_node *next_node = NULL;
+    unsigned int i = 0;
 
     if (!list)
         return;
 
-    for (ptr = list->head; ptr != NULL; ptr = next_node)
+    for (i = 0; i < TG_CONN_MAX_CHUNK; i++)
     {
-        next_node = ptr->next;
-        free(ptr);
+        free(list->chunks[i]);
+        list->chunks[i] = NULL;
     }
 
-    list->len = 0;
+    while (dequeue_pending_flow(list, NULL, true, NULL));
+
+    list->head = NULL;
+    list->tail = NULL;
+    atomic_store(&(list->len), 0);
+    atomic_store(&(list->live_len), 0);
+    list->dead_top = 0;
+    atomic_store(&(list->free_top), 0);
+    atomic_store(&(list->available_len), 0);
 }
 
 /* print information of the linked list */
 void print_conn_list(struct conn_list *list)
 {
-    if (list)
-        printf("%s:%hu  total connections: %u  available connections: %u  flows finished: %u\n",
-               list->ip, list->port, list->len, list->available_len, list->flow_finished);
+    if (!list)
+        return;
+
+    printf("%s:%hu  total connections: %u  live connections: %u  available connections: %u  flows finished: %u\n",
+           list->ip, list->port, atomic_load(&(list->len)), atomic_load(&(list->live_len)), atomic_load(&(list->available_len)),
+           atomic_load(&(list->flow_finished)));
+
+    pthread_mutex_lock(&(list->pending_lock));
+    if (list->num_wait_flow > 0 || list->num_drop_flow > 0)
+        printf("%s:%hu  requests waiting for a connection: %u  average wait: %llu us  max wait: %llu us  dropped: %u\n",
+               list->ip, list->port, list->num_wait_flow,
+               (list->num_wait_flow > 0) ? list->wait_us_total / list->num_wait_flow : 0,
+               list->wait_us_max, list->num_drop_flow);
+    pthread_mutex_unlock(&(list->pending_lock));
 }
@@ -6,31 +6,93 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "clock.h"
 
 struct conn_list;
 
+/* a flow request waiting for a connection */
+struct pending_flow
+{
+    struct flow_metadata flow;  /* flow request */
+    unsigned long long enqueue_ns;  /* time when the request started to wait (CLOCK_MONOTONIC) */
+    struct pending_flow *next;  /* next request in the queue */
+};
+
+/* size of a cache line */
+#define TG_CACHE_LINE_SIZE 64
+/* number of connections allocated together in a chunk of the pool */
+#define TG_CONN_CHUNK_SIZE 256
+/* maximum number of chunks per server (TG_CONN_CHUNK_SIZE * TG_CONN_MAX_CHUNK connections) */
+#define TG_CONN_MAX_CHUNK 1024
+
+/* a request outstanding on a pipelined or multiplexed connection */
+struct conn_req
+{
+    atomic_uint id; /* flow ID (0: free slot) */
+    unsigned long long start_ns;    /* when the request was sent (CLOCK_MONOTONIC) */
+    unsigned long long header_ns;   /* when the metadata of its flow arrived (CLOCK_MONOTONIC) */
+    unsigned long long wait_ns; /* how long the request waited for a connection before it was sent */
+    char meta_buf[TG_METADATA_SIZE];    /* metadata received (multiplexing) */
+    unsigned int meta_len;  /* bytes of metadata received (multiplexing) */
+    unsigned int bytes_left;    /* payload bytes left to receive (multiplexing) */
+};
+
+/* each connection has its own cache lines, so that receivers do not false-share them */
 struct conn_node
 {
-    int id; /* connection ID */
+    int id; /* connection ID (index in the pool) */
     int sockfd; /* socket */
-    pthread_t thread;   /* thread */
-    bool busy;  /* whether the connection is receiving data */
-    bool connected; /* whether the connection is established */
+    /* (outstanding requests << 1) | 1 if a thread holds the connection to send requests */
+    atomic_uint depth_state;
+    atomic_bool connected;  /* whether the connection is established */
+    atomic_uint free_next;  /* ID + 1 of the next connection in the free stack (0: none) */
+    char meta_buf[TG_METADATA_SIZE];    /* metadata of the flow being received */
+    unsigned int meta_len;  /* bytes of metadata received */
+    struct flow_metadata flow;  /* flow being received */
+    unsigned int bytes_left;    /* payload bytes left to receive */
+    unsigned long long start_ns;    /* when the request of the outstanding flow was sent (CLOCK_MONOTONIC) */
+    unsigned long long header_ns;   /* when the metadata of the outstanding flow arrived (CLOCK_MONOTONIC) */
+    unsigned long long wait_ns; /* how long the outstanding request waited for a connection before it was sent */
+    struct conn_req reqs[TG_MAX_DEPTH]; /* outstanding requests (pipelined or multiplexed lists only) */
+    struct conn_req *cur_req;   /* request of the flow (or frame) being received */
+    char frame_buf[TG_FRAME_HEADER_SIZE];   /* header of the frame being received (multiplexing) */
+    unsigned int frame_len; /* bytes of the frame header received (multiplexing) */
+    unsigned int frame_left;    /* bytes of the frame left to receive (multiplexing) */
     struct conn_node *next; /* pointer to next node */
     struct conn_list *list; /* pointer to parent list */
-};
+} __attribute__((aligned(TG_CACHE_LINE_SIZE)));
 
 struct conn_list
 {
     int index;  /* server index */
     char ip[20];    /* server IP address */
     unsigned short port;   /* server port number */
+    struct conn_node *chunks[TG_CONN_MAX_CHUNK];    /* nodes, allocated TG_CONN_CHUNK_SIZE at a time */
     struct conn_node *head; /* pointer to head node */
     struct conn_node *tail; /* pointer to tail node */
-    unsigned int len;   /* total number of nodes */
-    unsigned int available_len; /* total number of available nodes */
-    unsigned int flow_finished; /* total number of flows finished */
-    pthread_mutex_t lock;
+    atomic_uint len;    /* total number of nodes */
+    atomic_uint live_len;   /* connections established or being established */
+    unsigned int max_len;   /* maximum number of live connections (0: no limit) */
+    unsigned int dead_top;  /* ID + 1 of the first dead node to reuse (0: none), protected by lock */
+    unsigned int depth; /* maximum number of outstanding requests per connection */
+    bool mux;   /* whether responses of outstanding requests are interleaved frames */
+    pthread_mutex_t lock;   /* serialize insertions */
+    /* free stack of available connections: (tag << 32) | (ID + 1), the tag avoids ABA */
+    atomic_ullong free_top __attribute__((aligned(TG_CACHE_LINE_SIZE)));
+    atomic_uint available_len;  /* total number of available nodes */
+    atomic_uint flow_finished __attribute__((aligned(TG_CACHE_LINE_SIZE)));  /* total number of flows finished */
+    atomic_uint connecting; /* connections being established in the background */
+    atomic_uint pending_len;    /* flow requests waiting for a connection */
+    struct pending_flow *pending_head;  /* oldest waiting request */
+    struct pending_flow *pending_tail;  /* newest waiting request */
+    unsigned int num_wait_flow; /* requests that have waited for a connection */
+    unsigned int num_drop_flow; /* requests dropped as no connection could be established */
+    unsigned long long wait_us_total;   /* total waiting time of requests (us) */
+    unsigned long long wait_us_max; /* maximum waiting time of requests (us) */
+    pthread_mutex_t pending_lock;   /* protect the queue of waiting requests and its statistics */
 };
 
 
@@ -41,14 +103,60 @@ bool init_conn_list(struct conn_list *list, int index, char *ip, unsigned short
 /* insert several nodes to the tail of the linked list */
 bool insert_conn_list(struct conn_list *list, int num);
 
-/* search the first available connection (busy==false) in the list. */
-struct conn_node *search_conn_list(struct conn_list *list);
+/* insert a node whose connection is established in the background (NULL if it fails) */
+struct conn_node *insert_conn_list_async(struct conn_list *list);
+
+/* finish the background connect() of a node and return true if the connection is established */
+bool finish_conn_node(struct conn_node *node);
+
+/* give up a background connect() that was never handed to a receiver, the node is reused by the next insertion */
+void cancel_conn_node(struct conn_node *node);
+
+/* close the socket of a connection, which no longer counts against the limit of its list */
+void close_conn_node(struct conn_node *node);
+
+/* let the next insertion reuse a dead node that is not in the free stack and that no receiver watches */
+void recycle_conn_node(struct conn_node *node);
+
+/* limit the number of connections of a list (0: no limit) */
+void set_conn_list_max(struct conn_list *list, unsigned int max_len);
+
+/* whether a list has as many connections as it may have */
+bool conn_list_full(struct conn_list *list);
+
+/* queue a flow request until a connection of the list becomes available */
+bool enqueue_pending_flow(struct conn_list *list, struct flow_metadata *flow);
+
+/* take the oldest queued flow request and its waiting time ('wait_ns' may be NULL),
+   return true if there is one ('drop': it will not be sent) */
+bool dequeue_pending_flow(struct conn_list *list, struct flow_metadata *flow, bool drop, unsigned long long *wait_ns);
+
+/* let connections of a list carry up to 'depth' outstanding requests, multiplexed if 'mux' */
+bool set_conn_list_depth(struct conn_list *list, unsigned int depth, bool mux);
+
+/* take a connection that can carry one more request (NULL if none) and hold it in O(1) */
+struct conn_node *acquire_conn_list(struct conn_list *list);
+
+/* take N available connections into 'nodes' and return true if it succeeds (all or nothing) */
+bool acquire_n_conn_list(struct conn_list *list, unsigned int num, struct conn_node **nodes);
+
+/* stop holding a connection: it goes back to its list, or waits for a completion if it is full */
+void release_conn_list(struct conn_node *node);
+
+/* get the number of outstanding requests of a connection */
+unsigned int conn_node_outstanding(struct conn_node *node);
+
+/* record a request about to be sent on a held connection after waiting 'wait_ns' for it */
+void start_conn_req(struct conn_node *node, unsigned int id, unsigned long long wait_ns);
+
+/* find an outstanding request of a pipelined or multiplexed connection by flow ID (NULL if none) */
+struct conn_req *find_conn_req(struct conn_node *node, unsigned int id);
 
-/* search N available connections in the list */
-struct conn_node **search_n_conn_list(struct conn_list *list, unsigned int num);
+/* move the times of a received request into the node and free its slot */
+void free_conn_req(struct conn_node *node, struct conn_req *req);
 
-/* wait for all threads in the linked list to finish */
-void wait_conn_list(struct conn_list *list);
+/* count a completed request and return true if the caller now holds the connection (it was full) */
+bool finish_conn_req(struct conn_node *node);
 
 /* clear all the nodes in the linked list */
 void clear_conn_list(struct conn_list *list);
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "clock.h"
+#include "flow_log.h"
+
+/* a slot of the queue, 'seq' tells whether it is free or holds a record (bounded MPMC queue by D. Vyukov) */
+struct log_slot
+{
+    atomic_ulong seq;
+    struct log_record rec;
+};
+
+static struct log_slot *slots = NULL;   /* queue of records, TG_LOG_QUEUE_LEN slots */
+static atomic_ulong enqueue_pos __attribute__((aligned(64)));   /* next slot to fill (producers) */
+static unsigned long dequeue_pos __attribute__((aligned(64))) = 0;  /* next slot to read (writer only) */
+static atomic_ullong num_full_wait; /* pushes that waited for the writer because the queue was full */
+
+static int log_fd = -1; /* log file */
+static char *log_buf = NULL;    /* records formatted but not written yet */
+static unsigned int log_buf_len = 0;    /* bytes in log_buf */
+static unsigned long long num_written = 0;  /* records handed to the log file */
+static char log_name[80] = {0}; /* name of the log file */
+static enum log_format log_format = TG_LOG_TEXT;    /* format of the log file */
+
+static pthread_t writer_thread;
+static atomic_bool stop_writer;
+static bool catch_signals = false;  /* whether the writer handles SIGINT and SIGTERM */
+static sigset_t exit_signals;   /* SIGINT and SIGTERM */
+
+/* main loop of the log writer */
+static void *run_writer(void *ptr);
+
+/* open the log of flows in 'format' and start its writer thread. With 'catch_exit_signals', SIGINT and SIGTERM
+   are blocked in the calling thread (and threads it creates later) and make the writer dump the log and exit. */
+bool init_flow_log(char *file_name, enum log_format format, bool catch_exit_signals)
+{
+    struct log_header header;
+    unsigned long i = 0;
+
+    if (!file_name || strlen(file_name) >= sizeof(log_name))
+        return false;
+    strcpy(log_name, file_name);
+
+    slots = (struct log_slot*)malloc(TG_LOG_QUEUE_LEN * sizeof(struct log_slot));
+    log_buf = (char*)malloc(TG_LOG_BUF_SIZE);
+    if (!slots || !log_buf)
+    {
+        perror("Error: malloc in init_flow_log()");
+        return false;
+    }
+
+    for (i = 0; i < TG_LOG_QUEUE_LEN; i++)
+        atomic_init(&(slots[i].seq), i);
+    atomic_init(&enqueue_pos, 0);
+    atomic_init(&num_full_wait, 0);
+    atomic_init(&stop_writer, false);
+
+    log_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd < 0)
+    {
+        perror("Error: open the log file in init_flow_log()");
+        return false;
+    }
+
+    log_format = format;
+    if (log_format == TG_LOG_BINARY)
+    {
+        init_log_header(&header, TG_LOG_FLOW);
+        memcpy(log_buf, &header, sizeof(header));
+        log_buf_len = sizeof(header);
+    }
+
+    /* threads created later inherit the mask, so only the writer takes these signals */
+    catch_signals = catch_exit_signals;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    if (catch_signals && pthread_sigmask(SIG_BLOCK, &exit_signals, NULL) != 0)
+    {
+        perror("Error: pthread_sigmask() in init_flow_log()");
+        return false;
+    }
+
+    if (pthread_create(&writer_thread, NULL, run_writer, NULL) != 0)
+    {
+        perror("Error: pthread_create() in init_flow_log()");
+        return false;
+    }
+
+    return true;
+}
+
+/* queue a completed flow for the log writer (thread-safe, lock-free, the goodput must be set) */
+void flow_log_push(struct log_record *r)
+{
+    unsigned long pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    struct log_slot *slot = NULL;
+    long diff;
+    bool waited = false;
+
+    while (true)
+    {
+        slot = &slots[pos & (TG_LOG_QUEUE_LEN - 1)];
+        diff = (long)atomic_load_explicit(&(slot->seq), memory_order_acquire) - (long)pos;
+        /* the slot is free: claim it */
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        /* the queue is full: let the writer catch up */
+        else if (diff < 0)
+        {
+            if (!waited)
+                atomic_fetch_add(&num_full_wait, 1);
+            waited = true;
+            sched_yield();
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+        else
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    }
+
+    slot->rec = *r;
+    atomic_store_explicit(&(slot->seq), pos + 1, memory_order_release);
+}
+
+/* take the oldest record from the queue, return false if it is empty (writer only) */
+static bool flow_log_pop(struct log_record *r)
+{
+    struct log_slot *slot = &slots[dequeue_pos & (TG_LOG_QUEUE_LEN - 1)];
+
+    if (atomic_load_explicit(&(slot->seq), memory_order_acquire) != dequeue_pos + 1)
+        return false;
+
+    *r = slot->rec;
+    atomic_store_explicit(&(slot->seq), dequeue_pos + TG_LOG_QUEUE_LEN, memory_order_release);
+    dequeue_pos++;
+    return true;
+}
+
+/* hand the buffered records to the log file ('sync': make them durable as a checkpoint) */
+static void flush_log(bool sync)
+{
+    unsigned int off = 0;
+    ssize_t n;
+
+    while (off < log_buf_len)
+    {
+        n = write(log_fd, log_buf + off, log_buf_len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0)
+        {
+            perror("Error: write() in flush_log()");
+            break;
+        }
+        off += n;
+    }
+    log_buf_len = 0;
+
+    if (sync && fdatasync(log_fd) < 0)
+        perror("Error: fdatasync() in flush_log()");
+}
+
+/* format all the queued records into the buffer, return the number of records */
+static unsigned long long drain_log()
+{
+    struct log_record r;
+    unsigned long long num = 0;
+
+    while (flow_log_pop(&r))
+    {
+        /* a whole record always fits, so the file never ends in the middle of a record */
+        if (log_buf_len + TG_LOG_LINE_MAX > TG_LOG_BUF_SIZE)
+            flush_log(false);
+
+        if (log_format == TG_LOG_BINARY)
+        {
+            memcpy(log_buf + log_buf_len, &r, sizeof(r));
+            log_buf_len += sizeof(r);
+        }
+        else
+            log_buf_len += format_log_record(log_buf + log_buf_len, TG_LOG_BUF_SIZE - log_buf_len, &r, log_format, TG_LOG_FLOW);
+        num++;
+    }
+
+    num_written += num;
+    return num;
+}
+
+/* main loop of the log writer */
+static void *run_writer(void *ptr)
+{
+    unsigned long long last_flush_ns = get_mono_ns();
+    unsigned long long now_ns;
+    struct timespec busy = {0, 0};
+    struct timespec idle = {0, TG_LOG_IDLE_US * 1000};
+    unsigned long long num;
+    bool stop;
+    int sig;
+
+    while (true)
+    {
+        stop = atomic_load(&stop_writer);
+        num = drain_log();
+
+        now_ns = get_mono_ns();
+        if (now_ns - last_flush_ns >= TG_LOG_FLUSH_MS * 1000000ULL)
+        {
+            flush_log(true);
+            last_flush_ns = now_ns;
+        }
+
+        /* every record pushed before stop_flow_log() has been drained */
+        if (stop)
+            break;
+
+        if (catch_signals)
+        {
+            sig = sigtimedwait(&exit_signals, NULL, (num > 0) ? &busy : &idle);
+            if (sig == SIGINT || sig == SIGTERM)
+            {
+                drain_log();
+                flush_log(true);
+                printf("\nInterrupted: %llu flows written to %s\n", num_written, log_name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (num == 0)
+            usleep(TG_LOG_IDLE_US);
+    }
+
+    flush_log(true);
+    return (void*)0;
+}
+
+/* write the remaining records, stop the writer thread and return the number of records written */
+unsigned long long stop_flow_log()
+{
+    if (log_fd < 0)
+        return 0;
+
+    atomic_store(&stop_writer, true);
+    pthread_join(writer_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+
+    if (atomic_load(&num_full_wait) > 0)
+        printf("The log queue was full %llu times\n", (unsigned long long)atomic_load(&num_full_wait));
+
+    /* signals are handled by default again */
+    if (catch_signals)
+        pthread_sigmask(SIG_UNBLOCK, &exit_signals, NULL);
+
+    free(slots);
+    free(log_buf);
+    slots = NULL;
+    log_buf = NULL;
+    return num_written;
+}
@@ -0,0 +1,28 @@
+#ifndef FLOW_LOG_H
+#define FLOW_LOG_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "log_format.h"
+
+/* number of records the queue between receivers and the log writer can hold (power of 2) */
+#define TG_LOG_QUEUE_LEN (1 << 16)
+/* size of the buffer the log writer fills before a write() */
+#define TG_LOG_BUF_SIZE (1 << 20)
+/* interval between two checkpoints of the log (ms) */
+#define TG_LOG_FLUSH_MS 1000
+/* how long the log writer waits when the queue is empty (us) */
+#define TG_LOG_IDLE_US 1000
+
+/* open the log of flows in 'format' and start its writer thread. With 'catch_exit_signals', SIGINT and SIGTERM
+   are blocked in the calling thread (and threads it creates later) and make the writer dump the log and exit. */
+bool init_flow_log(char *file_name, enum log_format format, bool catch_exit_signals);
+
+/* queue a completed flow for the log writer (thread-safe, lock-free, the goodput must be set) */
+void flow_log_push(struct log_record *r);
+
+/* write the remaining records, stop the writer thread and return the number of records written */
+unsigned long long stop_flow_log();
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "flow_stats.h"
+
+static const char *size_bucket_names[TG_STATS_SIZE_BUCKETS] = {"(0, 100KB)", "[100KB, 10MB)", "[10MB, )"};
+
+/* size bucket of a flow or request */
+static unsigned int size_bucket(unsigned int size)
+{
+    if (size < TG_STATS_SMALL_SIZE)
+        return 0;
+    else if (size < TG_STATS_LARGE_SIZE)
+        return 1;
+    else
+        return 2;
+}
+
+/* allocate empty statistics (pages of unused DSCPs are never touched), NULL on failure */
+struct flow_stats *new_flow_stats()
+{
+    /* calloc() of large blocks maps zero pages lazily, and zero is an empty histogram */
+    struct flow_stats *s = (struct flow_stats*)calloc(1, sizeof(struct flow_stats));
+
+    if (!s)
+        perror("Error: calloc() in new_flow_stats()");
+    return s;
+}
+
+/* free statistics */
+void free_flow_stats(struct flow_stats *s)
+{
+    free(s);
+}
+
+/* add a flow or request to a group */
+static void stats_group_add(struct stats_group *g, struct log_record *r)
+{
+    histogram_add(&(g->fct), r->fct_us);
+    histogram_add(&(g->goodput), r->goodput);
+    histogram_add(&(g->ttfb), get_log_ttfb_us(r));
+    histogram_add(&(g->transfer), get_log_transfer_us(r));
+}
+
+/* add a completed flow or request whose goodput is set (thread-safe) */
+void flow_stats_add(struct flow_stats *s, struct log_record *r)
+{
+    if (!s)
+        return;
+
+    stats_group_add(&(s->all), r);
+    stats_group_add(&(s->size[size_bucket(r->size)]), r);
+    if (r->dscp < TG_STATS_DSCPS)
+        stats_group_add(&(s->dscp[r->dscp]), r);
+}
+
+/* print a line of completion times and goodput */
+static void print_stats_group(struct stats_group *g, const char *label)
+{
+    printf("%-15s %10llu %10.0f %10llu %10llu %10llu %10llu %10.0f %10llu\n", label, histogram_num(&(g->fct)),
+           histogram_mean(&(g->fct)), histogram_percentile(&(g->fct), 0.5), histogram_percentile(&(g->fct), 0.99),
+           histogram_percentile(&(g->fct), 0.999), histogram_max(&(g->fct)),
+           histogram_mean(&(g->goodput)), histogram_percentile(&(g->goodput), 0.5));
+}
+
+/* print a line of times to first byte and transfer times */
+static void print_stats_group_split(struct stats_group *g, const char *label)
+{
+    printf("%-15s %10llu %10.0f %10llu %10llu %10llu %10.0f %10llu %10llu %10llu\n", label, histogram_num(&(g->ttfb)),
+           histogram_mean(&(g->ttfb)), histogram_percentile(&(g->ttfb), 0.5), histogram_percentile(&(g->ttfb), 0.99),
+           histogram_max(&(g->ttfb)), histogram_mean(&(g->transfer)), histogram_percentile(&(g->transfer), 0.5),
+           histogram_percentile(&(g->transfer), 0.99), histogram_max(&(g->transfer)));
+}
+
+/* print a table with a line per group that has values */
+static void print_stats_table(struct flow_stats *s, void (*print_line)(struct stats_group *g, const char *label))
+{
+    char label[16] = {0};
+    unsigned int i;
+
+    print_line(&(s->all), "all");
+    for (i = 0; i < TG_STATS_SIZE_BUCKETS; i++)
+        print_line(&(s->size[i]), size_bucket_names[i]);
+    for (i = 0; i < TG_STATS_DSCPS; i++)
+    {
+        if (histogram_num(&(s->dscp[i].fct)) == 0)
+            continue;
+        snprintf(label, sizeof(label), "DSCP %u", i);
+        print_line(&(s->dscp[i]), label);
+    }
+}
+
+/* print statistics of 'name' (e.g. "flows") per size bucket and per DSCP */
+void print_flow_stats(struct flow_stats *s, const char *name)
+{
+    if (!s)
+        return;
+
+    printf("Completion times (us) and goodput (Mbps) of %s:\n", name);
+    printf("%-15s %10s %10s %10s %10s %10s %10s %10s %10s\n", "", "number", "avg", "p50", "p99", "p99.9", "max",
+           "avg gput", "p50 gput");
+    print_stats_table(s, print_stats_group);
+
+    /* request latency and server turnaround vs. throughput */
+    printf("Time to first byte and transfer time after it (us) of %s:\n", name);
+    printf("%-15s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "", "number", "avg ttfb", "p50 ttfb", "p99 ttfb",
+           "max ttfb", "avg xfer", "p50 xfer", "p99 xfer", "max xfer");
+    print_stats_table(s, print_stats_group_split);
+}
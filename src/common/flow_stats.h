@@ -0,0 +1,48 @@
+#ifndef FLOW_STATS_H
+#define FLOW_STATS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+#include "log_format.h"
+
+/* upper bound of small flows (bytes, same buckets as result.py) */
+#define TG_STATS_SMALL_SIZE (100 * 1024)
+/* lower bound of large flows (bytes) */
+#define TG_STATS_LARGE_SIZE (10 * 1024 * 1024)
+/* number of size buckets: (0, 100KB), [100KB, 10MB) and [10MB, ) */
+#define TG_STATS_SIZE_BUCKETS 3
+/* number of DSCP values */
+#define TG_STATS_DSCPS 64
+
+/* completion times, goodput and time to first byte of a group of flows or requests */
+struct stats_group
+{
+    struct histogram fct;   /* completion times (us) */
+    struct histogram goodput;   /* goodput (Mbps) */
+    struct histogram ttfb;  /* time to first byte (us) */
+    struct histogram transfer;  /* transfer time after the first byte (us) */
+};
+
+/* statistics of completed flows or requests, kept while the run is going */
+struct flow_stats
+{
+    struct stats_group all;
+    struct stats_group size[TG_STATS_SIZE_BUCKETS];
+    struct stats_group dscp[TG_STATS_DSCPS];
+};
+
+/* allocate empty statistics (pages of unused DSCPs are never touched), NULL on failure */
+struct flow_stats *new_flow_stats();
+
+/* free statistics */
+void free_flow_stats(struct flow_stats *s);
+
+/* add a completed flow or request whose goodput is set (thread-safe) */
+void flow_stats_add(struct flow_stats *s, struct log_record *r);
+
+/* print statistics of 'name' (e.g. "flows") per size bucket and per DSCP */
+void print_flow_stats(struct flow_stats *s, const char *name);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "histogram.h"
+
+/* number of exact values (and of sub-buckets of each power of 2 above them, times 2) */
+#define TG_HIST_SUB (1ULL << TG_HIST_SUB_BITS)
+/* sub-buckets of each power of 2 above the exact values */
+#define TG_HIST_HALF (1ULL << (TG_HIST_SUB_BITS - 1))
+
+/* bucket of a value */
+static unsigned int histogram_index(unsigned long long value)
+{
+    unsigned int shift;
+
+    if (value < TG_HIST_SUB)
+        return (unsigned int)value;
+
+    value = min(value, (1ULL << TG_HIST_MAX_BITS) - 1);
+    /* keep the TG_HIST_SUB_BITS most significant bits */
+    shift = 64 - __builtin_clzll(value) - TG_HIST_SUB_BITS;
+    return (unsigned int)((shift * TG_HIST_HALF) + (value >> shift));
+}
+
+/* value in the middle of a bucket */
+static unsigned long long histogram_value(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < TG_HIST_SUB)
+        return index;
+
+    shift = index / TG_HIST_HALF - 1;
+    return ((index - shift * TG_HIST_HALF) << shift) + ((1ULL << shift) - 1) / 2;
+}
+
+/* clear a histogram */
+void reset_histogram(struct histogram *h)
+{
+    unsigned int i;
+
+    for (i = 0; i < TG_HIST_BUCKETS; i++)
+        atomic_store_explicit(&(h->counts[i]), 0, memory_order_relaxed);
+    atomic_store(&(h->num), 0);
+    atomic_store(&(h->sum), 0);
+    atomic_store(&(h->max), 0);
+}
+
+/* add a value to a histogram (thread-safe) */
+void histogram_add(struct histogram *h, unsigned long long value)
+{
+    unsigned long long cur_max = atomic_load_explicit(&(h->max), memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&(h->counts[histogram_index(value)]), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(h->sum), value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(h->num), 1, memory_order_relaxed);
+
+    while (value > cur_max && !atomic_compare_exchange_weak_explicit(&(h->max), &cur_max, value,
+                                                                    memory_order_relaxed, memory_order_relaxed));
+}
+
+/* get the number of values of a histogram */
+unsigned long long histogram_num(struct histogram *h)
+{
+    return atomic_load_explicit(&(h->num), memory_order_relaxed);
+}
+
+/* get the average of the values of a histogram (0 if empty) */
+double histogram_mean(struct histogram *h)
+{
+    unsigned long long num = histogram_num(h);
+
+    if (num == 0)
+        return 0;
+    return (double)atomic_load_explicit(&(h->sum), memory_order_relaxed) / num;
+}
+
+/* get the maximum value of a histogram (0 if empty) */
+unsigned long long histogram_max(struct histogram *h)
+{
+    return atomic_load_explicit(&(h->max), memory_order_relaxed);
+}
+
+/* get the 'p' (0 to 1) percentile of a histogram, with the same rank as result.py (0 if empty) */
+unsigned long long histogram_percentile(struct histogram *h, double p)
+{
+    unsigned long long num = 0, rank, seen = 0;
+    unsigned int i;
+
+    /* values may be added meanwhile, so count what we actually walk over */
+    for (i = 0; i < TG_HIST_BUCKETS; i++)
+        num += atomic_load_explicit(&(h->counts[i]), memory_order_relaxed);
+    if (num == 0 || p < 0)
+        return 0;
+
+    rank = min((unsigned long long)(p * num), num - 1);
+    for (i = 0; i < TG_HIST_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&(h->counts[i]), memory_order_relaxed);
+        if (seen > rank)
+            return min(histogram_value(i), histogram_max(h));
+    }
+
+    return histogram_max(h);
+}
+
+/* add a value to the current interval (thread-safe) */
+void interval_histogram_add(struct interval_histogram *ih, unsigned long long value)
+{
+    histogram_add(&(ih->buf[atomic_load(&(ih->cur)) & 1]), value);
+}
+
+/* start a new interval and return the histogram of the one that ended, valid until the next swap
+   (only one thread swaps, a value added right when the interval ends may be missed) */
+struct histogram *swap_interval_histogram(struct interval_histogram *ih)
+{
+    unsigned int old = atomic_load(&(ih->cur)) & 1;
+
+    /* the next buffer was read at the end of the previous interval */
+    reset_histogram(&(ih->buf[old ^ 1]));
+    atomic_store(&(ih->cur), old ^ 1);
+    return &(ih->buf[old]);
+}
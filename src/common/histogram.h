@@ -0,0 +1,57 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* log2 of sub-buckets per power of 2 (relative error of percentiles below 1 / 2^(TG_HIST_SUB_BITS-1)) */
+#define TG_HIST_SUB_BITS 7
+/* values are counted up to 2^TG_HIST_MAX_BITS - 1, larger ones in the last bucket */
+#define TG_HIST_MAX_BITS 40
+/* number of buckets of a histogram */
+#define TG_HIST_BUCKETS ((TG_HIST_MAX_BITS - TG_HIST_SUB_BITS + 2) << (TG_HIST_SUB_BITS - 1))
+
+/* log-linear (HDR-style) histogram: values below 2^TG_HIST_SUB_BITS are exact, then each power of 2
+   is split into 2^(TG_HIST_SUB_BITS-1) buckets. Memory is fixed and threads add values without locks. */
+struct histogram
+{
+    atomic_ullong counts[TG_HIST_BUCKETS];
+    atomic_ullong num;  /* number of values */
+    atomic_ullong sum;  /* sum of values */
+    atomic_ullong max;  /* maximum value */
+};
+
+/* histogram of the current interval: a reporter swaps the buffers at the end of each interval */
+struct interval_histogram
+{
+    struct histogram buf[2];
+    atomic_uint cur;    /* buffer of the current interval */
+};
+
+/* clear a histogram */
+void reset_histogram(struct histogram *h);
+
+/* add a value to a histogram (thread-safe) */
+void histogram_add(struct histogram *h, unsigned long long value);
+
+/* get the number of values of a histogram */
+unsigned long long histogram_num(struct histogram *h);
+
+/* get the average of the values of a histogram (0 if empty) */
+double histogram_mean(struct histogram *h);
+
+/* get the maximum value of a histogram (0 if empty) */
+unsigned long long histogram_max(struct histogram *h);
+
+/* get the 'p' (0 to 1) percentile of a histogram, with the same rank as result.py (0 if empty) */
+unsigned long long histogram_percentile(struct histogram *h, double p);
+
+/* add a value to the current interval (thread-safe) */
+void interval_histogram_add(struct interval_histogram *ih, unsigned long long value);
+
+/* start a new interval and return the histogram of the one that ended, valid until the next swap
+   (only one thread swaps, a value added right when the interval ends may be missed) */
+struct histogram *swap_interval_histogram(struct interval_histogram *ih);
+
+#endif
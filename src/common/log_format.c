@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "log_format.h"
+
+static const char *log_format_names[] = {"text", "binary", "text-ns", "text-ext"};
+
+/* parse the name of a log format and return true if it succeeds */
+bool parse_log_format(char *name, enum log_format *format)
+{
+    int i = 0;
+
+    for (i = TG_LOG_TEXT; i <= TG_LOG_TEXT_EXT; i++)
+    {
+        if (!strcmp(name, log_format_names[i]))
+        {
+            *format = (enum log_format)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* get the name of a log format */
+const char *log_format_name(enum log_format format)
+{
+    return log_format_names[format];
+}
+
+/* initialize the header of a binary log */
+void init_log_header(struct log_header *h, enum log_kind kind)
+{
+    memset(h, 0, sizeof(struct log_header));
+    memcpy(h->magic, TG_LOG_MAGIC, sizeof(h->magic));
+    h->version = TG_LOG_VERSION;
+    h->header_size = sizeof(struct log_header);
+    h->record_size = sizeof(struct log_record);
+    h->kind = kind;
+}
+
+/* check the header of a binary log, return false if it is not a log we can read */
+bool check_log_header(struct log_header *h, unsigned long long file_size)
+{
+    if (file_size < sizeof(struct log_header) || memcmp(h->magic, TG_LOG_MAGIC, sizeof(h->magic)) != 0)
+        return false;
+
+    /* later versions may only append fields to the header and records */
+    return h->version >= 1 && h->header_size >= sizeof(struct log_header) && h->header_size <= file_size &&
+           h->record_size >= sizeof(struct log_record) && h->kind <= TG_LOG_REQUEST;
+}
+
+/* set the completion time of a record (ns) */
+void set_log_fct_ns(struct log_record *r, unsigned long long fct_ns)
+{
+    r->fct_us = fct_ns / 1000;
+    r->fct_ns_rem = fct_ns % 1000;
+}
+
+/* get the completion time of a record (ns) */
+unsigned long long get_log_fct_ns(struct log_record *r)
+{
+    return r->fct_us * 1000 + r->fct_ns_rem;
+}
+
+/* get the time to first byte of a record (us) */
+unsigned long long get_log_ttfb_us(struct log_record *r)
+{
+    return min(r->ttfb_ns, get_log_fct_ns(r)) / 1000;
+}
+
+/* get the time to transfer the payload after the first byte (us) */
+unsigned long long get_log_transfer_us(struct log_record *r)
+{
+    return (get_log_fct_ns(r) - min(r->ttfb_ns, get_log_fct_ns(r))) / 1000;
+}
+
+/* set the goodput of a record from its size and completion time */
+void set_log_goodput(struct log_record *r)
+{
+    unsigned long long fct_ns = get_log_fct_ns(r);
+
+    r->goodput = (fct_ns > 0) ? (uint32_t)((unsigned long long)r->size * 8000 / fct_ns) : 0;
+}
+
+/* format a record as a line of the text log and return the length of the line */
+int format_log_record(char *buf, unsigned int len, struct log_record *r, enum log_format format, enum log_kind kind)
+{
+    int n;
+
+    /* request size, RCT(us), DSCP, sending rate (Mbps), goodput (Mbps), fanout */
+    if (kind == TG_LOG_REQUEST)
+        n = snprintf(buf, len, "%u %llu %u %u %u %u", r->size, (unsigned long long)r->fct_us, r->dscp, r->rate, r->goodput, r->fanout);
+    /* flow size, FCT(us), DSCP, sending rate (Mbps), goodput (Mbps) */
+    else
+        n = snprintf(buf, len, "%u %llu %u %u %u", r->size, (unsigned long long)r->fct_us, r->dscp, r->rate, r->goodput);
+
+    /* time to first byte (us), transfer time (us), time waiting for a connection (us) */
+    if (format == TG_LOG_TEXT_EXT)
+        n += snprintf(buf + n, len - n, " %llu %llu %llu", get_log_ttfb_us(r), get_log_transfer_us(r),
+                      (unsigned long long)r->wait_ns / 1000);
+
+    /* send skew of the flows (us) */
+    if (format == TG_LOG_TEXT_EXT && kind == TG_LOG_REQUEST)
+        n += snprintf(buf + n, len - n, " %llu", (unsigned long long)r->skew_ns / 1000);
+
+    /* RCT/FCT (ns) */
+    if (format == TG_LOG_TEXT_NS || format == TG_LOG_TEXT_EXT)
+        n += snprintf(buf + n, len - n, " %llu", get_log_fct_ns(r));
+
+    return n + snprintf(buf + n, len - n, "\n");
+}
+
+/* start a log file in 'format' (binary logs begin with a header), return true if it succeeds */
+bool begin_log_file(FILE *fd, enum log_format format, enum log_kind kind)
+{
+    struct log_header h;
+
+    if (format != TG_LOG_BINARY)
+        return true;
+
+    init_log_header(&h, kind);
+    return fwrite(&h, sizeof(h), 1, fd) == 1;
+}
+
+/* append a record to a log file in 'format', return true if it succeeds */
+bool write_log_record(FILE *fd, struct log_record *r, enum log_format format, enum log_kind kind)
+{
+    char line[TG_LOG_LINE_MAX];
+
+    if (format == TG_LOG_BINARY)
+        return fwrite(r, sizeof(struct log_record), 1, fd) == 1;
+
+    format_log_record(line, sizeof(line), r, format, kind);
+    return fputs(line, fd) >= 0;
+}
@@ -0,0 +1,94 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* formats of FCT/RCT logs */
+enum log_format
+{
+    TG_LOG_TEXT,    /* one line per flow or request: size fct dscp rate goodput [fanout] */
+    TG_LOG_BINARY,  /* struct log_header followed by fixed-width struct log_record (native byte order) */
+    TG_LOG_TEXT_NS, /* TG_LOG_TEXT with the completion time in ns as the last column */
+    TG_LOG_TEXT_EXT /* TG_LOG_TEXT_NS with ttfb transfer wait [skew] before the completion time in ns */
+};
+
+/* what the records of a log are */
+enum log_kind
+{
+    TG_LOG_FLOW,    /* flows (FCT) */
+    TG_LOG_REQUEST  /* requests of the incast client (RCT, with fanout) */
+};
+
+/* first bytes of a binary log */
+#define TG_LOG_MAGIC "TGLOG\0\0\0"
+/* version of the binary log format */
+#define TG_LOG_VERSION 1
+/* maximum length of a line of the text log */
+#define TG_LOG_LINE_MAX 192
+
+/* header of a binary log */
+struct log_header
+{
+    char magic[8];  /* TG_LOG_MAGIC */
+    uint32_t version;   /* TG_LOG_VERSION */
+    uint32_t header_size;   /* bytes of the header (records start here) */
+    uint32_t record_size;   /* bytes of each record */
+    uint32_t kind;  /* enum log_kind */
+    uint64_t reserved;
+};
+
+/* a completed flow or request, as stored in a binary log */
+struct log_record
+{
+    uint64_t fct_us;    /* flow (or request) completion time (us) */
+    uint32_t size;  /* size (bytes) */
+    uint32_t dscp;  /* DSCP */
+    uint32_t rate;  /* sending rate (Mbps) */
+    uint32_t goodput;   /* goodput (Mbps) */
+    uint32_t fanout;    /* fanout of a request (0 for flows) */
+    uint32_t fct_ns_rem;    /* nanoseconds of the completion time beyond fct_us (0 to 999) */
+    uint64_t ttfb_ns;   /* time to first byte: until the metadata of the (first) flow arrives (ns, 0: unknown) */
+    uint64_t wait_ns;   /* time waiting for a connection (or, for requests, after the scheduled arrival) before being sent (ns, not in the completion time) */
+    uint64_t skew_ns;   /* time between sending the first and the last back-to-back flow of a request (ns, 0 for flows) */
+};
+
+/* parse the name of a log format and return true if it succeeds */
+bool parse_log_format(char *name, enum log_format *format);
+
+/* get the name of a log format */
+const char *log_format_name(enum log_format format);
+
+/* initialize the header of a binary log */
+void init_log_header(struct log_header *h, enum log_kind kind);
+
+/* check the header of a binary log, return false if it is not a log we can read */
+bool check_log_header(struct log_header *h, unsigned long long file_size);
+
+/* set the completion time of a record (ns) */
+void set_log_fct_ns(struct log_record *r, unsigned long long fct_ns);
+
+/* get the completion time of a record (ns) */
+unsigned long long get_log_fct_ns(struct log_record *r);
+
+/* get the time to first byte of a record (us) */
+unsigned long long get_log_ttfb_us(struct log_record *r);
+
+/* get the time to transfer the payload after the first byte (us) */
+unsigned long long get_log_transfer_us(struct log_record *r);
+
+/* set the goodput of a record from its size and completion time */
+void set_log_goodput(struct log_record *r);
+
+/* format a record as a line of the text log and return the length of the line */
+int format_log_record(char *buf, unsigned int len, struct log_record *r, enum log_format format, enum log_kind kind);
+
+/* start a log file in 'format' (binary logs begin with a header), return true if it succeeds */
+bool begin_log_file(FILE *fd, enum log_format format, enum log_kind kind);
+
+/* append a record to a log file in 'format', return true if it succeeds */
+bool write_log_record(FILE *fd, struct log_record *r, enum log_format format, enum log_kind kind);
+
+#endif
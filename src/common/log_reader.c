@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "log_reader.h"
+
+/* map a binary log, return false if it cannot be read */
+bool open_log_reader(struct log_reader *r, char *file_name)
+{
+    struct stat st;
+
+    memset(r, 0, sizeof(struct log_reader));
+    r->fd = open(file_name, O_RDONLY);
+    if (r->fd < 0)
+    {
+        perror("Error: open() in open_log_reader()");
+        return false;
+    }
+
+    if (fstat(r->fd, &st) < 0 || st.st_size < sizeof(struct log_header))
+    {
+        printf("Error: %s is not a binary log\n", file_name);
+        close(r->fd);
+        return false;
+    }
+
+    r->map_len = st.st_size;
+    r->map = (char*)mmap(NULL, r->map_len, PROT_READ, MAP_PRIVATE, r->fd, 0);
+    if (r->map == MAP_FAILED)
+    {
+        perror("Error: mmap() in open_log_reader()");
+        close(r->fd);
+        return false;
+    }
+
+    r->header = (struct log_header*)r->map;
+    if (!check_log_header(r->header, r->map_len))
+    {
+        printf("Error: %s is not a binary log of version %d or a compatible one\n", file_name, TG_LOG_VERSION);
+        close_log_reader(r);
+        return false;
+    }
+
+    /* records are read once from start to end */
+    madvise(r->map, r->map_len, MADV_SEQUENTIAL);
+    r->num_records = (r->map_len - r->header->header_size) / r->header->record_size;
+    return true;
+}
+
+/* unmap a binary log */
+void close_log_reader(struct log_reader *r)
+{
+    if (r->map && r->map != MAP_FAILED)
+        munmap(r->map, r->map_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->map = NULL;
+    r->fd = -1;
+}
+
+/* get the i-th record of a binary log */
+struct log_record *get_log_record(struct log_reader *r, unsigned long long i)
+{
+    /* newer versions may have longer records, we only read the fields we know */
+    return (struct log_record*)(r->map + r->header->header_size + i * r->header->record_size);
+}
+
+/* filter of records in a struct log_range ('arg') */
+bool log_range_filter(struct log_record *rec, void *arg)
+{
+    struct log_range *range = (struct log_range*)arg;
+
+    return rec->size >= range->min_size && (range->max_size == 0 || rec->size < range->max_size) &&
+           (range->dscp < 0 || rec->dscp == range->dscp);
+}
+
+/* aggregate the records that 'filter' keeps (NULL: all) */
+void summarize_log(struct log_reader *r, log_filter filter, void *arg, struct log_summary *s)
+{
+    struct log_record *rec = NULL;
+    unsigned long long i = 0;
+
+    memset(s, 0, sizeof(struct log_summary));
+    for (i = 0; i < r->num_records; i++)
+    {
+        rec = get_log_record(r, i);
+        if (filter && !filter(rec, arg))
+            continue;
+
+        s->num++;
+        s->size_total += rec->size;
+        s->fct_us_total += rec->fct_us;
+        s->fct_us_max = max(s->fct_us_max, rec->fct_us);
+        s->goodput_total += rec->goodput;
+        s->ttfb_us_total += get_log_ttfb_us(rec);
+        s->wait_us_total += rec->wait_ns / 1000;
+        s->skew_ns_total += rec->skew_ns;
+    }
+}
+
+/* compare two completion times for qsort() */
+static int compare_fct(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* get the 'p' (0 to 1) percentile of completion times of the records that 'filter' keeps (NULL: all) */
+unsigned long long percentile_log(struct log_reader *r, log_filter filter, void *arg, double p)
+{
+    unsigned long long *fct = NULL;
+    unsigned long long i = 0, num = 0, result = 0;
+    struct log_record *rec = NULL;
+
+    if (r->num_records == 0 || p < 0 || p > 1)
+        return 0;
+
+    fct = (unsigned long long*)malloc(r->num_records * sizeof(unsigned long long));
+    if (!fct)
+    {
+        perror("Error: malloc() in percentile_log()");
+        return 0;
+    }
+
+    for (i = 0; i < r->num_records; i++)
+    {
+        rec = get_log_record(r, i);
+        if (!filter || filter(rec, arg))
+            fct[num++] = rec->fct_us;
+    }
+
+    /* same rank as result.py */
+    if (num > 0)
+    {
+        qsort(fct, num, sizeof(unsigned long long), compare_fct);
+        result = fct[min((unsigned long long)(p * num), num - 1)];
+    }
+
+    free(fct);
+    return result;
+}
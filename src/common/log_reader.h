@@ -0,0 +1,61 @@
+#ifndef LOG_READER_H
+#define LOG_READER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "log_format.h"
+
+/* a binary log mapped into memory */
+struct log_reader
+{
+    int fd;
+    char *map;  /* the whole file */
+    size_t map_len; /* bytes mapped */
+    struct log_header *header;
+    unsigned long long num_records; /* complete records (a run that crashed may leave a partial one) */
+};
+
+/* keep a record or not */
+typedef bool (*log_filter)(struct log_record *r, void *arg);
+
+/* records of a size range and DSCP, for log_range_filter() */
+struct log_range
+{
+    unsigned long long min_size;    /* minimum size (inclusive) */
+    unsigned long long max_size;    /* maximum size (exclusive, 0: no limit) */
+    int dscp;   /* DSCP (-1: any) */
+};
+
+/* aggregate of records */
+struct log_summary
+{
+    unsigned long long num;
+    unsigned long long size_total;
+    unsigned long long fct_us_total;
+    unsigned long long fct_us_max;
+    unsigned long long goodput_total;
+    unsigned long long ttfb_us_total;
+    unsigned long long wait_us_total;
+    unsigned long long skew_ns_total;
+};
+
+/* map a binary log, return false if it cannot be read */
+bool open_log_reader(struct log_reader *r, char *file_name);
+
+/* unmap a binary log */
+void close_log_reader(struct log_reader *r);
+
+/* get the i-th record of a binary log */
+struct log_record *get_log_record(struct log_reader *r, unsigned long long i);
+
+/* filter of records in a struct log_range ('arg') */
+bool log_range_filter(struct log_record *rec, void *arg);
+
+/* aggregate the records that 'filter' keeps (NULL: all) */
+void summarize_log(struct log_reader *r, log_filter filter, void *arg, struct log_summary *s);
+
+/* get the 'p' (0 to 1) percentile of completion times of the records that 'filter' keeps (NULL: all) */
+unsigned long long percentile_log(struct log_reader *r, log_filter filter, void *arg, double p);
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include "pacing.h"
+
+static enum pacing_engine pacing_engine = TG_PACING_SLEEP;  /* pacing engine of this process */
+static FILE *rate_log = NULL;   /* log of requested and achieved rates */
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;   /* protect rate_log and the statistics below */
+static unsigned long long num_paced_flow = 0;   /* rate-limited flows logged */
+static double requested_total = 0;  /* sum of requested rates (Mbps) */
+static double achieved_total = 0;   /* sum of achieved rates (Mbps) */
+static double error_total = 0;  /* sum of relative errors of achieved rates */
+
+static const char *pacing_engine_names[] = {"auto", "sleep", "kernel", "wheel"};
+
+/* parse the name of a pacing engine and return true if it succeeds */
+bool parse_pacing_engine(char *name, enum pacing_engine *engine)
+{
+    int i = 0;
+
+    for (i = TG_PACING_AUTO; i <= TG_PACING_WHEEL; i++)
+    {
+        if (!strcmp(name, pacing_engine_names[i]))
+        {
+            *engine = (enum pacing_engine)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* get the name of a pacing engine */
+const char *pacing_engine_name(enum pacing_engine engine)
+{
+    return pacing_engine_names[engine];
+}
+
+/* check whether the kernel accepts SO_MAX_PACING_RATE on TCP sockets */
+static bool probe_kernel_pacing()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bool result = false;
+
+    if (fd < 0)
+        return false;
+
+    result = set_pacing_rate(fd, 1000);
+    close(fd);
+    return result;
+}
+
+/* resolve TG_PACING_AUTO, open the rate log (NULL: no log) and return the engine to use */
+enum pacing_engine init_pacing(enum pacing_engine engine, bool event_driven, char *log_name, bool verbose)
+{
+    bool kernel_pacing = probe_kernel_pacing();
+    char qdisc[32] = {0};
+    FILE *fd = NULL;
+
+    if (engine == TG_PACING_KERNEL && !kernel_pacing)
+    {
+        printf("SO_MAX_PACING_RATE is not available, fall back to user-space pacing\n");
+        engine = TG_PACING_AUTO;
+    }
+    else if (engine == TG_PACING_WHEEL && !event_driven)
+    {
+        printf("The timer wheel needs event-driven workers, fall back to usleep() pacing\n");
+        engine = TG_PACING_SLEEP;
+    }
+
+    if (engine == TG_PACING_AUTO)
+    {
+        if (kernel_pacing)
+            engine = TG_PACING_KERNEL;
+        else if (event_driven)
+            engine = TG_PACING_WHEEL;
+        else
+            engine = TG_PACING_SLEEP;
+    }
+    pacing_engine = engine;
+
+    if (verbose)
+    {
+        /* without fq, TCP falls back to its internal (hrtimer-based) pacing */
+        fd = fopen("/proc/sys/net/core/default_qdisc", "r");
+        if (fd)
+        {
+            if (fgets(qdisc, sizeof(qdisc), fd))
+                remove_newline(qdisc);
+            fclose(fd);
+        }
+        printf("Pacing engine: %s (SO_MAX_PACING_RATE %s, default qdisc: %s)\n", pacing_engine_name(engine),
+               (kernel_pacing) ? "available" : "not available", (strlen(qdisc) > 0) ? qdisc : "unknown");
+    }
+
+    if (log_name && strlen(log_name) > 0)
+    {
+        rate_log = fopen(log_name, "w");
+        if (!rate_log)
+            perror("Error: open the rate log file in init_pacing()");
+    }
+
+    return engine;
+}
+
+/* get the pacing engine of this process */
+enum pacing_engine get_pacing_engine()
+{
+    return pacing_engine;
+}
+
+/* set SO_MAX_PACING_RATE of a socket (0: no rate limiting) and return true if it succeeds */
+bool set_pacing_rate(int fd, unsigned int rate_mbps)
+{
+    unsigned int rate = ~0U;    /* bytes per second, ~0U means unlimited */
+    unsigned long long rate64;
+    double bytes_per_sec = rate_mbps * 1000000.0 / 8 * TG_PACING_RATIO;
+
+    if (rate_mbps > 0 && bytes_per_sec < ~0U)
+        rate = (unsigned int)bytes_per_sec;
+    /* rates beyond 32 bits need a 64-bit option value (recent kernels) */
+    else if (rate_mbps > 0)
+    {
+        rate64 = (unsigned long long)bytes_per_sec;
+        if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate64, sizeof(rate64)) == 0)
+            return true;
+        rate = ~0U - 1;
+    }
+
+    return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0;
+}
+
+/* size of each write of a flow paced by the timer wheel */
+unsigned int get_pacing_write(unsigned int rate_mbps)
+{
+    unsigned long long bytes = (unsigned long long)rate_mbps * (TG_PACING_INTERVAL_NS / 1000) / 8;
+
+    return (unsigned int)max(min(bytes, TG_MIN_WRITE), TG_PACING_MIN_WRITE);
+}
+
+/* log requested and achieved rates of a rate-limited flow whose last byte was written 'duration_ns' after its first */
+void log_pacing_rate(int fd, struct flow_metadata *f, unsigned long long duration_ns)
+{
+    int outq = 0;   /* bytes in the send queue (not sent or not acknowledged) */
+    double achieved_mbps;
+
+    if (!f || f->rate == 0 || duration_ns == 0)
+        return;
+
+    /* only count the bytes that have left the send queue */
+    if (ioctl(fd, SIOCOUTQ, &outq) < 0 || outq < 0)
+        outq = 0;
+    achieved_mbps = (f->size - min((unsigned int)outq, f->size)) * 8000.0 / duration_ns;
+
+    pthread_mutex_lock(&rate_lock);
+    num_paced_flow++;
+    requested_total += f->rate;
+    achieved_total += achieved_mbps;
+    error_total += fabs(achieved_mbps - f->rate) / f->rate;
+    /* flow ID, size (bytes), requested rate (Mbps), achieved rate (Mbps), duration (us) */
+    if (rate_log)
+        fprintf(rate_log, "%u %u %u %.2f %llu\n", f->id, f->size, f->rate, achieved_mbps, duration_ns / 1000);
+    pthread_mutex_unlock(&rate_lock);
+}
+
+/* print statistics of requested and achieved rates */
+void print_pacing_stats()
+{
+    pthread_mutex_lock(&rate_lock);
+    printf("Pacing engine: %s  rate-limited flows: %llu\n", pacing_engine_name(pacing_engine), num_paced_flow);
+    if (num_paced_flow > 0)
+        printf("Average requested rate: %.2f Mbps  average achieved rate: %.2f Mbps  average rate error: %.2f%%\n",
+               requested_total / num_paced_flow, achieved_total / num_paced_flow, error_total * 100 / num_paced_flow);
+    if (rate_log)
+        fflush(rate_log);
+    pthread_mutex_unlock(&rate_lock);
+}
+
+/* initialize a timer wheel */
+void init_timer_wheel(struct timer_wheel *w, unsigned long long now_ns)
+{
+    if (!w)
+        return;
+
+    memset(w->slots, 0, sizeof(w->slots));
+    w->cur_tick = now_ns / TG_WHEEL_TICK_NS;
+    w->len = 0;
+}
+
+/* slot of an entry (entries that have already expired go to the current slot) */
+static unsigned int wheel_slot(struct timer_wheel *w, struct wheel_entry *e)
+{
+    return max(e->expire_ns / TG_WHEEL_TICK_NS, w->cur_tick) % TG_WHEEL_SLOTS;
+}
+
+/* insert an entry into a timer wheel */
+void timer_wheel_add(struct timer_wheel *w, struct wheel_entry *e)
+{
+    e->slot = wheel_slot(w, e);
+    e->prev = NULL;
+    e->next = w->slots[e->slot];
+    if (e->next)
+        e->next->prev = e;
+    w->slots[e->slot] = e;
+    w->len++;
+}
+
+/* remove an entry from a timer wheel (nothing to do if it has expired) */
+void timer_wheel_del(struct timer_wheel *w, struct wheel_entry *e)
+{
+    if (e->slot >= TG_WHEEL_SLOTS)
+        return;
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        w->slots[e->slot] = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+
+    e->prev = e->next = NULL;
+    e->slot = TG_WHEEL_SLOTS;
+    w->len--;
+}
+
+/* remove all the entries that have expired by 'now_ns' and return them as a list */
+struct wheel_entry *timer_wheel_expire(struct timer_wheel *w, unsigned long long now_ns)
+{
+    unsigned long long now_tick = now_ns / TG_WHEEL_TICK_NS;
+    unsigned long long steps, i;
+    struct wheel_entry *expired = NULL;
+    struct wheel_entry *e = NULL;
+    struct wheel_entry *next = NULL;
+    unsigned int slot;
+
+    if (now_tick < w->cur_tick)
+        return NULL;
+
+    /* one round visits every slot */
+    steps = min(now_tick - w->cur_tick + 1, TG_WHEEL_SLOTS);
+    for (i = 0; i < steps && w->len > 0; i++)
+    {
+        slot = (w->cur_tick + i) % TG_WHEEL_SLOTS;
+        for (e = w->slots[slot]; e; e = next)
+        {
+            next = e->next;
+            /* entries of later rounds stay in the slot */
+            if (e->expire_ns > now_ns)
+                continue;
+
+            if (e->prev)
+                e->prev->next = e->next;
+            else
+                w->slots[slot] = e->next;
+            if (e->next)
+                e->next->prev = e->prev;
+            w->len--;
+
+            e->slot = TG_WHEEL_SLOTS;
+            e->prev = NULL;
+            e->next = expired;
+            expired = e;
+        }
+    }
+
+    /* the current tick may still hold entries that expire later within it */
+    w->cur_tick = now_tick;
+    return expired;
+}
+
+/* get the earliest expiration time of a timer wheel (0 if empty) */
+unsigned long long timer_wheel_next(struct timer_wheel *w)
+{
+    unsigned long long tick, result = 0;
+    struct wheel_entry *e = NULL;
+    unsigned int i;
+
+    if (w->len == 0)
+        return 0;
+
+    /* the first slot holding an entry of the current round */
+    for (i = 0; i < TG_WHEEL_SLOTS; i++)
+    {
+        tick = w->cur_tick + i;
+        for (e = w->slots[tick % TG_WHEEL_SLOTS]; e; e = e->next)
+        {
+            if (e->expire_ns / TG_WHEEL_TICK_NS <= tick && (result == 0 || e->expire_ns < result))
+                result = e->expire_ns;
+        }
+        if (result > 0)
+            return result;
+    }
+
+    /* all the entries expire in later rounds */
+    for (i = 0; i < TG_WHEEL_SLOTS; i++)
+    {
+        for (e = w->slots[i]; e; e = e->next)
+        {
+            if (result == 0 || e->expire_ns < result)
+                result = e->expire_ns;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,85 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* ways to enforce the sending rate of rate-limited flows */
+enum pacing_engine
+{
+    TG_PACING_AUTO, /* kernel if available, otherwise wheel (event-driven) or sleep */
+    TG_PACING_SLEEP,    /* usleep() after TG_MIN_WRITE writes (write_exact()) */
+    TG_PACING_KERNEL,   /* SO_MAX_PACING_RATE (fq or TCP internal pacing) */
+    TG_PACING_WHEEL /* user-space timer wheel with small writes (event-driven server only) */
+};
+
+/* IP bytes per TCP payload byte of a full-sized segment (pacing rates count IP bytes) */
+#define TG_PACING_RATIO (1500.0 / 1448)
+/* target interval between two writes of a flow paced by the timer wheel (ns) */
+#define TG_PACING_INTERVAL_NS 100000
+/* minimum write size of a flow paced by the timer wheel (one full-sized segment) */
+#define TG_PACING_MIN_WRITE 1448
+/* granularity of the timer wheel (ns) */
+#define TG_WHEEL_TICK_NS 10000
+/* number of slots of the timer wheel (covers TG_WHEEL_SLOTS * TG_WHEEL_TICK_NS per round) */
+#define TG_WHEEL_SLOTS 1024
+
+/* an entry of the timer wheel, embedded in the state it wakes up */
+struct wheel_entry
+{
+    unsigned long long expire_ns;   /* expiration time */
+    unsigned int slot;  /* slot holding the entry (TG_WHEEL_SLOTS if not in the wheel) */
+    struct wheel_entry *prev;   /* previous entry in the slot */
+    struct wheel_entry *next;   /* next entry in the slot (or in the list of expired entries) */
+};
+
+/* hashed timer wheel */
+struct timer_wheel
+{
+    struct wheel_entry *slots[TG_WHEEL_SLOTS];
+    unsigned long long cur_tick;    /* first tick that has not expired yet */
+    unsigned int len;   /* total number of entries */
+};
+
+/* parse the name of a pacing engine and return true if it succeeds */
+bool parse_pacing_engine(char *name, enum pacing_engine *engine);
+
+/* get the name of a pacing engine */
+const char *pacing_engine_name(enum pacing_engine engine);
+
+/* resolve TG_PACING_AUTO, open the rate log (NULL: no log) and return the engine to use */
+enum pacing_engine init_pacing(enum pacing_engine engine, bool event_driven, char *log_name, bool verbose);
+
+/* get the pacing engine of this process */
+enum pacing_engine get_pacing_engine();
+
+/* set SO_MAX_PACING_RATE of a socket (0: no rate limiting) and return true if it succeeds */
+bool set_pacing_rate(int fd, unsigned int rate_mbps);
+
+/* size of each write of a flow paced by the timer wheel */
+unsigned int get_pacing_write(unsigned int rate_mbps);
+
+/* log requested and achieved rates of a rate-limited flow whose last byte was written 'duration_ns' after its first */
+void log_pacing_rate(int fd, struct flow_metadata *f, unsigned long long duration_ns);
+
+/* print statistics of requested and achieved rates */
+void print_pacing_stats();
+
+/* initialize a timer wheel */
+void init_timer_wheel(struct timer_wheel *w, unsigned long long now_ns);
+
+/* insert an entry into a timer wheel */
+void timer_wheel_add(struct timer_wheel *w, struct wheel_entry *e);
+
+/* remove an entry from a timer wheel (nothing to do if it has expired) */
+void timer_wheel_del(struct timer_wheel *w, struct wheel_entry *e);
+
+/* remove all the entries that have expired by 'now_ns' and return them as a list */
+struct wheel_entry *timer_wheel_expire(struct timer_wheel *w, unsigned long long now_ns);
+
+/* get the earliest expiration time of a timer wheel (0 if empty) */
+unsigned long long timer_wheel_next(struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "common.h"
+#include "payload.h"
+
+static enum payload_mode payload_mode = TG_PAYLOAD_COPY;    /* payload mode of this process */
+static char payload_buf[TG_MAX_WRITE] = {0};    /* payload for TG_PAYLOAD_COPY and TG_PAYLOAD_ZEROCOPY */
+static int payload_fd = -1; /* memfd holding the payload for TG_PAYLOAD_SENDFILE and TG_PAYLOAD_SPLICE */
+
+static atomic_ullong payload_bytes;    /* total payload bytes written */
+static atomic_ullong zerocopy_completed;   /* MSG_ZEROCOPY sends completed */
+static atomic_ullong zerocopy_copied;  /* MSG_ZEROCOPY sends the kernel had to copy anyway */
+
+static const char *payload_mode_names[] = {"copy", "sendfile", "splice", "zerocopy"};
+
+/* parse the name of a payload mode and return true if it succeeds */
+bool parse_payload_mode(char *name, enum payload_mode *mode)
+{
+    int i = 0;
+
+    for (i = TG_PAYLOAD_COPY; i <= TG_PAYLOAD_ZEROCOPY; i++)
+    {
+        if (!strcmp(name, payload_mode_names[i]))
+        {
+            *mode = (enum payload_mode)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* get the name of a payload mode */
+const char *payload_mode_name(enum payload_mode mode)
+{
+    return payload_mode_names[mode];
+}
+
+/* select the payload mode of this process and prepare the payload */
+bool init_payload(enum payload_mode mode)
+{
+    payload_mode = mode;
+    atomic_init(&payload_bytes, 0);
+    atomic_init(&zerocopy_completed, 0);
+    atomic_init(&zerocopy_copied, 0);
+
+    if (mode != TG_PAYLOAD_SENDFILE && mode != TG_PAYLOAD_SPLICE)
+        return true;
+
+    /* the memfd is all zeros and is never modified, so all sockets can share it */
+    payload_fd = memfd_create("tg_payload", MFD_CLOEXEC);
+    if (payload_fd < 0)
+    {
+        perror("Error: memfd_create() in init_payload()");
+        return false;
+    }
+
+    if (ftruncate(payload_fd, TG_MAX_WRITE) < 0 || write(payload_fd, payload_buf, TG_MAX_WRITE) != TG_MAX_WRITE)
+    {
+        perror("Error: fill in memfd in init_payload()");
+        close(payload_fd);
+        payload_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/* initialize the per-socket state of the payload path */
+void init_payload_ctx(struct payload_ctx *ctx)
+{
+    if (!ctx)
+        return;
+
+    ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+    ctx->pipe_len = 0;
+    ctx->zerocopy = false;
+    ctx->zerocopy_tried = false;
+    ctx->zerocopy_pending = 0;
+    ctx->kernel_paced = false;
+}
+
+/* release the per-socket state of the payload path */
+void free_payload_ctx(struct payload_ctx *ctx)
+{
+    if (!ctx || ctx->pipe_fds[0] < 0)
+        return;
+
+    close(ctx->pipe_fds[0]);
+    close(ctx->pipe_fds[1]);
+    ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+    ctx->pipe_len = 0;
+}
+
+/* move payload from the memfd into the socket through the per-socket pipe */
+static int splice_payload(int fd, struct payload_ctx *ctx, size_t count)
+{
+    loff_t off = 0;
+    int n;
+
+    if (ctx->pipe_fds[0] < 0)
+    {
+        if (pipe2(ctx->pipe_fds, O_CLOEXEC) < 0)
+        {
+            ctx->pipe_fds[0] = ctx->pipe_fds[1] = -1;
+            return -1;
+        }
+        /* best effort: the default pipe capacity (64KB) only limits the size of each splice() */
+        fcntl(ctx->pipe_fds[1], F_SETPIPE_SZ, TG_MAX_WRITE);
+    }
+
+    /* data left in the pipe by a partial write is part of this socket's payload */
+    if (ctx->pipe_len == 0)
+    {
+        n = splice(payload_fd, &off, ctx->pipe_fds[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0)
+            return n;
+        ctx->pipe_len = n;
+    }
+
+    n = splice(ctx->pipe_fds[0], NULL, fd, NULL, min(ctx->pipe_len, count), SPLICE_F_MOVE);
+    if (n > 0)
+        ctx->pipe_len -= n;
+
+    return n;
+}
+
+/* send payload with MSG_ZEROCOPY, falling back to a copy when the kernel refuses */
+static int zerocopy_payload(int fd, struct payload_ctx *ctx, size_t count)
+{
+    int sock_opt = 1;
+    int n;
+
+    if (!ctx->zerocopy_tried)
+    {
+        ctx->zerocopy_tried = true;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &sock_opt, sizeof(sock_opt)) < 0)
+            perror("Error: set SO_ZEROCOPY option in zerocopy_payload()");
+        else
+            ctx->zerocopy = true;
+    }
+
+    if (!ctx->zerocopy || count < TG_ZEROCOPY_MIN_WRITE)
+        return write(fd, payload_buf, count);
+
+    /* payload_buf is never modified, so completions are only reaped to release kernel resources */
+    if (ctx->zerocopy_pending >= TG_ZEROCOPY_MAX_PENDING)
+        reap_payload_completions(fd, ctx);
+
+    n = send(fd, payload_buf, count, MSG_ZEROCOPY);
+    /* out of optmem for notifications */
+    if (n < 0 && errno == ENOBUFS)
+        return write(fd, payload_buf, count);
+    if (n > 0)
+        ctx->zerocopy_pending++;
+
+    return n;
+}
+
+/* write at most 'count' payload bytes into a socket 'fd' (same return value as write()) */
+int write_payload(int fd, struct payload_ctx *ctx, size_t count)
+{
+    off_t off = 0;
+    int n;
+
+    count = min(count, TG_MAX_WRITE);
+
+    if (payload_mode == TG_PAYLOAD_SENDFILE)
+        n = sendfile(fd, payload_fd, &off, count);
+    else if (payload_mode == TG_PAYLOAD_SPLICE && ctx)
+        n = splice_payload(fd, ctx, count);
+    else if (payload_mode == TG_PAYLOAD_ZEROCOPY && ctx)
+        n = zerocopy_payload(fd, ctx, count);
+    else
+        n = write(fd, payload_buf, count);
+
+    if (n > 0)
+        atomic_fetch_add_explicit(&payload_bytes, n, memory_order_relaxed);
+
+    return n;
+}
+
+/* reap MSG_ZEROCOPY completions and return false if the socket has a pending error */
+bool reap_payload_completions(int fd, struct payload_ctx *ctx)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm = NULL;
+    struct sock_extended_err *serr = NULL;
+    unsigned int num;
+    int sock_err = 0;
+    socklen_t len = sizeof(sock_err);
+
+    while (ctx && ctx->zerocopy)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* a notification covers the range of sends [ee_info, ee_data] */
+            num = serr->ee_data - serr->ee_info + 1;
+            ctx->zerocopy_pending -= min(num, ctx->zerocopy_pending);
+            atomic_fetch_add_explicit(&zerocopy_completed, num, memory_order_relaxed);
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                atomic_fetch_add_explicit(&zerocopy_copied, num, memory_order_relaxed);
+        }
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sock_err, &len) < 0 || sock_err != 0)
+        return false;
+
+    return true;
+}
+
+/* print payload bytes and CPU time per gigabyte of this process */
+void print_payload_stats()
+{
+    struct rusage usage;
+    double cpu_s, gbytes;
+    unsigned long long bytes = atomic_load_explicit(&payload_bytes, memory_order_relaxed);
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+    {
+        perror("Error: getrusage() in print_payload_stats()");
+        return;
+    }
+
+    cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+    gbytes = bytes / 1000000000.0;
+
+    printf("Payload mode: %s  payload: %.3f GB  CPU time: %.3f s (user %.3f s, sys %.3f s)\n",
+           payload_mode_name(payload_mode), gbytes, cpu_s,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+    if (gbytes > 0)
+        printf("CPU time per GB: %.4f s\n", cpu_s / gbytes);
+
+    if (payload_mode == TG_PAYLOAD_ZEROCOPY)
+        printf("MSG_ZEROCOPY sends completed: %llu  copied by the kernel: %llu\n",
+               atomic_load_explicit(&zerocopy_completed, memory_order_relaxed),
+               atomic_load_explicit(&zerocopy_copied, memory_order_relaxed));
+}
@@ -0,0 +1,56 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* ways to write the (static) payload of flows into sockets */
+enum payload_mode
+{
+    TG_PAYLOAD_COPY,    /* write() from a user-space buffer */
+    TG_PAYLOAD_SENDFILE,    /* sendfile() from a memfd */
+    TG_PAYLOAD_SPLICE,  /* splice() from a memfd through a pipe */
+    TG_PAYLOAD_ZEROCOPY /* send() with MSG_ZEROCOPY */
+};
+
+/* minimum write size to use MSG_ZEROCOPY (page pinning does not pay off for small writes) */
+#define TG_ZEROCOPY_MIN_WRITE (1 << 14)
+/* maximum number of uncompleted MSG_ZEROCOPY sends before reaping completions */
+#define TG_ZEROCOPY_MAX_PENDING 32
+
+/* per-socket state of the payload path */
+struct payload_ctx
+{
+    int pipe_fds[2];    /* pipe used by TG_PAYLOAD_SPLICE (-1 if not created yet) */
+    unsigned int pipe_len;  /* payload bytes left in the pipe */
+    bool zerocopy;  /* whether SO_ZEROCOPY is enabled on the socket */
+    bool zerocopy_tried;    /* whether we have tried to enable SO_ZEROCOPY */
+    unsigned int zerocopy_pending;  /* MSG_ZEROCOPY sends without completion notification */
+    bool kernel_paced;  /* whether SO_MAX_PACING_RATE limits the socket */
+};
+
+/* parse the name of a payload mode and return true if it succeeds */
+bool parse_payload_mode(char *name, enum payload_mode *mode);
+
+/* get the name of a payload mode */
+const char *payload_mode_name(enum payload_mode mode);
+
+/* select the payload mode of this process and prepare the payload */
+bool init_payload(enum payload_mode mode);
+
+/* initialize the per-socket state of the payload path */
+void init_payload_ctx(struct payload_ctx *ctx);
+
+/* release the per-socket state of the payload path */
+void free_payload_ctx(struct payload_ctx *ctx);
+
+/* write at most 'count' payload bytes into a socket 'fd' (same return value as write()) */
+int write_payload(int fd, struct payload_ctx *ctx, size_t count);
+
+/* reap MSG_ZEROCOPY completions and return false if the socket has a pending error */
+bool reap_payload_completions(int fd, struct payload_ctx *ctx);
+
+/* print payload bytes and CPU time per gigabyte of this process */
+void print_payload_stats();
+
+#endif
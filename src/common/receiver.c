@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "receiver.h"
+
+/* an epoll event loop receiving flows from many connections */
+struct receiver
+{
+    int epoll_fd;   /* epoll instance */
+    int stop_fd;    /* eventfd to stop the receiver thread */
+    char *read_buf; /* read buffer shared by all connections of the receiver */
+    pthread_t thread;   /* receiver thread */
+};
+
+static struct receiver *receivers = NULL;   /* receiver threads */
+static unsigned int num_receivers = 0;  /* number of receiver threads */
+static flow_done_handler on_flow_done = NULL;   /* called on every completed flow */
+static conn_ready_handler on_conn_ready = NULL; /* called on every background connect() */
+static conn_closed_handler on_conn_closed = NULL;   /* called on every established connection that is closed */
+static atomic_uint next_receiver;   /* receiver of the next connection (round-robin) */
+static unsigned int num_live_conn = 0;  /* connections that are not closed yet */
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;   /* protect num_live_conn */
+static pthread_cond_t live_cond = PTHREAD_COND_INITIALIZER; /* signaled when all connections are closed */
+
+/* main loop of a receiver */
+static void *run_receiver(void *ptr);
+/* add a connection to a receiver, waiting for 'events' */
+static bool add_conn(struct conn_node *node, unsigned int events);
+/* finish the background connect() of a connection */
+static void connect_conn(struct receiver *r, struct conn_node *node);
+/* read from a connection and complete the flows it carries */
+static void recv_conn(struct receiver *r, struct conn_node *node);
+/* complete the flows of 'n' bytes in the read buffer, answered one after another */
+static void recv_flows(struct receiver *r, struct conn_node *node, unsigned int n);
+/* complete the flows of 'n' bytes in the read buffer, as frames that interleave flows */
+static void recv_frames(struct receiver *r, struct conn_node *node, unsigned int n);
+/* close an established connection, stop receiving from it and tell the client */
+static void close_conn(struct receiver *r, struct conn_node *node);
+/* close a connection and stop receiving from it */
+static void release_conn(struct receiver *r, struct conn_node *node);
+
+/* start 'num' receiver threads that call 'handler' on every completed flow, 'ready' on every background connect()
+   and 'closed' (may be NULL) on every established connection that is closed */
+bool init_receivers(unsigned int num, flow_done_handler handler, conn_ready_handler ready, conn_closed_handler closed)
+{
+    struct epoll_event ev;
+    struct receiver *r = NULL;
+    unsigned int i = 0;
+
+    if (num == 0 || !handler)
+        return false;
+
+    receivers = (struct receiver*)calloc(num, sizeof(struct receiver));
+    if (!receivers)
+    {
+        perror("Error: calloc receivers in init_receivers()");
+        return false;
+    }
+
+    num_receivers = num;
+    on_flow_done = handler;
+    on_conn_ready = ready;
+    on_conn_closed = closed;
+    atomic_init(&next_receiver, 0);
+
+    for (i = 0; i < num; i++)
+    {
+        r = &receivers[i];
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        r->read_buf = (char*)malloc(TG_MAX_READ);
+        if (r->epoll_fd < 0 || r->stop_fd < 0 || !r->read_buf)
+        {
+            perror("Error: create receiver in init_receivers()");
+            return false;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &(r->stop_fd);
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->stop_fd, &ev) < 0)
+        {
+            perror("Error: epoll_ctl() in init_receivers()");
+            return false;
+        }
+
+        if (pthread_create(&(r->thread), NULL, run_receiver, (void*)r) != 0)
+        {
+            perror("Error: pthread_create() in init_receivers()");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* let a receiver thread receive flows from an established connection */
+bool receiver_add_conn(struct conn_node *node)
+{
+    return add_conn(node, EPOLLIN);
+}
+
+/* let a receiver thread finish the background connect() of a connection and then receive flows from it */
+bool receiver_add_pending_conn(struct conn_node *node)
+{
+    return add_conn(node, EPOLLOUT);
+}
+
+/* add a connection to a receiver, waiting for 'events' */
+static bool add_conn(struct conn_node *node, unsigned int events)
+{
+    struct epoll_event ev;
+    struct receiver *r = NULL;
+
+    if (!node || !receivers)
+        return false;
+
+    node->meta_len = 0;
+    node->bytes_left = 0;
+    node->frame_len = 0;
+
+    pthread_mutex_lock(&live_lock);
+    num_live_conn++;
+    pthread_mutex_unlock(&live_lock);
+
+    r = &receivers[atomic_fetch_add(&next_receiver, 1) % num_receivers];
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = node;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, node->sockfd, &ev) < 0)
+    {
+        perror("Error: epoll_ctl() in add_conn()");
+        pthread_mutex_lock(&live_lock);
+        num_live_conn--;
+        pthread_mutex_unlock(&live_lock);
+        return false;
+    }
+
+    return true;
+}
+
+/* wait for all connections to be closed and stop receiver threads */
+void wait_receivers()
+{
+    unsigned long long val = 1;
+    unsigned int i = 0;
+
+    if (!receivers)
+        return;
+
+    pthread_mutex_lock(&live_lock);
+    while (num_live_conn > 0)
+        pthread_cond_wait(&live_cond, &live_lock);
+    pthread_mutex_unlock(&live_lock);
+
+    for (i = 0; i < num_receivers; i++)
+    {
+        if (write(receivers[i].stop_fd, &val, sizeof(val)) < 0)
+            perror("Error: write stop_fd in wait_receivers()");
+        pthread_join(receivers[i].thread, NULL);
+        close(receivers[i].stop_fd);
+        close(receivers[i].epoll_fd);
+        free(receivers[i].read_buf);
+    }
+
+    free(receivers);
+    receivers = NULL;
+    num_receivers = 0;
+}
+
+/* main loop of a receiver */
+static void *run_receiver(void *ptr)
+{
+    struct receiver *r = (struct receiver*)ptr;
+    struct epoll_event events[TG_RECEIVER_MAX_EVENTS];
+    int i, n;
+
+    while (true)
+    {
+        n = epoll_wait(r->epoll_fd, events, TG_RECEIVER_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error: epoll_wait() in run_receiver()");
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &(r->stop_fd))
+                return (void*)0;
+            else if (!atomic_load(&(((struct conn_node*)events[i].data.ptr)->connected)))
+                connect_conn(r, (struct conn_node*)events[i].data.ptr);
+            else
+                recv_conn(r, (struct conn_node*)events[i].data.ptr);
+        }
+    }
+
+    return (void*)0;
+}
+
+/* finish the background connect() of a connection */
+static void connect_conn(struct receiver *r, struct conn_node *node)
+{
+    struct epoll_event ev;
+    bool connected = finish_conn_node(node);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = node;
+    if (connected && epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, node->sockfd, &ev) < 0)
+    {
+        perror("Error: epoll_ctl() in connect_conn()");
+        connected = false;
+    }
+
+    if (!connected)
+        release_conn(r, node);
+
+    if (on_conn_ready)
+        on_conn_ready(node, connected);
+
+    /* nobody else refers to a connection that never carried a request */
+    if (!connected)
+        recycle_conn_node(node);
+}
+
+/* read from a connection and complete the flows it carries */
+static void recv_conn(struct receiver *r, struct conn_node *node)
+{
+    int n;
+
+    /* one read per event keeps connections fair, epoll reports the rest again */
+    n = recv(node->sockfd, r->read_buf, TG_MAX_READ, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    else if (n < 0)
+    {
+        perror("Error: receive flow");
+        close_conn(r, node);
+        return;
+    }
+    else if (n == 0)
+    {
+        printf("Error: connection to %s:%hu is closed by the server\n", node->list->ip, node->list->port);
+        close_conn(r, node);
+        return;
+    }
+
+    if (node->list->mux)
+        recv_frames(r, node, n);
+    else
+        recv_flows(r, node, n);
+}
+
+/* complete the flows of 'n' bytes in the read buffer, answered one after another */
+static void recv_flows(struct receiver *r, struct conn_node *node, unsigned int n)
+{
+    bool pipelined = node->list->depth > 1;
+    unsigned int off, len;
+
+    for (off = 0; off < n; off += len)
+    {
+        /* metadata echoed back by the server */
+        if (node->meta_len < TG_METADATA_SIZE)
+        {
+            len = min(n - off, TG_METADATA_SIZE - node->meta_len);
+            memcpy(node->meta_buf + node->meta_len, r->read_buf + off, len);
+            node->meta_len += len;
+            if (node->meta_len < TG_METADATA_SIZE)
+                continue;
+
+            /* the server has turned the request around, the rest is transfer time */
+            node->header_ns = get_mono_ns();
+            decode_flow_metadata(node->meta_buf, &(node->flow));
+            node->bytes_left = node->flow.size;
+
+            /* the server answers pipelined requests in order, the echoed ID tells which one this is */
+            if (pipelined && node->flow.id != 0)
+            {
+                node->cur_req = find_conn_req(node, node->flow.id);
+                if (!node->cur_req)
+                {
+                    printf("Error: unknown flow %u on connection to %s:%hu\n", node->flow.id, node->list->ip, node->list->port);
+                    close_conn(r, node);
+                    return;
+                }
+                node->cur_req->header_ns = node->header_ns;
+            }
+        }
+        /* payload, which we just discard */
+        else
+        {
+            len = min(n - off, node->bytes_left);
+            node->bytes_left -= len;
+        }
+
+        if (node->bytes_left > 0)
+            continue;
+
+        node->meta_len = 0;
+        /* a special flow ID to terminate persistent connection */
+        if (node->flow.id == 0)
+        {
+            close_conn(r, node);
+            return;
+        }
+        if (pipelined)
+            free_conn_req(node, node->cur_req);
+        on_flow_done(node, &(node->flow));
+    }
+}
+
+/* complete the flows of 'n' bytes in the read buffer, as frames that interleave flows */
+static void recv_frames(struct receiver *r, struct conn_node *node, unsigned int n)
+{
+    struct frame_header h;
+    struct conn_req *req = NULL;
+    unsigned int off, len;
+
+    for (off = 0; off < n; off += len)
+    {
+        /* header of the next frame */
+        if (node->frame_len < TG_FRAME_HEADER_SIZE)
+        {
+            len = min(n - off, TG_FRAME_HEADER_SIZE - node->frame_len);
+            memcpy(node->frame_buf + node->frame_len, r->read_buf + off, len);
+            node->frame_len += len;
+            if (node->frame_len < TG_FRAME_HEADER_SIZE)
+                continue;
+
+            decode_frame_header(node->frame_buf, &h);
+            node->cur_req = find_conn_req(node, h.id);
+            /* a special flow ID to terminate persistent connection (in a single frame) */
+            if ((!node->cur_req && h.id != 0) || h.len == 0)
+            {
+                printf("Error: invalid frame of flow %u on connection to %s:%hu\n", h.id, node->list->ip, node->list->port);
+                close_conn(r, node);
+                return;
+            }
+            node->frame_left = h.len;
+            continue;
+        }
+
+        req = node->cur_req;
+        len = min(n - off, node->frame_left);
+        if (!req)
+        {
+            node->frame_left -= len;
+            if (node->frame_left == 0)
+            {
+                close_conn(r, node);
+                return;
+            }
+            continue;
+        }
+
+        /* metadata echoed back by the server */
+        if (req->meta_len < TG_METADATA_SIZE)
+        {
+            len = min(len, TG_METADATA_SIZE - req->meta_len);
+            memcpy(req->meta_buf + req->meta_len, r->read_buf + off, len);
+            req->meta_len += len;
+            if (req->meta_len == TG_METADATA_SIZE)
+            {
+                req->header_ns = get_mono_ns();
+                decode_flow_metadata(req->meta_buf, &(node->flow));
+                req->bytes_left = node->flow.size;
+            }
+        }
+        /* payload, which we just discard */
+        else
+        {
+            len = min(len, req->bytes_left);
+            req->bytes_left -= len;
+        }
+
+        node->frame_left -= len;
+        if (node->frame_left == 0)
+            node->frame_len = 0;
+        if (req->meta_len < TG_METADATA_SIZE || req->bytes_left > 0)
+            continue;
+
+        /* a frame never spans two flows */
+        if (node->frame_left > 0)
+        {
+            printf("Error: frame longer than flow %u on connection to %s:%hu\n", node->flow.id, node->list->ip, node->list->port);
+            close_conn(r, node);
+            return;
+        }
+
+        decode_flow_metadata(req->meta_buf, &(node->flow));
+        node->flow.tos &= ~TG_FLOW_MUX;
+        free_conn_req(node, req);
+        on_flow_done(node, &(node->flow));
+    }
+}
+
+/* close an established connection, stop receiving from it and tell the client */
+static void close_conn(struct receiver *r, struct conn_node *node)
+{
+    release_conn(r, node);
+    if (on_conn_closed)
+        on_conn_closed(node);
+}
+
+/* close a connection and stop receiving from it */
+static void release_conn(struct receiver *r, struct conn_node *node)
+{
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, node->sockfd, NULL);
+    close_conn_node(node);
+
+    pthread_mutex_lock(&live_lock);
+    if (--num_live_conn == 0)
+        pthread_cond_broadcast(&live_cond);
+    pthread_mutex_unlock(&live_lock);
+}
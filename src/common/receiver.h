@@ -0,0 +1,37 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "conn.h"
+
+/* default number of receiver threads */
+#define TG_DEFAULT_RECEIVERS 1
+/* maximum number of events returned by one epoll_wait() call */
+#define TG_RECEIVER_MAX_EVENTS 64
+
+/* called by a receiver thread when a flow (except the special flow ID 0) completes on a connection */
+typedef void (*flow_done_handler)(struct conn_node *node, struct flow_metadata *flow);
+
+/* called by a receiver thread when a background connect() completes ('connected': whether it succeeds) */
+typedef void (*conn_ready_handler)(struct conn_node *node, bool connected);
+
+/* called by a receiver thread when an established connection is closed */
+typedef void (*conn_closed_handler)(struct conn_node *node);
+
+/* start 'num' receiver threads that call 'handler' on every completed flow, 'ready' on every background connect()
+   and 'closed' (may be NULL) on every established connection that is closed */
+bool init_receivers(unsigned int num, flow_done_handler handler, conn_ready_handler ready, conn_closed_handler closed);
+
+/* let a receiver thread receive flows from an established connection */
+bool receiver_add_conn(struct conn_node *node);
+
+/* let a receiver thread finish the background connect() of a connection and then receive flows from it */
+bool receiver_add_pending_conn(struct conn_node *node);
+
+/* wait for all connections to be closed and stop receiver threads */
+void wait_receivers();
+
+#endif
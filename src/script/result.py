@@ -1,9 +1,41 @@
 import sys
 import os
+import struct
+
+''' Binary logs (src/common/log_format.h): header, then fixed-width records in native byte order '''
+log_magic = b'TGLOG\0\0\0'
+log_header = struct.Struct('=8sIIIIQ')
+''' Leading fields of the records, later versions only append fields '''
+log_record = struct.Struct('=QIIIIII')
+
+''' Parse a binary log to get FCT and goodput results '''
+def parse_binary_file(file_name):
+    results = []
+    f = open(file_name, 'rb')
+    header = log_header.unpack(f.read(log_header.size))
+    header_size, record_size = header[2], header[3]
+    f.seek(header_size)
+    while True:
+        data = f.read(record_size * 65536)
+        for off in range(0, len(data) - record_size + 1, record_size):
+            '''fct, size, dscp, rate, goodput, fanout'''
+            rec = log_record.unpack_from(data, off)
+            '''[size, fct, goodput]'''
+            results.append([rec[1], rec[0], rec[4]])
+        if len(data) < record_size * 65536:
+            break
+    f.close()
+    return results
 
 ''' Parse a file to get FCT and goodput results '''
 def parse_file(file_name):
     results = []
+    f = open(file_name, 'rb')
+    is_binary = (f.read(len(log_magic)) == log_magic)
+    f.close()
+    if is_binary:
+        return parse_binary_file(file_name)
+
     f = open(file_name)
     while True:
         line = f.readline().rstrip()
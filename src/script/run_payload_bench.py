@@ -0,0 +1,56 @@
+import os
+import re
+import sys
+import time
+import signal
+import argparse
+import subprocess
+
+''' Compare server CPU time per GB of payload across payload modes (-z) '''
+
+modes = ['copy', 'sendfile', 'splice', 'zerocopy']
+
+''' Run the server with a payload mode, fetch flows with simple-client and return (GB, CPU s/GB, zerocopy line) '''
+def run_mode(bin_dir, mode, port, flow_size, flow_num, workers):
+    server_cmd = [os.path.join(bin_dir, 'server'), '-p', str(port), '-z', mode]
+    if workers > 0:
+        server_cmd.extend(['-w', str(workers)])
+    client_cmd = [os.path.join(bin_dir, 'simple-client'), '-s', '127.0.0.1', '-p', str(port),
+                  '-n', str(flow_size), '-c', str(flow_num)]
+
+    server = subprocess.Popen(server_cmd, stdout = subprocess.PIPE, universal_newlines = True)
+    time.sleep(0.5)
+    devnull = open(os.devnull, 'w')
+    subprocess.call(client_cmd, stdout = devnull)
+    devnull.close()
+    server.send_signal(signal.SIGTERM)
+    output = server.communicate()[0]
+
+    gbytes = re.search(r'payload: ([0-9.]+) GB', output)
+    cpu_per_gb = re.search(r'CPU time per GB: ([0-9.]+) s', output)
+    zerocopy = re.search(r'MSG_ZEROCOPY sends completed: (\d+)  copied by the kernel: (\d+)', output)
+    if not gbytes or not cpu_per_gb:
+        return None
+    return (float(gbytes.group(1)), float(cpu_per_gb.group(1)), zerocopy)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description = 'Compare server CPU time per GB across payload modes over loopback')
+    parser.add_argument('-b', dest = 'bin_dir', default = os.path.dirname(os.path.abspath(__file__)), help = 'directory of server and simple-client')
+    parser.add_argument('-p', dest = 'port', type = int, default = 5101, help = 'server port (default 5101)')
+    parser.add_argument('-n', dest = 'flow_size', type = int, default = 1000000000, help = 'flow size in bytes (default 1GB)')
+    parser.add_argument('-c', dest = 'flow_num', type = int, default = 10, help = 'number of flows per mode (default 10)')
+    parser.add_argument('-w', dest = 'workers', type = int, default = 0, help = 'event-driven worker threads of the server (default 0)')
+    parser.add_argument('-m', dest = 'modes', default = ','.join(modes), help = 'comma-separated payload modes (default all)')
+    args = parser.parse_args()
+
+    print('%-10s %12s %16s' % ('mode', 'payload (GB)', 'CPU s per GB'))
+    for mode in args.modes.split(','):
+        result = run_mode(args.bin_dir, mode, args.port, args.flow_size, args.flow_num, args.workers)
+        if not result:
+            print('%-10s %12s %16s' % (mode, 'failed', '-'))
+            continue
+        print('%-10s %12.3f %16.4f' % (mode, result[0], result[1]))
+        if result[2] and int(result[2].group(2)) > 0:
+            print('%-10s %d of %d MSG_ZEROCOPY sends were copied by the kernel (e.g. loopback)' % ('', int(result[2].group(2)), int(result[2].group(1))))
+    sys.stdout.flush()
@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "reactor.h"
+#include "../common/clock.h"
+
+/* main loop of a reactor */
+static void *run_reactor(void *ptr);
+/* accept all pending connections on the listening socket */
+static void accept_conns(struct reactor *r);
+/* handle an event on a connection */
+static void handle_conn_event(struct reactor *r, struct serv_conn *c, unsigned int events);
+/* read the flow request and return false if the connection should be closed */
+static bool read_conn(struct reactor *r, struct serv_conn *c);
+/* write the flow response and return false if the connection should be closed */
+static bool write_conn(struct reactor *r, struct serv_conn *c);
+/* serve a request as interleaved frames and return false if the connection should be closed */
+static bool add_mux_flow(struct reactor *r, struct serv_conn *c);
+/* write frames of the flows of a multiplexed connection and return false if the connection should be closed */
+static bool write_mux_conn(struct reactor *r, struct serv_conn *c);
+/* epoll events of a multiplexed connection: new requests while it has room, writes while it has flows */
+static unsigned int get_mux_events(struct serv_conn *c);
+/* switch a connection to a new state */
+static bool set_conn_state(struct reactor *r, struct serv_conn *c, enum serv_conn_state state);
+/* update the epoll events of a connection */
+static bool set_conn_events(struct reactor *r, struct serv_conn *c, unsigned int events);
+/* wake up paced connections whose next write time has come */
+static void expire_paced_conns(struct reactor *r);
+/* arm the timer of a reactor if 'expire_ns' is earlier than its current expiration time */
+static void arm_reactor_timer(struct reactor *r, unsigned long long expire_ns);
+/* close a connection, its state is released by release_closed_conns() */
+static void close_conn(struct reactor *r, struct serv_conn *c);
+/* release the state of the connections closed during a batch of events */
+static void release_closed_conns(struct reactor *r);
+
+/* initialize a reactor */
+bool init_reactor(struct reactor *r, int id, bool verbose)
+{
+    struct epoll_event ev;
+
+    if (!r)
+        return false;
+
+    r->id = id;
+    r->verbose = verbose;
+    r->timer_ns = 0;
+    init_timer_wheel(&(r->wheel), get_mono_ns());
+    r->closed = NULL;
+    r->listen_fd = -1;
+    r->cpu = -1;
+    r->route_conn = NULL;
+    atomic_init(&(r->num_accept), 0);
+    atomic_init(&(r->num_route), 0);
+    atomic_init(&(r->num_conn), 0);
+    atomic_init(&(r->num_flow), 0);
+
+    r->epoll_fd = epoll_create1(0);
+    if (r->epoll_fd < 0)
+    {
+        perror("Error: epoll_create1() in init_reactor()");
+        return false;
+    }
+
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (r->timer_fd < 0)
+    {
+        perror("Error: timerfd_create() in init_reactor()");
+        close(r->epoll_fd);
+        return false;
+    }
+
+    /* event sources without connection state point into the reactor itself */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &(r->timer_fd);
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->timer_fd, &ev) < 0)
+    {
+        perror("Error: add timer_fd in init_reactor()");
+        close(r->timer_fd);
+        close(r->epoll_fd);
+        return false;
+    }
+
+    return true;
+}
+
+/* start the worker thread of a reactor */
+bool start_reactor(struct reactor *r)
+{
+    if (!r)
+        return false;
+
+    if (pthread_create(&(r->thread), NULL, run_reactor, (void*)r) != 0)
+    {
+        perror("Error: pthread_create() in start_reactor()");
+        return false;
+    }
+
+    return true;
+}
+
+/* hand an accepted connection over to a reactor */
+bool reactor_add_conn(struct reactor *r, int sockfd)
+{
+    struct serv_conn *c = NULL;
+    struct epoll_event ev;
+    int flags;
+
+    if (!r)
+        return false;
+
+    flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("Error: set O_NONBLOCK in reactor_add_conn()");
+        return false;
+    }
+
+    c = (struct serv_conn*)calloc(1, sizeof(struct serv_conn));
+    if (!c)
+    {
+        perror("Error: calloc serv_conn in reactor_add_conn()");
+        return false;
+    }
+    c->sockfd = sockfd;
+    c->state = TG_CONN_READ;
+    c->events = EPOLLIN;
+    init_payload_ctx(&(c->payload));
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        perror("Error: epoll_ctl() in reactor_add_conn()");
+        free(c);
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&(r->num_conn), 1, memory_order_relaxed);
+    return true;
+}
+
+/* let a reactor accept connections from a non-blocking listening socket */
+bool reactor_add_listener(struct reactor *r, int listen_fd)
+{
+    struct epoll_event ev;
+
+    if (!r || r->listen_fd >= 0)
+        return false;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &(r->listen_fd);
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    {
+        perror("Error: epoll_ctl() in reactor_add_listener()");
+        return false;
+    }
+
+    r->listen_fd = listen_fd;
+    return true;
+}
+
+/* print counters of a reactor */
+void print_reactor(struct reactor *r)
+{
+    if (!r)
+        return;
+
+    printf("Worker %d (CPU %d)  accepted connections: %llu  handed over: %llu  active connections: %llu  flows: %llu\n",
+           r->id, r->cpu,
+           atomic_load_explicit(&(r->num_accept), memory_order_relaxed),
+           atomic_load_explicit(&(r->num_route), memory_order_relaxed),
+           atomic_load_explicit(&(r->num_conn), memory_order_relaxed),
+           atomic_load_explicit(&(r->num_flow), memory_order_relaxed));
+}
+
+/* main loop of a reactor */
+static void *run_reactor(void *ptr)
+{
+    struct reactor *r = (struct reactor*)ptr;
+    struct epoll_event events[TG_REACTOR_MAX_EVENTS];
+    cpu_set_t cpu_set;
+    int i, n;
+
+    if (r->cpu >= 0)
+    {
+        CPU_ZERO(&cpu_set);
+        CPU_SET(r->cpu, &cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+            printf("Error: pin worker %d to CPU %d in run_reactor()\n", r->id, r->cpu);
+    }
+
+    while (true)
+    {
+        n = epoll_wait(r->epoll_fd, events, TG_REACTOR_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error: epoll_wait() in run_reactor()");
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &(r->timer_fd))
+                expire_paced_conns(r);
+            else if (events[i].data.ptr == &(r->listen_fd))
+                accept_conns(r);
+            else
+                handle_conn_event(r, (struct serv_conn*)events[i].data.ptr, events[i].events);
+        }
+
+        /* later events of the batch may still point to connections closed by earlier ones */
+        release_closed_conns(r);
+    }
+
+    return (void*)0;
+}
+
+/* accept all pending connections on the listening socket */
+static void accept_conns(struct reactor *r)
+{
+    struct reactor *dst = NULL;
+    int sockfd;
+
+    while (true)
+    {
+        sockfd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (sockfd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error: accept4() in accept_conns()");
+            break;
+        }
+        atomic_fetch_add_explicit(&(r->num_accept), 1, memory_order_relaxed);
+
+        dst = (r->route_conn) ? r->route_conn(r, sockfd) : NULL;
+        if (!dst)
+            dst = r;
+        else if (dst != r)
+            atomic_fetch_add_explicit(&(r->num_route), 1, memory_order_relaxed);
+
+        if (!reactor_add_conn(dst, sockfd))
+            close(sockfd);
+    }
+}
+
+/* handle an event on a connection */
+static void handle_conn_event(struct reactor *r, struct serv_conn *c, unsigned int events)
+{
+    bool ok = true;
+
+    /* closed by an earlier event of the same batch */
+    if (c->state == TG_CONN_CLOSED)
+        return;
+
+    /* EPOLLERR also reports MSG_ZEROCOPY completions on the error queue */
+    if ((events & EPOLLERR) && !reap_payload_completions(c->sockfd, &(c->payload)))
+        ok = false;
+    else if (c->state == TG_CONN_READ)
+        ok = read_conn(r, c);
+    else if (c->state == TG_CONN_WRITE)
+        ok = write_conn(r, c);
+    /* new requests first, so that their first frames join the round-robin */
+    else if (c->state == TG_CONN_MUX)
+        ok = (!(events & EPOLLIN) || read_conn(r, c)) && (!(events & EPOLLOUT) || write_mux_conn(r, c));
+    /* a paced connection is only reported on errors or hang up */
+    else if (events & EPOLLHUP)
+        ok = false;
+
+    if (!ok)
+        close_conn(r, c);
+}
+
+/* read the flow request and return false if the connection should be closed */
+static bool read_conn(struct reactor *r, struct serv_conn *c)
+{
+    int n = read(c->sockfd, c->meta_buf + c->meta_len, TG_METADATA_SIZE - c->meta_len);
+
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        if (r->verbose)
+            printf("Cannot read metadata from the request\n");
+        return false;
+    }
+
+    c->meta_len += n;
+    if (c->meta_len < TG_METADATA_SIZE)
+        return true;
+
+    decode_flow_metadata(c->meta_buf, &(c->flow));
+    atomic_fetch_add_explicit(&(r->num_flow), 1, memory_order_relaxed);
+    if (r->verbose)
+        printf("Flow request: ID: %u Size: %u bytes ToS: %u Rate: %u Mbps\n", c->flow.id, c->flow.size, c->flow.tos, c->flow.rate);
+
+    /* once a client multiplexes requests on a connection, all its responses are frames */
+    if (c->flow.tos & TG_FLOW_MUX)
+        c->state = (c->state == TG_CONN_READ) ? TG_CONN_MUX : c->state;
+    c->flow.tos &= ~TG_FLOW_MUX;
+
+    if (setsockopt(c->sockfd, IPPROTO_IP, IP_TOS, &(c->flow.tos), sizeof(c->flow.tos)) < 0)
+        printf("Error: set IP_TOS option in read_conn()");
+
+    if (c->state == TG_CONN_MUX)
+        return add_mux_flow(r, c);
+
+    /* let the kernel pace the flow, and remove the rate limit of a previous flow */
+    if (get_pacing_engine() == TG_PACING_KERNEL && (c->flow.rate > 0 || c->payload.kernel_paced))
+        c->payload.kernel_paced = set_pacing_rate(c->sockfd, c->flow.rate) && c->flow.rate > 0;
+
+    /* meta_buf already holds the metadata to echo back */
+    c->meta_len = 0;
+    c->bytes_left = c->flow.size;
+    c->timer.expire_ns = 0;
+    if (!set_conn_state(r, c, TG_CONN_WRITE))
+        return false;
+
+    /* the socket is most likely writable, so don't wait for EPOLLOUT */
+    return write_conn(r, c);
+}
+
+/* write the flow response and return false if the connection should be closed */
+static bool write_conn(struct reactor *r, struct serv_conn *c)
+{
+    enum pacing_engine engine = get_pacing_engine();
+    unsigned int max_per_write = TG_MAX_WRITE;
+    unsigned long long now_ns, gap_ns;
+    int n;
+
+    /* echo back metadata */
+    while (c->meta_len < TG_METADATA_SIZE)
+    {
+        n = write(c->sockfd, c->meta_buf + c->meta_len, TG_METADATA_SIZE - c->meta_len);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return true;
+            if (r->verbose)
+                printf("Cannot generate the response\n");
+            return false;
+        }
+        c->meta_len += n;
+    }
+
+    /* a flow the kernel could not pace falls back to the timer wheel */
+    if (engine == TG_PACING_KERNEL && !c->payload.kernel_paced)
+        engine = TG_PACING_WHEEL;
+
+    /* user-space pacing: small writes with the timer wheel, TG_MIN_WRITE writes as write_exact() otherwise */
+    if (c->flow.rate > 0 && engine == TG_PACING_WHEEL)
+        max_per_write = get_pacing_write(c->flow.rate);
+    else if (c->flow.rate > 0 && engine == TG_PACING_SLEEP)
+        max_per_write = TG_MIN_WRITE;
+
+    if (c->bytes_left > 0)
+    {
+        now_ns = get_mono_ns();
+        if (c->bytes_left == c->flow.size)
+            c->start_ns = now_ns;
+
+        n = write_payload(c->sockfd, &(c->payload), min(c->bytes_left, max_per_write));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return true;
+            if (r->verbose)
+                printf("Cannot generate the response\n");
+            return false;
+        }
+        c->bytes_left -= n;
+
+        if (c->flow.rate > 0 && c->bytes_left > 0 && !c->payload.kernel_paced)
+        {
+            gap_ns = (unsigned long long)n * 8000 / c->flow.rate;
+            /* write_exact() waits n * 8 / rate us after each write */
+            if (engine == TG_PACING_SLEEP || c->timer.expire_ns == 0)
+                c->timer.expire_ns = now_ns + gap_ns;
+            /* follow an absolute schedule so that late wake-ups do not lower the rate (but never burst more than one interval) */
+            else
+                c->timer.expire_ns = max(c->timer.expire_ns, now_ns - TG_PACING_INTERVAL_NS) + gap_ns;
+
+            if (c->timer.expire_ns > get_mono_ns())
+                return set_conn_state(r, c, TG_CONN_PACED);
+        }
+    }
+
+    /* the response is complete, wait for the next request */
+    if (c->bytes_left == 0)
+    {
+        if (c->flow.rate > 0 && c->flow.size > 0)
+            log_pacing_rate(c->sockfd, &(c->flow), get_mono_ns() - c->start_ns);
+        c->meta_len = 0;
+        return set_conn_state(r, c, TG_CONN_READ);
+    }
+
+    return true;
+}
+
+/* serve a request as interleaved frames and return false if the connection should be closed */
+static bool add_mux_flow(struct reactor *r, struct serv_conn *c)
+{
+    struct serv_flow *f = &(c->flows[c->num_flows++]);
+
+    /* the flows share the socket, so rates are not enforced and the ToS is the one of the latest request */
+    f->flow = c->flow;
+    memcpy(f->meta_buf, c->meta_buf, TG_METADATA_SIZE);
+    f->bytes_left = (unsigned long long)TG_METADATA_SIZE + c->flow.size;
+    c->meta_len = 0;
+
+    if (!set_conn_events(r, c, get_mux_events(c)))
+        return false;
+
+    /* the socket is most likely writable, so don't wait for EPOLLOUT */
+    return write_mux_conn(r, c);
+}
+
+/* write frames of the flows of a multiplexed connection and return false if the connection should be closed */
+static bool write_mux_conn(struct reactor *r, struct serv_conn *c)
+{
+    struct serv_flow *f = NULL;
+    struct frame_header h;
+    unsigned long long sent;
+    unsigned int meta_len;
+    unsigned int budget = TG_MAX_WRITE;
+    int n = 0;
+
+    /* like write_conn(), write at most TG_MAX_WRITE bytes per event to keep connections fair */
+    while (c->num_flows > 0 && n >= 0 && (c->frame_len > 0 || budget > 0))
+    {
+        /* start the next frame, the first one of a flow starts with the metadata */
+        if (c->frame_len == 0)
+        {
+            c->frame_flow = c->next_flow % c->num_flows;
+            c->next_flow = c->frame_flow + 1;
+            f = &(c->flows[c->frame_flow]);
+            sent = TG_METADATA_SIZE + f->flow.size - f->bytes_left;
+            h.id = f->flow.id;
+            h.len = min(f->bytes_left, TG_FRAME_MAX_LEN);
+            meta_len = (sent < TG_METADATA_SIZE) ? min(TG_METADATA_SIZE - sent, h.len) : 0;
+            encode_frame_header(c->frame_buf, &h);
+            memcpy(c->frame_buf + TG_FRAME_HEADER_SIZE, f->meta_buf + sent, meta_len);
+            c->frame_len = TG_FRAME_HEADER_SIZE + meta_len;
+            c->frame_off = 0;
+            c->frame_payload = h.len - meta_len;
+            f->bytes_left -= h.len;
+            budget -= min(budget, h.len);
+        }
+
+        while (c->frame_off < c->frame_len && (n = write(c->sockfd, c->frame_buf + c->frame_off, c->frame_len - c->frame_off)) >= 0)
+            c->frame_off += n;
+        while (c->frame_off == c->frame_len && c->frame_payload > 0 && (n = write_payload(c->sockfd, &(c->payload), c->frame_payload)) >= 0)
+            c->frame_payload -= n;
+        if (n < 0)
+            break;
+
+        /* the frame is complete, and so is its flow if nothing is left */
+        c->frame_len = 0;
+        if (c->flows[c->frame_flow].bytes_left == 0)
+        {
+            c->flows[c->frame_flow] = c->flows[--c->num_flows];
+            c->next_flow = c->frame_flow;
+        }
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        if (r->verbose)
+            printf("Cannot generate the response\n");
+        return false;
+    }
+
+    return set_conn_events(r, c, get_mux_events(c));
+}
+
+/* epoll events of a multiplexed connection: new requests while it has room, writes while it has flows */
+static unsigned int get_mux_events(struct serv_conn *c)
+{
+    return ((c->num_flows < TG_MAX_DEPTH) ? EPOLLIN : 0) | ((c->num_flows > 0) ? EPOLLOUT : 0);
+}
+
+/* switch a connection to a new state */
+static bool set_conn_state(struct reactor *r, struct serv_conn *c, enum serv_conn_state state)
+{
+    unsigned int events;
+
+    if (c->state == state)
+        return true;
+
+    if (state == TG_CONN_READ)
+        events = EPOLLIN;
+    else if (state == TG_CONN_WRITE)
+        events = EPOLLOUT;
+    /* a paced connection only listens to errors until its next write */
+    else
+        events = 0;
+
+    if (!set_conn_events(r, c, events))
+        return false;
+
+    if (c->state == TG_CONN_PACED)
+        timer_wheel_del(&(r->wheel), &(c->timer));
+
+    if (state == TG_CONN_PACED)
+    {
+        timer_wheel_add(&(r->wheel), &(c->timer));
+        arm_reactor_timer(r, c->timer.expire_ns);
+    }
+
+    c->state = state;
+    return true;
+}
+
+/* update the epoll events of a connection */
+static bool set_conn_events(struct reactor *r, struct serv_conn *c, unsigned int events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events)
+        return true;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->sockfd, &ev) < 0)
+    {
+        perror("Error: epoll_ctl() in set_conn_events()");
+        return false;
+    }
+
+    c->events = events;
+    return true;
+}
+
+/* wake up paced connections whose next write time has come */
+static void expire_paced_conns(struct reactor *r)
+{
+    unsigned long long expirations;
+    struct wheel_entry *e = NULL;
+    struct wheel_entry *next = NULL;
+    struct serv_conn *c = NULL;
+
+    /* drain the timer */
+    if (read(r->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("Error: read timer_fd in expire_paced_conns()");
+
+    r->timer_ns = 0;
+    for (e = timer_wheel_expire(&(r->wheel), get_mono_ns()); e; e = next)
+    {
+        next = e->next;
+        c = (struct serv_conn*)((char*)e - offsetof(struct serv_conn, timer));
+        /* the socket is most likely writable, so don't wait for EPOLLOUT */
+        if (!set_conn_state(r, c, TG_CONN_WRITE) || !write_conn(r, c))
+            close_conn(r, c);
+    }
+
+    arm_reactor_timer(r, timer_wheel_next(&(r->wheel)));
+}
+
+/* arm the timer of a reactor if 'expire_ns' is earlier than its current expiration time */
+static void arm_reactor_timer(struct reactor *r, unsigned long long expire_ns)
+{
+    struct itimerspec its;
+
+    if (expire_ns == 0 || (r->timer_ns > 0 && r->timer_ns <= expire_ns))
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = expire_ns / 1000000000;
+    its.it_value.tv_nsec = expire_ns % 1000000000;
+    if (timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("Error: timerfd_settime() in arm_reactor_timer()");
+    else
+        r->timer_ns = expire_ns;
+}
+
+/* close a connection, its state is released by release_closed_conns() */
+static void close_conn(struct reactor *r, struct serv_conn *c)
+{
+    if (c->state == TG_CONN_CLOSED)
+        return;
+
+    if (c->state == TG_CONN_PACED)
+        timer_wheel_del(&(r->wheel), &(c->timer));
+
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+    close(c->sockfd);
+    c->state = TG_CONN_CLOSED;
+    c->next_closed = r->closed;
+    r->closed = c;
+    atomic_fetch_sub_explicit(&(r->num_conn), 1, memory_order_relaxed);
+}
+
+/* release the state of the connections closed during a batch of events */
+static void release_closed_conns(struct reactor *r)
+{
+    struct serv_conn *c = NULL;
+
+    while (r->closed)
+    {
+        c = r->closed;
+        r->closed = c->next_closed;
+        free_payload_ctx(&(c->payload));
+        free(c);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "../common/common.h"
+#include "../common/payload.h"
+#include "../common/pacing.h"
+
+/* maximum number of events returned by one epoll_wait() call */
+#define TG_REACTOR_MAX_EVENTS 64
+
+/* state of a connection served by a reactor */
+enum serv_conn_state
+{
+    TG_CONN_READ,   /* waiting for (the rest of) a flow request */
+    TG_CONN_WRITE,  /* writing the flow response */
+    TG_CONN_PACED,  /* rate-limited flow waiting for its next write */
+    TG_CONN_MUX,    /* reading requests and writing interleaved frames of their responses */
+    TG_CONN_CLOSED  /* closed, released after the current batch of events */
+};
+
+/* a flow served on a multiplexed connection */
+struct serv_flow
+{
+    struct flow_metadata flow;  /* flow request */
+    char meta_buf[TG_METADATA_SIZE];    /* metadata to echo back */
+    unsigned long long bytes_left;  /* bytes of metadata and payload left to put into frames (may exceed UINT_MAX) */
+};
+
+struct serv_conn
+{
+    int sockfd; /* socket */
+    enum serv_conn_state state; /* current state */
+    char meta_buf[TG_METADATA_SIZE];    /* metadata of the flow request */
+    unsigned int meta_len;  /* bytes of metadata read (TG_CONN_READ) or echoed (otherwise) */
+    struct flow_metadata flow;  /* flow being served */
+    unsigned int bytes_left;    /* payload bytes left to write */
+    unsigned long long start_ns;    /* time of the first payload write */
+    struct wheel_entry timer;   /* time of the next write (rate-limited flows) */
+    struct payload_ctx payload; /* state of the payload path */
+    unsigned int events;    /* epoll events the connection waits for */
+    struct serv_flow flows[TG_MAX_DEPTH];   /* flows being served (TG_CONN_MUX) */
+    unsigned int num_flows; /* number of flows being served (TG_CONN_MUX) */
+    unsigned int next_flow; /* flow of the next frame, round-robin (TG_CONN_MUX) */
+    unsigned int frame_flow;    /* flow of the frame being written (TG_CONN_MUX) */
+    char frame_buf[TG_FRAME_HEADER_SIZE + TG_METADATA_SIZE];    /* header (and metadata) of the frame being written */
+    unsigned int frame_len; /* bytes in frame_buf (0: no frame being written) */
+    unsigned int frame_off; /* bytes of frame_buf written */
+    unsigned int frame_payload; /* payload bytes of the frame left to write */
+    struct serv_conn *next_closed;  /* next closed connection to release (TG_CONN_CLOSED) */
+};
+
+/* an epoll event loop serving many connections from one worker thread */
+struct reactor
+{
+    int id; /* reactor ID */
+    int epoll_fd;   /* epoll instance */
+    int timer_fd;   /* timer to wake up paced connections */
+    unsigned long long timer_ns;    /* expiration time of timer_fd (0 if disarmed) */
+    struct timer_wheel wheel;   /* rate-limited connections waiting for their next write */
+    struct serv_conn *closed;   /* connections closed during the current batch of events */
+    int listen_fd;  /* listening socket owned by this reactor (-1 if none) */
+    int cpu;    /* CPU to pin the worker thread to (-1 if not pinned) */
+    /* pick the reactor to serve a connection accepted on listen_fd (NULL: serve it locally) */
+    struct reactor *(*route_conn)(struct reactor *r, int sockfd);
+    pthread_t thread;   /* worker thread */
+    bool verbose;   /* give more detailed output */
+
+    atomic_ullong num_accept;   /* connections accepted on listen_fd */
+    atomic_ullong num_route;    /* accepted connections handed over to other reactors */
+    atomic_ullong num_conn; /* connections currently served */
+    atomic_ullong num_flow; /* flows served */
+};
+
+/* initialize a reactor */
+bool init_reactor(struct reactor *r, int id, bool verbose);
+
+/* start the worker thread of a reactor */
+bool start_reactor(struct reactor *r);
+
+/* hand an accepted connection over to a reactor */
+bool reactor_add_conn(struct reactor *r, int sockfd);
+
+/* let a reactor accept connections from a non-blocking listening socket */
+bool reactor_add_listener(struct reactor *r, int listen_fd);
+
+/* print counters of a reactor */
+void print_reactor(struct reactor *r);
+
+#endif
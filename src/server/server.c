@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
@@ -13,16 +18,36 @@
 #include <pthread.h>
 
 #include "../common/common.h"
+#include "../common/payload.h"
+#include "../common/pacing.h"
+#include "reactor.h"
 
 int server_port = TG_SERVER_PORT;
 unsigned int sleep_overhead_us = 50;
 bool verbose_mode = false;  /* by default, we don't give more detailed output */
 bool daemon_mode = false;   /* by default, we don't run the server as a daemon */
+unsigned int num_workers = 0;   /* number of event-driven worker threads (0: one thread per connection) */
+unsigned int num_shards = 0;    /* number of SO_REUSEPORT listeners with their own CPU-pinned workers */
+bool incoming_cpu_mode = false; /* keep accepted connections on the worker pinned to their SO_INCOMING_CPU */
+enum payload_mode payload_mode = TG_PAYLOAD_COPY;  /* how to write the payload of flows */
+enum pacing_engine pacing_engine = TG_PACING_AUTO;  /* how to enforce the rate of rate-limited flows */
+char rate_log_name[80] = {0};   /* log of requested and achieved rates (empty: no log) */
+struct reactor *reactors = NULL;    /* event loops of worker threads */
+unsigned int num_reactors = 0;  /* number of event loops */
+int cpu_reactor[CPU_SETSIZE];   /* index of the worker pinned to each CPU (-1 if none) */
 
 /* print usage of the program */
 void print_usage(char *program);
 /* read command line arguments */
 void read_args(int argc, char *argv[]);
+/* create a socket listening on server_port */
+int create_listen_socket(bool reuse_port);
+/* create SO_REUSEPORT listeners and workers of all shards */
+void init_shards(int *listen_fds);
+/* keep an accepted connection on the worker pinned to its incoming CPU */
+struct reactor *route_incoming_cpu(struct reactor *r, int sockfd);
+/* print counters on SIGUSR1 and exit on SIGINT / SIGTERM */
+void *wait_signals(void *ptr);
 /* handle an incomming connection */
 void* handle_connection(void* ptr);
 /* get usleep overhead in microsecond (us) */
@@ -31,13 +56,16 @@ unsigned int get_sleep_overhead(int iter_num);
 int main(int argc, char *argv[])
 {
     pid_t pid, sid;
-    int listen_fd;
-    struct sockaddr_in serv_addr;   /* local server address */
+    int listen_fd = -1;
+    int *listen_fds = NULL; /* listening sockets of shards */
     struct sockaddr_in cli_addr;    /* remote client address */
-    int sock_opt = 1;
     pthread_t serv_thread;  /* server thread */
+    pthread_t signal_thread;    /* thread to report counters upon signals */
     int* sockfd_ptr = NULL;
     socklen_t len = sizeof(struct sockaddr_in);
+    unsigned int i = 0;
+    unsigned long long num_accept = 0;  /* number of accepted connections */
+    sigset_t signals;
 
     /* read arguments */
     read_args(argc, argv);
@@ -47,30 +75,31 @@ int main(int argc, char *argv[])
     if (verbose_mode)
         printf("usleep() overhead is around %u us\n", sleep_overhead_us);
 
-    /* initialize local server address */
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;    
-    serv_addr.sin_port = htons(server_port);
-
-    /* initialize server socket */
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0)
-        error("Error: initialize socket");
-
-    /* set socket options */
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt)) < 0)
-        error("Error: set SO_REUSEADDR option");
-    if (setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt)) < 0)
-        error("ERROR: set TCP_NODELAY option");
+    if (!init_payload(payload_mode))
+        error("Error: init_payload");
 
-    if (bind(listen_fd,(struct sockaddr *)&serv_addr,sizeof(struct sockaddr)) < 0)
-        error("Error: bind");
+    pacing_engine = init_pacing(pacing_engine, num_workers > 0 || num_shards > 0, rate_log_name, verbose_mode);
 
-    if (listen(listen_fd, TG_SERVER_BACKLOG_CONN) < 0)
-        error("Error: listen");
+    if (num_shards == 0)
+    {
+        listen_fd = create_listen_socket(false);
+        printf("Traffic Generator Server listens on 0.0.0.0:%d\n", server_port);
+    }
+    /* bind all listeners before daemonizing so that errors are reported */
+    else
+    {
+        listen_fds = (int*)calloc(num_shards, sizeof(int));
+        if (!listen_fds)
+            error("Error: calloc listen_fds");
 
-    printf("Traffic Generator Server listens on 0.0.0.0:%d\n", server_port);
+        for (i = 0; i < num_shards; i++)
+        {
+            listen_fds[i] = create_listen_socket(true);
+            if (fcntl(listen_fds[i], F_SETFL, fcntl(listen_fds[i], F_GETFL, 0) | O_NONBLOCK) < 0)
+                error("Error: set O_NONBLOCK option");
+        }
+        printf("Traffic Generator Server listens on 0.0.0.0:%d with %u SO_REUSEPORT listeners\n", server_port, num_shards);
+    }
 
     /* if we run the server as a daemon */
     if (daemon_mode)
@@ -106,6 +135,53 @@ int main(int argc, char *argv[])
         close(STDERR_FILENO);
     }
 
+    /* block signals before creating other threads so that only wait_signals() receives them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /* each shard accepts and serves its own connections, the main thread only reports counters */
+    if (num_shards > 0)
+    {
+        init_shards(listen_fds);
+        wait_signals((void*)&signals);
+    }
+    else if (pthread_create(&signal_thread, NULL, wait_signals, (void*)&signals) != 0)
+        error("Error: create pthread");
+
+    /* start event-driven worker threads after daemonizing */
+    if (num_workers > 0)
+    {
+        reactors = (struct reactor*)calloc(num_workers, sizeof(struct reactor));
+        if (!reactors)
+            error("Error: calloc reactors");
+
+        for (i = 0; i < num_workers; i++)
+        {
+            if (!init_reactor(&reactors[i], i, verbose_mode) || !start_reactor(&reactors[i]))
+                error("Error: start reactor");
+        }
+        num_reactors = num_workers;
+
+        if (verbose_mode)
+            printf("Serve connections with %u event-driven worker threads\n", num_workers);
+    }
+
+    /* distribute connections to worker threads in a round-robin fashion */
+    while (num_workers > 0)
+    {
+        int sockfd = accept(listen_fd, (struct sockaddr *)&cli_addr, &len);
+        if (sockfd < 0)
+        {
+            close(listen_fd);
+            error("Error: accept");
+        }
+        else if (!reactor_add_conn(&reactors[num_accept++ % num_workers], sockfd))
+            close(sockfd);
+    }
+
     while (1)
     {
         sockfd_ptr = (int*)malloc(sizeof(int));
@@ -130,13 +206,152 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+/* create a socket listening on server_port */
+int create_listen_socket(bool reuse_port)
+{
+    int listen_fd;
+    struct sockaddr_in serv_addr;   /* local server address */
+    int sock_opt = 1;
+
+    /* initialize local server address */
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(server_port);
+
+    /* initialize server socket */
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        error("Error: initialize socket");
+
+    /* set socket options */
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt)) < 0)
+        error("Error: set SO_REUSEADDR option");
+    if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &sock_opt, sizeof(sock_opt)) < 0)
+        error("Error: set SO_REUSEPORT option");
+    if (setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt)) < 0)
+        error("ERROR: set TCP_NODELAY option");
+
+    if (bind(listen_fd,(struct sockaddr *)&serv_addr,sizeof(struct sockaddr)) < 0)
+        error("Error: bind");
+
+    if (listen(listen_fd, TG_SERVER_BACKLOG_CONN) < 0)
+        error("Error: listen");
+
+    return listen_fd;
+}
+
+/* create SO_REUSEPORT listeners and workers of all shards */
+void init_shards(int *listen_fds)
+{
+    cpu_set_t cpu_set;
+    int cpus[CPU_SETSIZE];  /* CPUs this process may run on */
+    int num_cpu = 0;
+    unsigned int i = 0;
+
+    CPU_ZERO(&cpu_set);
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) < 0)
+        error("Error: sched_getaffinity");
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+    {
+        cpu_reactor[i] = -1;
+        if (CPU_ISSET(i, &cpu_set))
+            cpus[num_cpu++] = i;
+    }
+
+    reactors = (struct reactor*)calloc(num_shards, sizeof(struct reactor));
+    if (!reactors)
+        error("Error: calloc reactors");
+
+    for (i = 0; i < num_shards; i++)
+    {
+        if (!init_reactor(&reactors[i], i, verbose_mode))
+            error("Error: init reactor");
+
+        /* pin shards to CPUs in a round-robin fashion */
+        reactors[i].cpu = cpus[i % num_cpu];
+        if (cpu_reactor[reactors[i].cpu] < 0)
+            cpu_reactor[reactors[i].cpu] = i;
+
+        if (incoming_cpu_mode)
+        {
+            /* prefer this listener for SYNs processed on its CPU */
+            if (setsockopt(listen_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &(reactors[i].cpu), sizeof(reactors[i].cpu)) < 0)
+                perror("Error: set SO_INCOMING_CPU option");
+            reactors[i].route_conn = route_incoming_cpu;
+        }
+
+        if (!reactor_add_listener(&reactors[i], listen_fds[i]))
+            error("Error: add listener to reactor");
+    }
+
+    num_reactors = num_shards;
+
+    /* start workers only after the CPU map is complete */
+    for (i = 0; i < num_shards; i++)
+    {
+        if (!start_reactor(&reactors[i]))
+            error("Error: start reactor");
+    }
+
+    if (verbose_mode)
+    {
+        for (i = 0; i < num_shards; i++)
+            printf("Shard %u: listening socket %d on CPU %d\n", i, listen_fds[i], reactors[i].cpu);
+    }
+}
+
+/* keep an accepted connection on the worker pinned to its incoming CPU */
+struct reactor *route_incoming_cpu(struct reactor *r, int sockfd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0 || cpu >= CPU_SETSIZE)
+        return NULL;
+
+    if (cpu_reactor[cpu] < 0)
+        return NULL;
+
+    return &reactors[cpu_reactor[cpu]];
+}
+
+/* print counters on SIGUSR1 and exit on SIGINT / SIGTERM */
+void *wait_signals(void *ptr)
+{
+    sigset_t *signals = (sigset_t*)ptr;
+    unsigned int i = 0;
+    int sig;
+
+    while (true)
+    {
+        if (sigwait(signals, &sig) != 0)
+            continue;
+
+        printf("===========================================\n");
+        for (i = 0; i < num_reactors; i++)
+            print_reactor(&reactors[i]);
+        print_payload_stats();
+        print_pacing_stats();
+        printf("===========================================\n");
+        fflush(stdout);
+
+        if (sig != SIGUSR1)
+            exit(EXIT_SUCCESS);
+    }
+}
+
 /* handle an incomming connection */
 void* handle_connection(void* ptr)
 {
     struct flow_metadata flow;
+    struct payload_ctx payload;
     int sockfd = *(int*)ptr;
     free(ptr);
 
+    init_payload_ctx(&payload);
+
     while (1)
     {
         /* read meta data from the request */
@@ -150,8 +365,9 @@ void* handle_connection(void* ptr)
         if (verbose_mode)
             printf("Flow request: ID: %u Size: %u bytes ToS: %u Rate: %u Mbps\n", flow.id, flow.size, flow.tos, flow.rate);
 
-        /* generate the flow response */
-        if (!write_flow(sockfd, &flow, sleep_overhead_us))
+        /* generate the flow response, as frames if the client multiplexes requests (one at a time in this mode) */
+        if (!((flow.tos & TG_FLOW_MUX) ? write_flow_frames(sockfd, &flow, &payload) :
+                                         write_flow(sockfd, &flow, &payload, sleep_overhead_us)))
         {
             if (verbose_mode)
                 printf("Cannot generate the response\n");
@@ -160,6 +376,7 @@ void* handle_connection(void* ptr)
     }
 
     close(sockfd);
+    free_payload_ctx(&payload);
     return (void*)0;
 }
 
@@ -170,6 +387,13 @@ void print_usage(char *program)
     printf("-p <port>   port number (default %d)\n", TG_SERVER_PORT);
     printf("-v          give more detailed output (verbose)\n");
     printf("-d          run the server as a daemon\n");
+    printf("-w <num>    serve connections with <num> event-driven worker threads\n");
+    printf("            (default 0: one thread per connection)\n");
+    printf("-s <num>    open <num> SO_REUSEPORT listeners, each with its own CPU-pinned worker\n");
+    printf("-i          keep accepted connections on the worker of their SO_INCOMING_CPU (with -s)\n");
+    printf("-z <mode>   how to write the payload: copy, sendfile, splice or zerocopy (default copy)\n");
+    printf("-P <engine> how to pace rate-limited flows: auto, sleep, kernel or wheel (default auto)\n");
+    printf("-l <file>   log requested and achieved rates of rate-limited flows\n");
     printf("-h          display help information\n");
 }
 
@@ -207,6 +431,79 @@ void read_args(int argc, char *argv[])
             daemon_mode = true;
             i += 1;
         }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-w") == 0)
+        {
+            if (i+1 < argc)
+            {
+                num_workers = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            /* cannot read number of worker threads */
+            else
+            {
+                printf("Cannot read number of worker threads\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-s") == 0)
+        {
+            if (i+1 < argc)
+            {
+                num_shards = (unsigned int)strtoul(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            /* cannot read number of shards */
+            else
+            {
+                printf("Cannot read number of listeners\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-z") == 0)
+        {
+            if (i+1 < argc && parse_payload_mode(argv[i+1], &payload_mode))
+                i += 2;
+            /* cannot read payload mode */
+            else
+            {
+                printf("Cannot read payload mode\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-P") == 0)
+        {
+            if (i+1 < argc && parse_pacing_engine(argv[i+1], &pacing_engine))
+                i += 2;
+            /* cannot read pacing engine */
+            else
+            {
+                printf("Cannot read pacing engine\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-l") == 0)
+        {
+            if (i+1 < argc && strlen(argv[i+1]) < sizeof(rate_log_name))
+            {
+                sprintf(rate_log_name, "%s", argv[i+1]);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read log file name\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-i") == 0)
+        {
+            incoming_cpu_mode = true;
+            i += 1;
+        }
         else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-h") == 0)
         {
             print_usage(argv[0]);
@@ -219,4 +516,18 @@ void read_args(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
     }
+
+    if (num_shards > 0 && num_workers > 0)
+    {
+        printf("You cannot specify both worker threads (-w) and SO_REUSEPORT listeners (-s)\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (incoming_cpu_mode && num_shards == 0)
+    {
+        printf("You need to specify SO_REUSEPORT listeners (-s) to use SO_INCOMING_CPU (-i)\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 }
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "../common/log_format.h"
+#include "../common/log_reader.h"
+
+char input_name[80] = {0};  /* binary log to read */
+char output_name[80] = {0}; /* text log to write (default stdout) */
+bool summary_mode = false;  /* print a summary instead of converting */
+enum log_format text_format = TG_LOG_TEXT;  /* format of the text log */
+struct log_range range = {0, 0, -1};    /* records to keep */
+
+/* print usage of the program */
+void print_usage(char *program);
+/* read command line arguments */
+void read_args(int argc, char *argv[]);
+/* print a summary of the records in the range */
+void print_summary(struct log_reader *r);
+
+int main(int argc, char *argv[])
+{
+    struct log_reader reader;
+    struct log_record *rec = NULL;
+    unsigned long long i = 0;
+    FILE *fd = stdout;
+
+    read_args(argc, argv);
+
+    if (!open_log_reader(&reader, input_name))
+        exit(EXIT_FAILURE);
+
+    if (summary_mode)
+    {
+        print_summary(&reader);
+        close_log_reader(&reader);
+        return 0;
+    }
+
+    if (strlen(output_name) > 0 && !(fd = fopen(output_name, "w")))
+    {
+        close_log_reader(&reader);
+        error("Error: open the output file");
+    }
+
+    /* same lines as a text log of the client */
+    for (i = 0; i < reader.num_records; i++)
+    {
+        rec = get_log_record(&reader, i);
+        if (log_range_filter(rec, &range))
+            write_log_record(fd, rec, text_format, reader.header->kind);
+    }
+
+    if (fd != stdout)
+        fclose(fd);
+    close_log_reader(&reader);
+    return 0;
+}
+
+/* print a summary of the records in the range */
+void print_summary(struct log_reader *r)
+{
+    struct log_summary s;
+    const char *name = (r->header->kind == TG_LOG_REQUEST) ? "requests" : "flows";
+
+    summarize_log(r, log_range_filter, &range, &s);
+    printf("%llu of %llu %s in the range\n", s.num, r->num_records, name);
+    if (s.num == 0)
+        return;
+
+    printf("Average size: %llu bytes\n", s.size_total / s.num);
+    printf("Average completion time: %llu us\n", s.fct_us_total / s.num);
+    printf("Median completion time: %llu us\n", percentile_log(r, log_range_filter, &range, 0.5));
+    printf("99th percentile completion time: %llu us\n", percentile_log(r, log_range_filter, &range, 0.99));
+    printf("Maximum completion time: %llu us\n", s.fct_us_max);
+    printf("Average goodput: %llu Mbps\n", s.goodput_total / s.num);
+    printf("Average time to first byte: %llu us\n", s.ttfb_us_total / s.num);
+    if (r->header->kind == TG_LOG_REQUEST)
+    {
+        printf("Average dispatch delay after arrival: %llu us\n", s.wait_us_total / s.num);
+        printf("Average send skew: %.3f us\n", (double)s.skew_ns_total / s.num / 1000);
+    }
+    else
+        printf("Average wait for a connection: %llu us\n", s.wait_us_total / s.num);
+}
+
+/* print usage of the program */
+void print_usage(char *program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("-i <file>       binary FCT/RCT log (required)\n");
+    printf("-o <file>       write the text log to a file (default standard output)\n");
+    printf("-n              add the completion time in ns as the last column of the text log\n");
+    printf("-e              also add TTFB, transfer time, wait and send skew before it (as -o text-ext)\n");
+    printf("-s              print a summary instead of the text log\n");
+    printf("-d <dscp>       only flows/requests with this DSCP\n");
+    printf("-a <bytes>      only flows/requests of at least this size\n");
+    printf("-z <bytes>      only flows/requests smaller than this size\n");
+    printf("-h              display help information\n");
+}
+
+/* read command line arguments */
+void read_args(int argc, char *argv[])
+{
+    int i = 1;
+
+    if (argc == 1)
+    {
+        print_usage(argv[0]);
+        exit(EXIT_SUCCESS);
+    }
+
+    while (i < argc)
+    {
+        if (strlen(argv[i]) == 2 && strcmp(argv[i], "-i") == 0)
+        {
+            if (i+1 < argc && strlen(argv[i+1]) < sizeof(input_name))
+            {
+                strcpy(input_name, argv[i+1]);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read input file name\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-o") == 0)
+        {
+            if (i+1 < argc && strlen(argv[i+1]) < sizeof(output_name))
+            {
+                strcpy(output_name, argv[i+1]);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read output file name\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-n") == 0)
+        {
+            text_format = (text_format == TG_LOG_TEXT_EXT) ? TG_LOG_TEXT_EXT : TG_LOG_TEXT_NS;
+            i++;
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-e") == 0)
+        {
+            text_format = TG_LOG_TEXT_EXT;
+            i++;
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-s") == 0)
+        {
+            summary_mode = true;
+            i++;
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-d") == 0)
+        {
+            if (i+1 < argc)
+            {
+                range.dscp = atoi(argv[i+1]);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read DSCP\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-a") == 0)
+        {
+            if (i+1 < argc)
+            {
+                range.min_size = strtoull(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read minimum size\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-z") == 0)
+        {
+            if (i+1 < argc)
+            {
+                range.max_size = strtoull(argv[i+1], NULL, 10);
+                i += 2;
+            }
+            else
+            {
+                printf("Cannot read maximum size\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strlen(argv[i]) == 2 && strcmp(argv[i], "-h") == 0)
+        {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else
+        {
+            printf("Invalid option %s\n", argv[i]);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (strlen(input_name) == 0)
+    {
+        printf("You need to specify the binary log (-i)\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}